@@ -0,0 +1,1021 @@
+// Microbenchmarks for storage backends, joins, entities, events and queries.
+//
+// Every result is printed as one JSON object per line (or CSV with --csv) so
+// that runs can be diffed and plotted by scripts.
+//
+// Usage: bench [--sizes 1000,10000,...] [--density 0.5] [--backend name]
+//              [--csv]
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "compact_hash_table.h"
+#include "component.h"
+#include "component_index.h"
+#include "entity.h"
+#include "entity_set.h"
+#include "event.h"
+#include "hash_table.h"
+#include "hibernate.h"
+#include "hierarchy.h"
+#include "segmented_hash_table.h"
+#include "spatial.h"
+#include "system.h"
+
+struct bench_value {
+  float x, y, z, w;
+};
+
+// Storage backends
+//
+// Each backend is a table keyed by entity id holding a `struct bench_value`,
+// the table scenarios only talk to them through this interface so any new
+// storage can be compared head to head by adding an entry to `backends`.
+
+struct bench_backend {
+  const char *const name;
+  void *(*const new)(void);
+  void (*const free)(void *table);
+  void (*const insert)(void *table, uint32_t k, struct bench_value v);
+  struct bench_value *(*const lookup)(void *table, uint32_t k);
+  bool (*const delete)(void *table, uint32_t k);
+  // sum a field of every value, to measure a full table scan
+  float (*const scan)(void *table);
+  // count visits to every key in `seen` while iterating, deleting the even
+  // keys as they are visited and the key after each multiple of 4
+  void (*const sweep)(void *table, uint8_t *seen);
+  // a table that never grows, on storage sized the way ECS_STATIC_STORAGE
+  // sizes it and allocated along with the table so `free` releases both
+  void *(*const new_fixed)(uint32_t max_elems);
+  // insert and lookup may be called from several threads at once
+  const bool thread_safe;
+};
+
+#define BENCH_HASH_TABLE_BACKEND(NAME, THREAD_SAFE)                            \
+  static void *bench_##NAME##_new(void) { return hash_table_##NAME##_new(); }  \
+  static void bench_##NAME##_free(void *table) {                               \
+    hash_table_##NAME##_free(table);                                           \
+  }                                                                            \
+  static void bench_##NAME##_insert(void *table, uint32_t k,                   \
+                                    struct bench_value v) {                    \
+    hash_table_##NAME##_insert(table, k, v);                                   \
+  }                                                                            \
+  static struct bench_value *bench_##NAME##_lookup(void *table, uint32_t k) {  \
+    return hash_table_##NAME##_lookup(table, k);                               \
+  }                                                                            \
+  static bool bench_##NAME##_delete(void *table, uint32_t k) {                 \
+    return hash_table_##NAME##_delete(table, k);                               \
+  }                                                                            \
+  static float bench_##NAME##_scan(void *table) {                              \
+    float sum = 0;                                                             \
+    HASH_TABLE_ITER(NAME, k, v, (struct hash_table_##NAME *)table,             \
+                    { (void)k; sum += v->x; });                                \
+    return sum;                                                                \
+  }                                                                            \
+  static void bench_##NAME##_sweep(void *table, uint8_t *seen) {               \
+    HASH_TABLE_ITER(NAME, k, v, (struct hash_table_##NAME *)table, {           \
+      (void)v;                                                                 \
+      seen[k]++;                                                               \
+      if (k % 2 == 0) {                                                        \
+        hash_table_##NAME##_delete(table, k);                                  \
+      }                                                                        \
+      if (k % 4 == 0) {                                                        \
+        hash_table_##NAME##_delete(table, k + 1);                              \
+      }                                                                        \
+    });                                                                        \
+  }                                                                            \
+  struct bench_##NAME##_fixed {                                                \
+    struct hash_table_##NAME table;                                            \
+    struct hash_table_##NAME##_elem elems[];                                   \
+  };                                                                           \
+  static void *bench_##NAME##_new_fixed(uint32_t max_elems) {                  \
+    uint32_t cap = HASH_TABLE_SLOTS_FOR(max_elems);                            \
+    size_t elems_size = sizeof(struct hash_table_##NAME##_elem) * cap;         \
+    struct bench_##NAME##_fixed *f =                                           \
+        calloc(1, sizeof(*f) + elems_size + BIT_ARRAY_NUM_BYTES(cap));         \
+    hash_table_##NAME##_init_fixed(&f->table, f->elems,                        \
+                                   (uint8_t *)f->elems + elems_size, cap,      \
+                                   max_elems);                                 \
+    return &f->table;                                                          \
+  }                                                                            \
+  static const struct bench_backend bench_##NAME##_backend = {                 \
+      .name = #NAME,                                                           \
+      .new = &bench_##NAME##_new,                                              \
+      .free = &bench_##NAME##_free,                                            \
+      .insert = &bench_##NAME##_insert,                                        \
+      .lookup = &bench_##NAME##_lookup,                                        \
+      .delete = &bench_##NAME##_delete,                                        \
+      .scan = &bench_##NAME##_scan,                                            \
+      .sweep = &bench_##NAME##_sweep,                                          \
+      .new_fixed = &bench_##NAME##_new_fixed,                                  \
+      .thread_safe = THREAD_SAFE};
+
+DEFINE_HASH(struct bench_value, robin_hood);
+MAKE_HASH(struct bench_value, robin_hood);
+BENCH_HASH_TABLE_BACKEND(robin_hood, false);
+
+DEFINE_CONCURRENT_HASH(struct bench_value, concurrent);
+MAKE_CONCURRENT_HASH(struct bench_value, concurrent);
+BENCH_HASH_TABLE_BACKEND(concurrent, true);
+
+DEFINE_SEGMENTED_HASH(struct bench_value, segmented);
+MAKE_SEGMENTED_HASH(struct bench_value, segmented);
+BENCH_HASH_TABLE_BACKEND(segmented, false);
+
+DEFINE_COMPACT_HASH(struct bench_value, compact);
+MAKE_COMPACT_HASH(struct bench_value, compact);
+BENCH_HASH_TABLE_BACKEND(compact, false);
+
+// The same table backed by a huge page arena, released in one go
+static struct ecs_arena *bench_arena;
+
+static void *bench_robin_hood_arena_new(void) {
+  bench_arena = ecs_arena_new(&(struct ecs_arena_opts){
+      .chunk_size = 2 * 1024 * 1024,
+      .large_threshold = 256 * 1024,
+      .huge_pages = true});
+
+  struct ecs_allocator *old =
+      ecs_set_allocator(ecs_arena_allocator(bench_arena));
+  void *table = hash_table_robin_hood_new();
+  ecs_set_allocator(old);
+
+  return table;
+}
+
+static void bench_robin_hood_arena_free(void *table) {
+  ecs_arena_release(bench_arena);
+}
+
+static const struct bench_backend bench_robin_hood_arena_backend = {
+    .name = "robin_hood_arena",
+    .new = &bench_robin_hood_arena_new,
+    .free = &bench_robin_hood_arena_free,
+    .insert = &bench_robin_hood_insert,
+    .lookup = &bench_robin_hood_lookup,
+    .delete = &bench_robin_hood_delete,
+    .scan = &bench_robin_hood_scan,
+    .sweep = &bench_robin_hood_sweep,
+    .new_fixed = &bench_robin_hood_new_fixed,
+    .thread_safe = false};
+
+static const struct bench_backend *const backends[] = {
+    &bench_robin_hood_backend,
+    &bench_robin_hood_arena_backend,
+    &bench_concurrent_backend,
+    &bench_segmented_backend,
+    &bench_compact_backend,
+};
+
+static const uint32_t bench_num_threads = 4;
+
+// Components and systems for the world scenarios
+
+DEFINE_COMPONENT(bench_position, struct bench_value);
+REGISTER_COMPONENT(bench_position, struct bench_value);
+
+DEFINE_COMPONENT(bench_velocity, struct bench_value);
+REGISTER_COMPONENT(bench_velocity, struct bench_value);
+
+DEFINE_COMPONENT(bench_health, float);
+REGISTER_COMPONENT(bench_health, float);
+
+struct bench_owner {
+  uint32_t player_id;
+};
+
+DEFINE_COMPONENT(bench_owner, struct bench_owner);
+REGISTER_COMPONENT(bench_owner, struct bench_owner);
+DEFINE_COMPONENT_INDEX(bench_owner, player_id);
+REGISTER_COMPONENT_INDEX(bench_owner, player_id);
+
+DEFINE_COMPONENT(bench_body, struct bench_value);
+REGISTER_COMPONENT(bench_body, struct bench_value);
+DEFINE_SPATIAL_INDEX(bench_body);
+REGISTER_SPATIAL_INDEX_2D(bench_body, x, y, 4.0f);
+
+DEFINE_HIERARCHY(bench_child_of);
+REGISTER_HIERARCHY(bench_child_of);
+
+struct bench_hit {
+  uint32_t target;
+  float damage;
+};
+
+DEFINE_EVENT(bench_hit, struct bench_hit);
+REGISTER_EVENT(bench_hit, struct bench_hit);
+
+REGISTER_SYSTEM(bench_integrate, {
+  FOR_JOIN_COMPONENT_2(bench_position, bench_velocity, d, {
+    d.bench_position->x += d.bench_velocity->x;
+    d.bench_position->y += d.bench_velocity->y;
+  });
+});
+
+REGISTER_SYSTEM(bench_regenerate, {
+  FOR_JOIN_COMPONENT_1(bench_health, d, { *d.bench_health += 1.0f; });
+});
+
+// Measurement helpers
+
+static volatile float bench_sink;
+
+static struct {
+  bool csv;
+  double density;
+  // run the correctness checks instead of the scenarios
+  bool check;
+} bench_opts = {.csv = false, .density = 0.5, .check = false};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t xorshift(void) {
+  xorshift_state ^= xorshift_state << 13;
+  xorshift_state ^= xorshift_state >> 7;
+  xorshift_state ^= xorshift_state << 17;
+  return xorshift_state;
+}
+
+static bool chance(double p) {
+  return (xorshift() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+/**
+ * Reset the peak resident set size so each scenario reports its own peak,
+ * only possible on linux, elsewhere the peak is for the whole process.
+ */
+static void reset_peak_rss(void) {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+
+  if (f) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+static long peak_rss_kb(void) {
+  FILE *f = fopen("/proc/self/status", "r");
+
+  if (f) {
+    char line[256];
+    long kb = -1;
+
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+        break;
+      }
+    }
+
+    fclose(f);
+
+    if (kb >= 0) {
+      return kb;
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void report(const char *backend, const char *scenario,
+                   uint32_t entities, uint64_t ops, uint64_t elapsed_ns) {
+  double ns_per_op = ops ? (double)elapsed_ns / ops : 0.0;
+  double ops_per_sec = elapsed_ns ? ops * 1e9 / elapsed_ns : 0.0;
+
+  if (bench_opts.csv) {
+    printf("%s,%s,%u,%.3f,%lu,%.2f,%.0f,%ld\n", backend, scenario, entities,
+           bench_opts.density, ops, ns_per_op, ops_per_sec, peak_rss_kb());
+  } else {
+    printf("{\"backend\": \"%s\", \"scenario\": \"%s\", \"entities\": %u, "
+           "\"density\": %.3f, \"ops\": %lu, \"ns_per_op\": %.2f, "
+           "\"ops_per_sec\": %.0f, \"peak_rss_kb\": %ld}\n",
+           backend, scenario, entities, bench_opts.density, ops, ns_per_op,
+           ops_per_sec, peak_rss_kb());
+  }
+
+  fflush(stdout);
+}
+
+static uint32_t *shuffled_keys(uint32_t n, uint32_t offset) {
+  uint32_t *keys = malloc(sizeof(uint32_t) * n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    keys[i] = i + offset;
+  }
+
+  for (uint32_t i = n; i > 1; i--) {
+    SWAP(keys[i - 1], keys[xorshift() % i]);
+  }
+
+  return keys;
+}
+
+// Scenarios
+
+static void bench_table(const struct bench_backend *b, uint32_t n) {
+  uint32_t *hit_keys = shuffled_keys(n, 0);
+  uint32_t *miss_keys = shuffled_keys(n, n);
+  float sum = 0;
+  uint64_t start;
+
+  reset_peak_rss();
+  void *table = b->new();
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    b->insert(table, i, (struct bench_value){.x = i});
+  }
+  report(b->name, "insert", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    sum += b->lookup(table, hit_keys[i])->x;
+  }
+  report(b->name, "lookup_hit", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    sum += b->lookup(table, miss_keys[i]) != NULL;
+  }
+  report(b->name, "lookup_miss", n, n, now_ns() - start);
+
+  start = now_ns();
+  sum += b->scan(table);
+  report(b->name, "iter", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    sum += b->delete(table, hit_keys[i]);
+  }
+  report(b->name, "delete", n, n, now_ns() - start);
+
+  b->free(table);
+  free(hit_keys);
+  free(miss_keys);
+
+  bench_sink = sum;
+}
+
+struct bench_thread_args {
+  const struct bench_backend *b;
+  void *table;
+  uint32_t *keys;
+  uint32_t n;
+  float sum;
+};
+
+static void *bench_thread_insert(void *arg) {
+  struct bench_thread_args *a = arg;
+
+  for (uint32_t i = 0; i < a->n; i++) {
+    a->b->insert(a->table, a->keys[i], (struct bench_value){.x = i});
+  }
+
+  return NULL;
+}
+
+static void *bench_thread_lookup(void *arg) {
+  struct bench_thread_args *a = arg;
+
+  for (uint32_t i = 0; i < a->n; i++) {
+    a->sum += a->b->lookup(a->table, a->keys[i])->x;
+  }
+
+  return NULL;
+}
+
+static uint64_t bench_run_threads(void *(*fn)(void *),
+                                  struct bench_thread_args *args) {
+  pthread_t threads[bench_num_threads];
+  uint64_t start = now_ns();
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    pthread_create(&threads[t], NULL, fn, &args[t]);
+  }
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  return now_ns() - start;
+}
+
+// insert and look up disjoint key ranges from several threads at once
+static void bench_table_threaded(const struct bench_backend *b, uint32_t n) {
+  uint32_t *keys = shuffled_keys(n, 0);
+  struct bench_thread_args args[bench_num_threads];
+  uint32_t per_thread = n / bench_num_threads;
+  float sum = 0;
+
+  reset_peak_rss();
+  void *table = b->new();
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    args[t] = (struct bench_thread_args){
+        .b = b, .table = table, .keys = &keys[t * per_thread], .n = per_thread};
+  }
+
+  report(b->name, "insert_threaded", n, per_thread * bench_num_threads,
+         bench_run_threads(&bench_thread_insert, args));
+  report(b->name, "lookup_hit_threaded", n, per_thread * bench_num_threads,
+         bench_run_threads(&bench_thread_lookup, args));
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    sum += args[t].sum;
+  }
+
+  b->free(table);
+  free(keys);
+
+  bench_sink = sum;
+}
+
+static void bench_world(uint32_t n) {
+  float sum = 0;
+  uint64_t start;
+
+  remove_all_entities();
+  reset_ent_counter();
+  reset_peak_rss();
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t id = new_entity_id();
+
+    bench_position.add_value(id, (struct bench_value){.x = i});
+
+    if (chance(bench_opts.density)) {
+      bench_velocity.add_value(id, (struct bench_value){.x = 1, .y = 1});
+    }
+
+    if (chance(bench_opts.density)) {
+      bench_health.add_value(id, 1.0f);
+    }
+  }
+  report("component", "spawn", n, n, now_ns() - start);
+
+  start = now_ns();
+  FOR_JOIN_COMPONENT_2(bench_position, bench_velocity, d,
+                       { sum += d.bench_velocity->x; });
+  report("component", "join_2", n, n, now_ns() - start);
+
+  start = now_ns();
+  FOR_JOIN_COMPONENT_3(bench_position, bench_velocity, bench_health, d,
+                       { sum += *d.bench_health; });
+  report("component", "join_3", n, n, now_ns() - start);
+
+  const uint64_t ticks = 10;
+  start = now_ns();
+  for (uint64_t i = 0; i < ticks; i++) {
+    run_systems();
+  }
+  report("component", "run_systems", n, ticks, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    bench_hit.emit((struct bench_hit){.target = i, .damage = 1.0f});
+  }
+  swap_events();
+  report("component", "emit_event", n, n, now_ns() - start);
+
+  start = now_ns();
+  FOR_EACH_EVENT(bench_hit, ev, { sum += ev->damage; });
+  report("component", "read_event", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    kill_entity(i);
+  }
+  report("component", "kill_entity", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    bench_owner.add_value(i, (struct bench_owner){.player_id = n - i});
+  }
+  report("component", "index_add", n, n, now_ns() - start);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t id;
+    sum += index_bench_owner_player_id_lookup(i, &id, 1);
+  }
+  report("component", "index_lookup", n, n, now_ns() - start);
+
+  // about one body per unit square
+  uint32_t side = 1;
+  while ((uint64_t)side * side < n) {
+    side++;
+  }
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    bench_body.add_value(i, (struct bench_value){
+                                .x = (xorshift() % 10000) * side / 10000,
+                                .y = (xorshift() % 10000) * side / 10000});
+  }
+  report("component", "spatial_add", n, n, now_ns() - start);
+
+  const uint32_t queries = n < 100000 ? n : 100000;
+  uint32_t found[64];
+  start = now_ns();
+  for (uint32_t i = 0; i < queries; i++) {
+    float p[3] = {(xorshift() % 10000) * side / 10000,
+                  (xorshift() % 10000) * side / 10000, 0};
+    sum += spatial_grid_radius(&spatial_bench_body, p, 2.0f, found, 64);
+  }
+  report("component", "spatial_radius", n, queries, now_ns() - start);
+
+  uint64_t pairs = 0;
+  start = now_ns();
+  FOR_EACH_SPATIAL_PAIR(&spatial_bench_body, 1.0f, pair,
+                        { pairs += pair->a != pair->b; });
+  report("component", "spatial_pairs", n, pairs, now_ns() - start);
+
+  // one root in 16, every other body hangs off one added before it
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    hierarchy_bench_child_of_set_parent(
+        i, i && xorshift() % 16 ? xorshift() % i : HIERARCHY_NONE);
+  }
+  report("component", "hierarchy_set_parent", n, n, now_ns() - start);
+
+  start = now_ns();
+  hierarchy_order(&hierarchy_bench_child_of);
+  report("component", "hierarchy_order", n, n, now_ns() - start);
+
+  // world x of every body, parents summed in before their children
+  float *world = malloc(sizeof(float) * n);
+  start = now_ns();
+  FOR_EACH_HIERARCHY(&hierarchy_bench_child_of, e, i, {
+    float local = bench_body.lookup_value(e->id)->x;
+    world[i] = e->parent_idx == HIERARCHY_NONE ? local
+                                               : world[e->parent_idx] + local;
+  });
+  report("component", "hierarchy_propagate", n, n, now_ns() - start);
+  sum += world[n - 1];
+  free(world);
+
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    if (bench_child_of.lookup_value(i) &&
+        bench_child_of.lookup_value(i)->parent == HIERARCHY_NONE) {
+      hierarchy_bench_child_of_despawn(i);
+    }
+  }
+  report("component", "hierarchy_despawn", n, n, now_ns() - start);
+
+  // tag like sets, a dense half of the world and two sparse eighths
+  struct entity_set half, sparse_a, sparse_b, out;
+  entity_set_init(&half);
+  entity_set_init(&sparse_a);
+  entity_set_init(&sparse_b);
+  entity_set_init(&out);
+  start = now_ns();
+  for (uint32_t i = 0; i < n; i++) {
+    if (chance(0.5)) {
+      entity_set_insert(&half, i);
+    }
+    if (chance(0.125)) {
+      entity_set_insert(&sparse_a, i);
+    }
+    if (chance(0.125)) {
+      entity_set_insert(&sparse_b, i);
+    }
+  }
+  report("component", "entity_set_insert", n, n, now_ns() - start);
+
+  entity_set_optimize(&half);
+  start = now_ns();
+  entity_set_intersect(&out, &half, &half);
+  report("component", "entity_set_intersect_bitmap", n, n, now_ns() - start);
+  sum += entity_set_count(&out);
+
+  start = now_ns();
+  entity_set_intersect(&out, &sparse_a, &sparse_b);
+  report("component", "entity_set_intersect_sorted", n,
+         entity_set_count(&sparse_a) + entity_set_count(&sparse_b),
+         now_ns() - start);
+  sum += entity_set_count(&out);
+
+  start = now_ns();
+  entity_set_union(&out, &sparse_a, &half);
+  report("component", "entity_set_union", n, n, now_ns() - start);
+  sum += entity_set_count(&out);
+
+  entity_set_destroy(&half);
+  entity_set_destroy(&sparse_a);
+  entity_set_destroy(&sparse_b);
+  entity_set_destroy(&out);
+
+  // a world where only one entity in 16 is near a player
+  uint32_t *idle = malloc(sizeof(uint32_t) * n);
+  uint32_t num_idle = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    bench_position.add_value(i, (struct bench_value){.x = i});
+    bench_velocity.add_value(i, (struct bench_value){.x = 1, .y = 1});
+    if (i % 16) {
+      idle[num_idle++] = i;
+    }
+  }
+
+  start = now_ns();
+  hibernate_entities(idle, num_idle);
+  report("component", "hibernate", n, num_idle, now_ns() - start);
+
+  start = now_ns();
+  FOR_JOIN_COMPONENT_2(bench_position, bench_velocity, d,
+                       { sum += d.bench_velocity->x; });
+  report("component", "join_2_awake", n, n - num_idle, now_ns() - start);
+
+  start = now_ns();
+  wake_entities(idle, num_idle);
+  report("component", "wake", n, num_idle, now_ns() - start);
+  free(idle);
+
+  bench_sink = sum;
+}
+
+// Correctness checks, `--check` runs these instead of the scenarios and exits
+// with 1 if any of them fails
+
+static uint32_t check_failures;
+
+static void check_report(const char *backend, const char *check,
+                         uint32_t failures) {
+  printf("check %s %s: %s (%u failures)\n", backend, check,
+         failures ? "FAILED" : "ok", failures);
+  check_failures += failures != 0;
+}
+
+static const uint32_t check_churn_rounds = 8;
+
+struct check_churn_args {
+  const struct bench_backend *b;
+  void *table;
+  uint32_t first;
+  uint32_t n;
+  // keys of every thread, to look up while the others change them
+  uint32_t total;
+  uint32_t failures;
+};
+
+// insert, overwrite and delete a range of keys while the other threads do the
+// same to theirs, so resizes start and get copied under writes
+static void *check_churn_thread(void *arg) {
+  struct check_churn_args *a = arg;
+
+  for (uint32_t r = 0; r < check_churn_rounds; r++) {
+    for (uint32_t i = a->first; i < a->first + a->n; i++) {
+      a->b->insert(a->table, i, (struct bench_value){.x = r, .y = i});
+    }
+
+    for (uint32_t i = a->first; i < a->first + a->n; i++) {
+      if ((i + r) % 3 == 0 && !a->b->delete(a->table, i)) {
+        a->failures++;
+      }
+
+      struct bench_value *v = a->b->lookup(a->table, i * 7 % a->total);
+      if (v && v->y != i * 7 % a->total) {
+        a->failures++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void check_churn_threaded(const struct bench_backend *b, uint32_t n) {
+  struct check_churn_args args[bench_num_threads];
+  pthread_t threads[bench_num_threads];
+  uint32_t per_thread = n / bench_num_threads;
+  uint32_t total = per_thread * bench_num_threads;
+  uint32_t last = check_churn_rounds - 1;
+  uint32_t failures = 0;
+  void *table = b->new();
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    args[t] = (struct check_churn_args){.b = b,
+                                        .table = table,
+                                        .first = t * per_thread,
+                                        .n = per_thread,
+                                        .total = total};
+    pthread_create(&threads[t], NULL, &check_churn_thread, &args[t]);
+  }
+
+  for (uint32_t t = 0; t < bench_num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    failures += args[t].failures;
+  }
+
+  // deleted keys were put back by the next round, except in the last one
+  for (uint32_t i = 0; i < total; i++) {
+    struct bench_value *v = b->lookup(table, i);
+
+    if ((i + last) % 3 == 0) {
+      failures += v != NULL;
+    } else {
+      failures += !v || v->x != last || v->y != i;
+    }
+  }
+
+  b->free(table);
+  check_report(b->name, "churn_threaded", failures);
+}
+
+static const uint32_t check_fixed_max = 100;
+static const uint32_t check_fixed_batch = 10;
+
+struct check_fixed_args {
+  const struct bench_backend *b;
+  void *table;
+  uint32_t first;
+  uint32_t n;
+  uint32_t failures;
+};
+
+// put fresh keys through the table a few at a time, then insert the keys
+// below `check_fixed_max / 2` at the same time as the other threads
+static void *check_fixed_thread(void *arg) {
+  struct check_fixed_args *a = arg;
+
+  for (uint32_t first = a->first; first + check_fixed_batch <= a->first + a->n;
+       first += check_fixed_batch) {
+    for (uint32_t i = first; i < first + check_fixed_batch; i++) {
+      a->b->insert(a->table, i, (struct bench_value){.y = i});
+    }
+
+    for (uint32_t i = first; i < first + check_fixed_batch; i++) {
+      struct bench_value *v = a->b->lookup(a->table, i);
+      a->failures += !v || v->y != i;
+      a->failures += !a->b->delete(a->table, i);
+    }
+  }
+
+  for (uint32_t i = 0; i < check_fixed_max / 2; i++) {
+    a->b->insert(a->table, i, (struct bench_value){.y = i});
+  }
+
+  return NULL;
+}
+
+// fixed tables never grow, so going through many more keys than they hold
+// only works if the slots of deleted ones are used again
+static void check_churn_fixed(const struct bench_backend *b, uint32_t n) {
+  uint32_t num_threads = b->thread_safe ? bench_num_threads : 1;
+  struct check_fixed_args args[num_threads];
+  pthread_t threads[num_threads];
+  uint32_t failures = 0;
+  void *table = b->new_fixed(check_fixed_max);
+
+  for (uint32_t t = 0; t < num_threads; t++) {
+    args[t] = (struct check_fixed_args){.b = b,
+                                        .table = table,
+                                        .first = check_fixed_max +
+                                                 t * (n / num_threads),
+                                        .n = n / num_threads};
+    pthread_create(&threads[t], NULL, &check_fixed_thread, &args[t]);
+  }
+
+  for (uint32_t t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    failures += args[t].failures;
+  }
+
+  // keys inserted by several threads at once must be there exactly once
+  for (uint32_t i = 0; i < check_fixed_max / 2; i++) {
+    struct bench_value *v = b->lookup(table, i);
+
+    failures += !v || v->y != i || !b->delete(table, i);
+    failures += b->lookup(table, i) != NULL;
+  }
+
+  free(table);
+  check_report(b->name, "churn_fixed", failures);
+}
+
+// delete the entry being visited and others while iterating: every entry left
+// alone must be visited exactly once
+static void check_delete_while_iterating(const struct bench_backend *b,
+                                         uint32_t n) {
+  uint8_t *seen = calloc(n, 1);
+  uint32_t failures = 0;
+  void *table = b->new();
+
+  for (uint32_t i = 0; i < n; i++) {
+    b->insert(table, i, (struct bench_value){.y = i});
+  }
+
+  b->sweep(table, seen);
+
+  // only the keys after a multiple of 4 may go before they are visited, and
+  // those that are 3 past one are never deleted
+  for (uint32_t i = 0; i < n; i++) {
+    failures += seen[i] > 1 || (!seen[i] && i % 4 != 1);
+    failures += (b->lookup(table, i) != NULL) != (i % 4 == 3);
+  }
+
+  b->free(table);
+  free(seen);
+  check_report(b->name, "delete_while_iterating", failures);
+}
+
+// whether an id in `a` (bit 0 of `f`) and / or `b` (bit 1) belongs in the
+// intersection (op 0), union (op 1) or difference (op 2) of the two
+static bool check_set_expected(uint8_t f, uint32_t op) {
+  switch (op) {
+  case 0:
+    return f == 3;
+  case 1:
+    return f != 0;
+  default:
+    return f == 1;
+  }
+}
+
+static uint32_t check_set_result(const struct entity_set *out,
+                                 const uint8_t *flags, uint32_t span,
+                                 uint32_t op) {
+  uint8_t *seen = calloc(span, 1);
+  uint32_t failures = 0;
+  uint32_t expected = 0;
+
+  FOR_EACH_ENTITY_SET(out, id, {
+    failures += id >= span || seen[id] || !check_set_expected(flags[id], op);
+    if (id < span) {
+      seen[id] = 1;
+    }
+  });
+
+  for (uint32_t i = 0; i < span; i++) {
+    expected += check_set_expected(flags[i], op);
+  }
+  failures += entity_set_count(out) != expected;
+
+  free(seen);
+  return failures;
+}
+
+// set operations on sparse (sorted) and dense (bitmap) sets at unaligned
+// offsets, checked against the same operations done one id at a time. This
+// covers the SSE2 intersection of sorted ids and combining of bitmap words,
+// and the tails both finish with scalar loops
+static void check_entity_sets(uint32_t n) {
+  static const double densities[] = {0.03, 0.5};
+  uint32_t span = n * 2;
+  uint8_t *flags = malloc(span);
+  uint32_t failures = 0;
+  struct entity_set a, b, out;
+
+  entity_set_init(&a);
+  entity_set_init(&b);
+  entity_set_init(&out);
+
+  for (uint32_t round = 0; round < 4; round++) {
+    for (size_t da = 0; da < ARRAY_LEN(densities); da++) {
+      for (size_t db = 0; db < ARRAY_LEN(densities); db++) {
+        uint32_t base_a = xorshift() % (n / 2 + 1);
+        uint32_t base_b = xorshift() % (n / 2 + 1);
+
+        memset(flags, 0, span);
+        for (uint32_t i = 0; i < n; i++) {
+          flags[base_a + i] |= chance(densities[da]);
+        }
+        // half of the ids of `a` in range too, so sparse sets overlap
+        for (uint32_t i = 0; i < n; i++) {
+          uint8_t f = flags[base_b + i];
+
+          if (chance(densities[db]) || (f & 1 && chance(0.5))) {
+            flags[base_b + i] |= 2;
+          }
+        }
+
+        entity_set_clear(&a);
+        entity_set_clear(&b);
+        for (uint32_t i = 0; i < span; i++) {
+          if (flags[i] & 1) {
+            entity_set_insert(&a, i);
+          }
+          if (flags[i] & 2) {
+            entity_set_insert(&b, i);
+          }
+        }
+
+        // inserted in order the sets stay sorted, then dense ones turn into
+        // bitmaps
+        for (uint32_t pass = 0; pass < 2; pass++) {
+          if (pass) {
+            entity_set_optimize(&a);
+            entity_set_optimize(&b);
+          }
+
+          entity_set_intersect(&out, &a, &b);
+          failures += check_set_result(&out, flags, span, 0);
+          entity_set_union(&out, &a, &b);
+          failures += check_set_result(&out, flags, span, 1);
+          entity_set_difference(&out, &a, &b);
+          failures += check_set_result(&out, flags, span, 2);
+        }
+      }
+    }
+  }
+
+  entity_set_destroy(&a);
+  entity_set_destroy(&b);
+  entity_set_destroy(&out);
+  free(flags);
+  check_report("entity_set", "set_operations", failures);
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  uint32_t sizes[32] = {1000, 10000, 100000, 1000000};
+  size_t num_sizes = 4;
+  const char *only_backend = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--csv") == 0) {
+      bench_opts.csv = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      bench_opts.check = true;
+    } else if (strcmp(argv[i], "--density") == 0 && i + 1 < argc) {
+      bench_opts.density = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+      only_backend = argv[++i];
+    } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      char *s = argv[++i];
+      num_sizes = 0;
+
+      while (*s && num_sizes < ARRAY_LEN(sizes)) {
+        sizes[num_sizes++] = strtoul(s, &s, 10);
+        s += *s == ',';
+      }
+    } else {
+      fprintf(stderr,
+              "usage: %s [--sizes 1000,10000,...] [--density 0.5] "
+              "[--backend name] [--csv] [--check]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (bench_opts.check) {
+    for (size_t i = 0; i < num_sizes; i++) {
+      check_entity_sets(sizes[i]);
+
+      for (size_t j = 0; j < ARRAY_LEN(backends); j++) {
+        check_delete_while_iterating(backends[j], sizes[i]);
+        check_churn_fixed(backends[j], sizes[i]);
+
+        if (backends[j]->thread_safe) {
+          check_churn_threaded(backends[j], sizes[i]);
+        }
+      }
+    }
+
+    return check_failures != 0;
+  }
+
+  // worlds never shrink their tables, so go from small to large
+  qsort(sizes, num_sizes, sizeof(uint32_t), &compare_u32);
+
+  if (bench_opts.csv) {
+    printf("backend,scenario,entities,density,ops,ns_per_op,ops_per_sec,"
+           "peak_rss_kb\n");
+  }
+
+  for (size_t i = 0; i < num_sizes; i++) {
+    for (size_t j = 0; j < ARRAY_LEN(backends); j++) {
+      if (!only_backend || strcmp(only_backend, backends[j]->name) == 0) {
+        bench_table(backends[j], sizes[i]);
+
+        if (backends[j]->thread_safe) {
+          bench_table_threaded(backends[j], sizes[i]);
+        }
+      }
+    }
+
+    if (!only_backend || strcmp(only_backend, "component") == 0) {
+      bench_world(sizes[i]);
+    }
+  }
+
+  return 0;
+}
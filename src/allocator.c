@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+
+static void *libc__alloc(void *ctx, size_t size) { return calloc(1, size); }
+
+static void *libc__realloc(void *ctx, void *ptr, size_t old_size,
+                           size_t new_size) {
+  return realloc(ptr, new_size);
+}
+
+static void libc__free(void *ctx, void *ptr, size_t size) { free(ptr); }
+
+struct ecs_allocator ecs_libc_allocator = {.alloc = &libc__alloc,
+                                           .realloc = &libc__realloc,
+                                           .free = &libc__free,
+                                           .ctx = NULL};
+
+static struct ecs_allocator *current_allocator = &ecs_libc_allocator;
+
+struct ecs_allocator *ecs_current_allocator(void) { return current_allocator; }
+
+struct ecs_allocator *ecs_set_allocator(struct ecs_allocator *a) {
+  struct ecs_allocator *old = current_allocator;
+  current_allocator = a;
+  return old;
+}
+
+// Arena allocator
+
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const uint32_t arena_min_class = 4;
+#define ARENA_NUM_CLASSES 64
+
+// Address space reserved up front, without committing any memory
+static const size_t arena_default_reserve =
+    sizeof(void *) > 4 ? (size_t)64 << 30 : (size_t)256 << 20;
+
+// A reserved range of address space. Chunks and large allocations are mapped
+// into it one after the other, so their sizes stay exact and releasing the
+// arena is one munmap per region, normally a single one.
+struct arena_region {
+  struct arena_region *next;
+  char *base;
+  size_t size;
+  // start of the part not handed out yet
+  char *cursor;
+};
+
+struct ecs_arena {
+  struct ecs_allocator allocator;
+  struct ecs_arena_opts opts;
+  struct arena_region *regions;
+  size_t mapped_bytes;
+  char *chunk_cursor;
+  size_t chunk_remaining;
+  void *free_lists[ARENA_NUM_CLASSES];
+};
+
+static size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+static uint32_t arena__size_class(size_t size) {
+  uint32_t class = arena_min_class;
+
+  while (((size_t)1 << class) < size) {
+    class++;
+  }
+
+  return class;
+}
+
+// size of the mapping behind an allocation of `size` bytes
+static size_t arena__map_size(struct ecs_arena *arena, size_t size) {
+  return round_up(size, arena->opts.huge_pages ? huge_page_size
+                                               : (size_t)getpagesize());
+}
+
+static struct arena_region *arena__reserve(struct ecs_arena *arena,
+                                           size_t size) {
+  // with room to align the start for huge pages
+  size_t align = arena__map_size(arena, 1);
+  size_t reserve = MAX(arena->opts.reserve_size, size) + align;
+
+  char *base = mmap(NULL, reserve, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    RUNTIME_ERROR("Arena failed to reserve %zu bytes", reserve);
+  }
+
+  struct arena_region *r = malloc(sizeof(struct arena_region));
+  *r = (struct arena_region){
+      .next = arena->regions,
+      .base = base,
+      .size = reserve,
+      .cursor = (char *)round_up((uintptr_t)base, align)};
+  arena->regions = r;
+
+  return r;
+}
+
+static void *arena__map(struct ecs_arena *arena, size_t size) {
+  size = arena__map_size(arena, size);
+
+  struct arena_region *r = arena->regions;
+  if (!r || (size_t)(r->base + r->size - r->cursor) < size) {
+    r = arena__reserve(arena, size);
+  }
+
+  char *p = r->cursor;
+  void *mapped = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (arena->opts.huge_pages) {
+    mapped = mmap(p, size, PROT_READ | PROT_WRITE,
+                  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1,
+                  0);
+  }
+#endif
+
+  // no reserved huge pages, the range is huge page aligned so transparent
+  // huge pages can back it instead
+  if (mapped == MAP_FAILED) {
+    mapped = mmap(p, size, PROT_READ | PROT_WRITE,
+                  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if (mapped != MAP_FAILED && arena->opts.huge_pages) {
+      madvise(p, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  if (mapped == MAP_FAILED) {
+    RUNTIME_ERROR("Arena failed to map %zu bytes", size);
+  }
+
+  r->cursor += size;
+  arena->mapped_bytes += size;
+
+  return p;
+}
+
+// give the memory back, the range stays reserved until the arena is released
+static void arena__unmap(struct ecs_arena *arena, void *p, size_t size) {
+  size = arena__map_size(arena, size);
+  mmap(p, size, PROT_NONE,
+       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  arena->mapped_bytes -= size;
+}
+
+static void *arena__alloc(void *ctx, size_t size) {
+  struct ecs_arena *arena = ctx;
+
+  if (size >= arena->opts.large_threshold) {
+    return arena__map(arena, size);
+  }
+
+  uint32_t class = arena__size_class(size);
+  size_t class_size = (size_t)1 << class;
+  void *p = arena->free_lists[class];
+
+  if (p) {
+    arena->free_lists[class] = *(void **)p;
+    memset(p, 0, class_size);
+    return p;
+  }
+
+  if (arena->chunk_remaining < class_size) {
+    arena->chunk_cursor = arena__map(arena, arena->opts.chunk_size);
+    arena->chunk_remaining = arena__map_size(arena, arena->opts.chunk_size);
+  }
+
+  p = arena->chunk_cursor;
+  arena->chunk_cursor += class_size;
+  arena->chunk_remaining -= class_size;
+
+  return p;
+}
+
+static void arena__free(void *ctx, void *ptr, size_t size) {
+  struct ecs_arena *arena = ctx;
+
+  if (!ptr) {
+    return;
+  }
+
+  if (size >= arena->opts.large_threshold) {
+    arena__unmap(arena, ptr, size);
+    return;
+  }
+
+  uint32_t class = arena__size_class(size);
+  *(void **)ptr = arena->free_lists[class];
+  arena->free_lists[class] = ptr;
+}
+
+static void *arena__realloc(void *ctx, void *ptr, size_t old_size,
+                            size_t new_size) {
+  struct ecs_arena *arena = ctx;
+
+  if (ptr && old_size < arena->opts.large_threshold &&
+      new_size < arena->opts.large_threshold &&
+      arena__size_class(old_size) == arena__size_class(new_size)) {
+    return ptr;
+  }
+
+  void *new_ptr = arena__alloc(ctx, new_size);
+
+  if (ptr) {
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    arena__free(ctx, ptr, old_size);
+  }
+
+  return new_ptr;
+}
+
+struct ecs_arena *ecs_arena_new(const struct ecs_arena_opts *opts) {
+  struct ecs_arena *arena = malloc(sizeof(struct ecs_arena));
+
+  memcpy(arena,
+         &(struct ecs_arena){.allocator = {.alloc = &arena__alloc,
+                                           .realloc = &arena__realloc,
+                                           .free = &arena__free,
+                                           .ctx = arena},
+                             .opts = {.chunk_size = huge_page_size,
+                                      .large_threshold = 256 * 1024,
+                                      .huge_pages = false}},
+         sizeof(struct ecs_arena));
+
+  if (opts) {
+    arena->opts = *opts;
+  }
+
+  if (!arena->opts.reserve_size) {
+    arena->opts.reserve_size = arena_default_reserve;
+  }
+
+  // chunks must be able to hold the largest small allocation
+  size_t largest_class =
+      (size_t)1 << arena__size_class(arena->opts.large_threshold);
+  if (arena->opts.chunk_size < largest_class) {
+    arena->opts.chunk_size = largest_class;
+  }
+
+  return arena;
+}
+
+struct ecs_allocator *ecs_arena_allocator(struct ecs_arena *arena) {
+  return &arena->allocator;
+}
+
+void ecs_arena_release(struct ecs_arena *arena) {
+  struct arena_region *r = arena->regions;
+
+  while (r) {
+    struct arena_region *next = r->next;
+    munmap(r->base, r->size);
+    free(r);
+    r = next;
+  }
+
+  if (current_allocator == &arena->allocator) {
+    current_allocator = &ecs_libc_allocator;
+  }
+
+  free(arena);
+}
+
+size_t ecs_arena_mapped_bytes(struct ecs_arena *arena) {
+  return arena->mapped_bytes;
+}
@@ -0,0 +1,100 @@
+#ifndef __ALLOCATOR_H_
+#define __ALLOCATOR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Pluggable allocators for the ECS containers.
+//
+// Every container remembers the allocator that was current when it was
+// created and does all of its allocation through it, so storage can be moved
+// out of the libc heap, e.g. into an arena that is thrown away in one go.
+
+/**
+ * An allocator, `alloc` must return zeroed memory. Callers always pass back the
+ * size of an allocation when resizing or freeing it.
+ */
+struct ecs_allocator {
+  void *(*const alloc)(void *ctx, size_t size);
+  void *(*const realloc)(void *ctx, void *ptr, size_t old_size,
+                         size_t new_size);
+  void (*const free)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+};
+
+/**
+ * The libc backed allocator, the default.
+ */
+extern struct ecs_allocator ecs_libc_allocator;
+
+/**
+ * Get the allocator new containers will be created with.
+ */
+struct ecs_allocator *ecs_current_allocator(void);
+
+/**
+ * Set the allocator new containers will be created with, returns the previous
+ * one. Existing containers keep using the allocator they were created with.
+ */
+struct ecs_allocator *ecs_set_allocator(struct ecs_allocator *a);
+
+static inline void *ecs_alloc(struct ecs_allocator *a, size_t size) {
+  return a->alloc(a->ctx, size);
+}
+
+static inline void *ecs_realloc(struct ecs_allocator *a, void *ptr,
+                                size_t old_size, size_t new_size) {
+  return a->realloc(a->ctx, ptr, old_size, new_size);
+}
+
+static inline void ecs_free(struct ecs_allocator *a, void *ptr, size_t size) {
+  a->free(a->ctx, ptr, size);
+}
+
+struct ecs_arena_opts {
+  // size of the chunks small allocations are carved out of
+  size_t chunk_size;
+  // allocations at least this big get a mapping of their own
+  size_t large_threshold;
+  // back chunks and large allocations with huge pages, MAP_HUGETLB is tried
+  // first and transparent huge pages are used as a fallback
+  bool huge_pages;
+  // address space reserved at a time for chunks and large allocations, 0 for
+  // the default of 64GB. Nothing is committed until it is allocated.
+  size_t reserve_size;
+};
+
+/**
+ * An arena/slab allocator.
+ *
+ * Small allocations are rounded up to a power of two size class and carved out
+ * of large chunks, freed blocks go onto a per class free list for reuse by the
+ * next allocation of that class. Large allocations get their own mapping.
+ *
+ * Not thread safe.
+ */
+struct ecs_arena;
+
+/**
+ * Create an arena, `opts` may be NULL for the defaults.
+ */
+struct ecs_arena *ecs_arena_new(const struct ecs_arena_opts *opts);
+
+/**
+ * The allocator interface of an arena, to pass to `ecs_set_allocator`.
+ */
+struct ecs_allocator *ecs_arena_allocator(struct ecs_arena *arena);
+
+/**
+ * Release every allocation made from the arena and the arena itself, without
+ * visiting individual allocations: one munmap per reserved range, of which
+ * there is only one unless the arena outgrew `reserve_size`.
+ */
+void ecs_arena_release(struct ecs_arena *arena);
+
+/**
+ * Total bytes the arena has mapped from the OS.
+ */
+size_t ecs_arena_mapped_bytes(struct ecs_arena *arena);
+
+#endif // __ALLOCATOR_H_
@@ -7,9 +7,11 @@ size_t index_in_bitarray(size_t idx) { return idx / 8; }
 size_t bit_index_in_bitarray(size_t idx) { return idx % 8; }
 
 uint8_t *bit_array_new(size_t num_bits) {
-  size_t num_bytes = (num_bits + 8) / 8;
+  return calloc(bit_array_num_bytes(num_bits), sizeof(uint8_t));
+}
 
-  return calloc(num_bytes, sizeof(uint8_t));
+size_t bit_array_num_bytes(size_t num_bits) {
+  return BIT_ARRAY_NUM_BYTES(num_bits);
 }
 
 bool get_bit_in_bitarray(uint8_t *bitarray, size_t idx) {
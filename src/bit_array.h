@@ -11,6 +11,13 @@ size_t bit_index_in_bitarray(size_t idx);
 
 uint8_t *bit_array_new(size_t num_bits);
 
+/**
+ * Number of bytes backing a bit array of `num_bits` bits.
+ */
+#define BIT_ARRAY_NUM_BYTES(NUM_BITS) (((NUM_BITS) + 8) / 8)
+
+size_t bit_array_num_bytes(size_t num_bits);
+
 /**
  * Get a bit from a bit array.
  */
@@ -20,6 +20,7 @@
   } while (0)
 #endif // NDEBUG
 
+#ifndef ECS_STATIC_STORAGE
 #define ALLOC_SPRINTF(S, ...)                                                  \
   do {                                                                         \
     size_t needed = snprintf(NULL, 0, __VA_ARGS__) + 1;                        \
@@ -27,6 +28,13 @@
     sprintf(buf, __VA_ARGS__);                                                 \
     (S) = buf;                                                                 \
   } while (0)
+#else
+#define ALLOC_SPRINTF(S, ...)                                                  \
+  do {                                                                         \
+    _Static_assert(0, "ALLOC_SPRINTF allocates, it is not available with "     \
+                      "ECS_STATIC_STORAGE");                                   \
+  } while (0)
+#endif // ECS_STATIC_STORAGE
 
 #ifndef NDEBUG
 #define DEBUG_FPRINTF(...) fprintf(__VA_ARGS__)
@@ -49,4 +57,33 @@
 
 #define ARRAY_LEN(A) (sizeof(A) / sizeof(*A))
 
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+// strips the parentheses from a macro argument passed as `(a, b, ...)`
+#define ECS__UNPAREN(...) __VA_ARGS__
+
+#define ECS__SMEAR(X, S) ((X) | ((X) >> (S)))
+#define ECS__SMEAR_LO(X) ECS__SMEAR(ECS__SMEAR(ECS__SMEAR(X, 1), 2), 4)
+#define ECS__SMEAR_ALL(X)                                                      \
+  ECS__SMEAR(ECS__SMEAR(ECS__SMEAR(ECS__SMEAR_LO(X), 8), 16), 32)
+
+/**
+ * Smallest power of two greater than or equal to `X`, a constant expression.
+ */
+#define ECS_NEXT_POW2(X) (ECS__SMEAR_ALL((uint64_t)(X) - 1) + 1)
+
+// With ECS_STATIC_STORAGE defined nothing allocates after startup: component
+// storage is sized at compile time and containers fail instead of growing.
+#ifdef ECS_STATIC_STORAGE
+#define ECS_STATIC_STORAGE_ENABLED 1
+#else
+#define ECS_STATIC_STORAGE_ENABLED 0
+#endif // ECS_STATIC_STORAGE
+
+#ifndef ECS_STATIC_DEFAULT_CAPACITY
+// capacity of components registered without one in ECS_STATIC_STORAGE builds
+#define ECS_STATIC_DEFAULT_CAPACITY 1024
+#endif // ECS_STATIC_DEFAULT_CAPACITY
+
 #endif // __COMMON_MACROS_H_
@@ -0,0 +1,452 @@
+#ifndef __COMPACT_HASH_TABLE_H_
+#define __COMPACT_HASH_TABLE_H_
+
+// A robin hood hash table without per element bookkeeping
+//
+// Keys and values are kept in two parallel arrays and nothing else: the hash
+// is recomputed from the key when needed instead of being stored, and empty
+// and deleted slots are marked by `COMPACT_HASH_EMPTY_KEY` and
+// `COMPACT_HASH_DELETED_KEY`, which therefore can't be inserted. A table of
+// `float`s takes 8 bytes a slot instead of 12, and a scan reads values packed
+// densely in their own array.
+//
+// Deletes never move elements, so values can be deleted while iterating: a
+// slot that ends its run is emptied, any other is marked deleted. Once marked
+// slots would fill the table an insert closes them up by shifting their runs
+// back, or grows the table, which drops them as well.
+//
+// Slots are picked with Fibonacci hashing, a single multiply that spreads the
+// sequential ids handed out by `new_entity_id` evenly over the table. Keys
+// that differ only in their high bits hash poorly, use the default table for
+// those.
+//
+// Inserting a key that is already present replaces its value.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "hash_table.h"
+
+#define COMPACT_HASH_EMPTY_KEY UINT32_MAX
+#define COMPACT_HASH_DELETED_KEY (UINT32_MAX - 1)
+
+// 2^32 divided by the golden ratio
+static const uint32_t compact_hash_fibonacci = 2654435769u;
+
+#define DEFINE_COMPACT_HASH(VALTYPE, NAME)                                     \
+  /* one slot of fixed storage, the table splits them into two arrays */       \
+  struct hash_table_##NAME##_elem {                                            \
+    uint32_t key;                                                              \
+    VALTYPE val;                                                               \
+  };                                                                           \
+                                                                               \
+  struct hash_table_##NAME {                                                   \
+    uint32_t *keys;                                                            \
+    VALTYPE *vals;                                                             \
+    uint32_t num_elems;                                                        \
+    uint32_t num_tombstones;                                                   \
+    uint32_t cap;                                                              \
+    uint32_t mask;                                                             \
+    /* 32 - log2(cap), turns a 32 bit hash into a slot */                      \
+    uint32_t shift;                                                            \
+    uint32_t resize_thresh;                                                    \
+    /* capacity allocated by the first insert, keys is NULL until then */      \
+    uint32_t lazy_cap;                                                         \
+    struct ecs_allocator *alloc;                                               \
+    /* the storage is not owned by the table and never grows */                \
+    bool fixed;                                                                \
+  };                                                                           \
+  struct hash_table_##NAME *hash_table_##NAME##_new();                         \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table);              \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems);                           \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems);                     \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table);           \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v);                                  \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k);                             \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k);                                 \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table);             \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems);                        \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table);            \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out);                \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table);           \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##_count(                            \
+      struct hash_table_##NAME *table) {                                       \
+    return table->num_elems;                                                   \
+  }                                                                            \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##__slot_count(                      \
+      struct hash_table_##NAME *table) {                                       \
+    return table->cap;                                                         \
+  }                                                                            \
+                                                                               \
+  static inline VALTYPE *hash_table_##NAME##__slot(                            \
+      struct hash_table_##NAME *table, uint32_t idx, uint32_t *key) {          \
+    if (table->keys[idx] >= COMPACT_HASH_DELETED_KEY) {                        \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    *key = table->keys[idx];                                                   \
+    return &table->vals[idx];                                                  \
+  }
+
+#define MAKE_COMPACT_HASH(VALTYPE, NAME)                                       \
+  static uint32_t hash_table_##NAME##__home(struct hash_table_##NAME *table,   \
+                                            uint32_t k) {                      \
+    return (k * compact_hash_fibonacci) >> table->shift;                       \
+  }                                                                            \
+                                                                               \
+  static uint32_t hash_table_##NAME##__probes(struct hash_table_##NAME *table, \
+                                              uint32_t idx) {                  \
+    return (idx - hash_table_##NAME##__home(table, table->keys[idx])) &        \
+           table->mask;                                                        \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__set_cap(struct hash_table_##NAME *table,    \
+                                           uint32_t cap) {                     \
+    table->num_elems = 0;                                                      \
+    table->num_tombstones = 0;                                                 \
+    table->cap = cap;                                                          \
+    table->mask = cap - 1;                                                     \
+    table->shift = 32 - __builtin_ctz(cap);                                    \
+    memset(table->keys, 0xff, sizeof(uint32_t) * cap);                         \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__construct(struct hash_table_##NAME *table,  \
+                                             struct ecs_allocator *alloc,      \
+                                             uint32_t cap) {                   \
+    table->alloc = alloc;                                                      \
+    table->keys = ecs_alloc(alloc, sizeof(uint32_t) * cap);                    \
+    table->vals = ecs_alloc(alloc, sizeof(VALTYPE) * cap);                     \
+    table->resize_thresh = (cap * hash_table_load_factor_to_grow) / 100;       \
+    table->lazy_cap = cap;                                                     \
+    table->fixed = false;                                                      \
+    hash_table_##NAME##__set_cap(table, cap);                                  \
+  }                                                                            \
+                                                                               \
+  /* an empty table whose first insert allocates `cap` slots */                \
+  static void hash_table_##NAME##__construct_lazy(                             \
+      struct hash_table_##NAME *table, struct ecs_allocator *alloc,            \
+      uint32_t cap) {                                                          \
+    memset(table, 0, sizeof(struct hash_table_##NAME));                        \
+    table->alloc = alloc;                                                      \
+    table->lazy_cap = cap;                                                     \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__destruct(struct hash_table_##NAME *table) { \
+    if (table->fixed || !table->keys) {                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    ecs_free(table->alloc, table->keys, sizeof(uint32_t) * table->cap);        \
+    ecs_free(table->alloc, table->vals, sizeof(VALTYPE) * table->cap);         \
+  }                                                                            \
+                                                                               \
+  /* robin hood insert of a key known not to be in the table */                \
+  static void hash_table_##NAME##__place(struct hash_table_##NAME *table,      \
+                                         uint32_t k, VALTYPE v) {              \
+    uint32_t idx = hash_table_##NAME##__home(table, k);                        \
+    uint32_t probes = 0;                                                       \
+                                                                               \
+    for (;;) {                                                                 \
+      if (table->keys[idx] == COMPACT_HASH_EMPTY_KEY) {                        \
+        table->keys[idx] = k;                                                  \
+        table->vals[idx] = v;                                                  \
+        return;                                                                \
+      }                                                                        \
+                                                                               \
+      /* deleted slots are passed over, only closing them up reuses them */    \
+      if (table->keys[idx] != COMPACT_HASH_DELETED_KEY) {                      \
+        uint32_t current_probes = hash_table_##NAME##__probes(table, idx);     \
+                                                                               \
+        /* steal from the rich, give to the poor */                            \
+        if (current_probes < probes) {                                         \
+          SWAP(k, table->keys[idx]);                                           \
+          SWAP(v, table->vals[idx]);                                           \
+          probes = current_probes;                                             \
+        }                                                                      \
+      }                                                                        \
+                                                                               \
+      idx = (idx + 1) & table->mask;                                           \
+      probes++;                                                                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static int64_t hash_table_##NAME##__find(struct hash_table_##NAME *table,    \
+                                           uint32_t k) {                       \
+    /* also covers a table that hasn't allocated yet */                        \
+    if (!table->num_elems) {                                                   \
+      return -1;                                                               \
+    }                                                                          \
+                                                                               \
+    uint32_t idx = hash_table_##NAME##__home(table, k);                        \
+                                                                               \
+    for (uint32_t probes = 0;; probes++) {                                     \
+      uint32_t current = table->keys[idx];                                     \
+                                                                               \
+      /* an element closer to its home than we are to ours ends the run */     \
+      if (current == COMPACT_HASH_EMPTY_KEY ||                                 \
+          (current != COMPACT_HASH_DELETED_KEY &&                              \
+           hash_table_##NAME##__probes(table, idx) < probes)) {                \
+        return -1;                                                             \
+      }                                                                        \
+                                                                               \
+      if (current == k) {                                                      \
+        return idx;                                                            \
+      }                                                                        \
+                                                                               \
+      idx = (idx + 1) & table->mask;                                           \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__resize(struct hash_table_##NAME *table,     \
+                                          uint32_t new_cap) {                  \
+    struct hash_table_##NAME new_table;                                        \
+    hash_table_##NAME##__construct(&new_table, table->alloc, new_cap);         \
+                                                                               \
+    for (uint32_t i = 0; i < table->cap; i++) {                                \
+      if (table->keys[i] < COMPACT_HASH_DELETED_KEY) {                         \
+        hash_table_##NAME##__place(&new_table, table->keys[i],                 \
+                                   table->vals[i]);                            \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    new_table.num_elems = table->num_elems;                                    \
+    hash_table_##NAME##__destruct(table);                                      \
+    *table = new_table;                                                        \
+  }                                                                            \
+                                                                               \
+  /* shift the rest of the run back over a hole at `idx` */                    \
+  static void hash_table_##NAME##__close(struct hash_table_##NAME *table,      \
+                                         uint32_t idx) {                       \
+    uint32_t next = (idx + 1) & table->mask;                                   \
+                                                                               \
+    while (table->keys[next] == COMPACT_HASH_DELETED_KEY ||                    \
+           (table->keys[next] != COMPACT_HASH_EMPTY_KEY &&                     \
+            hash_table_##NAME##__probes(table, next) > 0)) {                   \
+      table->keys[idx] = table->keys[next];                                    \
+      table->vals[idx] = table->vals[next];                                    \
+      idx = next;                                                              \
+      next = (next + 1) & table->mask;                                         \
+    }                                                                          \
+                                                                               \
+    table->keys[idx] = COMPACT_HASH_EMPTY_KEY;                                 \
+  }                                                                            \
+                                                                               \
+  /* close up every deleted slot, moving elements back towards their homes */  \
+  static void hash_table_##NAME##__purge(struct hash_table_##NAME *table) {    \
+    for (uint32_t i = 0; table->num_tombstones; i = (i + 1) & table->mask) {   \
+      if (table->keys[i] == COMPACT_HASH_DELETED_KEY) {                        \
+        hash_table_##NAME##__close(table, i);                                  \
+        table->num_tombstones--;                                               \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__grow(struct hash_table_##NAME *table) {     \
+    hash_table_##NAME##__resize(table, table->keys ? table->cap * 2            \
+                                                   : table->lazy_cap);         \
+  }                                                                            \
+                                                                               \
+  struct hash_table_##NAME *hash_table_##NAME##_new() {                        \
+    struct ecs_allocator *alloc = ecs_current_allocator();                     \
+    struct hash_table_##NAME *table =                                          \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME));                    \
+    hash_table_##NAME##__construct_lazy(table, alloc, hash_table_initial_cap); \
+    return table;                                                              \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table) {             \
+    hash_table_##NAME##__destruct(table);                                      \
+    ecs_free(table->alloc, table, sizeof(struct hash_table_##NAME));           \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems) {                          \
+    uint32_t cap = HASH_TABLE_SLOTS_FOR(num_elems);                            \
+    hash_table_##NAME##__construct_lazy(table, ecs_current_allocator(),        \
+                                        MAX(cap, hash_table_initial_cap));     \
+  }                                                                            \
+                                                                               \
+  /* the keys take the start of elems and the values the rest */               \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems) {                    \
+    size_t vals_offset = sizeof(uint32_t) * cap;                               \
+    vals_offset += -vals_offset & (_Alignof(VALTYPE) - 1);                     \
+    table->keys = (uint32_t *)elems;                                           \
+    table->vals = (VALTYPE *)((char *)elems + vals_offset);                    \
+    table->resize_thresh = max_elems + 1;                                      \
+    table->lazy_cap = cap;                                                     \
+    table->alloc = NULL;                                                       \
+    table->fixed = true;                                                       \
+    hash_table_##NAME##__set_cap(table, cap);                                  \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table) {          \
+    hash_table_##NAME##__destruct(table);                                      \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v) {                                 \
+    if (k >= COMPACT_HASH_DELETED_KEY) {                                       \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    int64_t idx = hash_table_##NAME##__find(table, k);                         \
+                                                                               \
+    if (idx >= 0) {                                                            \
+      table->vals[idx] = v;                                                    \
+      return true;                                                             \
+    }                                                                          \
+                                                                               \
+    uint32_t used = table->num_elems + table->num_tombstones;                  \
+                                                                               \
+    /* a fixed table can only make room by closing up deleted slots */         \
+    if (used + 1 >= table->resize_thresh &&                                    \
+        (table->fixed || table->num_tombstones > table->num_elems / 4)) {      \
+      hash_table_##NAME##__purge(table);                                       \
+      used = table->num_elems;                                                 \
+    }                                                                          \
+                                                                               \
+    if (used + 1 >= table->resize_thresh) {                                    \
+      if (table->fixed) {                                                      \
+        return false;                                                          \
+      }                                                                        \
+                                                                               \
+      hash_table_##NAME##__grow(table);                                        \
+    }                                                                          \
+                                                                               \
+    table->num_elems++;                                                        \
+    hash_table_##NAME##__place(table, k, v);                                   \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k) {                            \
+    int64_t idx = hash_table_##NAME##__find(table, k);                         \
+                                                                               \
+    if (idx < 0) {                                                             \
+      return NULL;                                                             \
+    }                                                                          \
+    return &table->vals[idx];                                                  \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k) {                                \
+    int64_t found = hash_table_##NAME##__find(table, k);                       \
+                                                                               \
+    if (found < 0) {                                                           \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    uint32_t idx = found;                                                      \
+    uint32_t next = (idx + 1) & table->mask;                                   \
+                                                                               \
+    table->num_elems--;                                                        \
+                                                                               \
+    /* later elements of the run are found through this slot */                \
+    if (table->keys[next] == COMPACT_HASH_DELETED_KEY ||                       \
+        (table->keys[next] != COMPACT_HASH_EMPTY_KEY &&                        \
+         hash_table_##NAME##__probes(table, next) > 0)) {                      \
+      table->keys[idx] = COMPACT_HASH_DELETED_KEY;                             \
+      table->num_tombstones++;                                                 \
+      return true;                                                             \
+    }                                                                          \
+                                                                               \
+    /* the run ends here now, and so do the deleted slots right before it */   \
+    table->keys[idx] = COMPACT_HASH_EMPTY_KEY;                                 \
+    idx = (idx - 1) & table->mask;                                             \
+                                                                               \
+    while (table->keys[idx] == COMPACT_HASH_DELETED_KEY) {                     \
+      table->keys[idx] = COMPACT_HASH_EMPTY_KEY;                               \
+      table->num_tombstones--;                                                 \
+      idx = (idx - 1) & table->mask;                                           \
+    }                                                                          \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table) {            \
+    if (!table->keys) {                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    hash_table_##NAME##__set_cap(table, table->cap);                           \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems) {                       \
+    uint32_t cap = HASH_TABLE_SLOTS_FOR(num_elems);                            \
+                                                                               \
+    if (table->fixed) {                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    if (!table->keys) {                                                        \
+      table->lazy_cap = MAX(table->lazy_cap, cap);                             \
+    } else if (cap > table->cap) {                                             \
+      hash_table_##NAME##__resize(table, cap);                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* room for twice the elements, so the next inserts don't regrow it */       \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table) {           \
+    uint32_t cap = MAX(HASH_TABLE_SLOTS_FOR((uint64_t)table->num_elems * 2),   \
+                       hash_table_initial_cap);                                \
+                                                                               \
+    if (table->fixed || !table->keys || cap >= table->cap) {                   \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    hash_table_##NAME##__resize(table, cap);                                   \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out) {               \
+    uint64_t total_probes = 0;                                                 \
+                                                                               \
+    memset(out, 0, sizeof(*out));                                              \
+    out->cap = table->cap;                                                     \
+    out->bytes_allocated = (sizeof(uint32_t) + sizeof(VALTYPE)) * table->cap;  \
+                                                                               \
+    out->num_tombstones = table->num_tombstones;                               \
+                                                                               \
+    for (uint32_t i = 0; i < table->cap; i++) {                                \
+      if (table->keys[i] >= COMPACT_HASH_DELETED_KEY) {                        \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      uint32_t probes = hash_table_##NAME##__probes(table, i);                 \
+      uint32_t bucket = probes < HASH_TABLE_STATS_HIST_BUCKETS                 \
+                            ? probes                                           \
+                            : HASH_TABLE_STATS_HIST_BUCKETS - 1;               \
+                                                                               \
+      out->num_elems++;                                                        \
+      out->probe_hist[bucket]++;                                               \
+      total_probes += probes;                                                  \
+      if (probes > out->max_probes) {                                          \
+        out->max_probes = probes;                                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    if (out->num_elems) {                                                      \
+      out->mean_probes = (double)total_probes / out->num_elems;                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* nothing is ever retired, tables are single threaded */                    \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table) {}
+
+#endif // __COMPACT_HASH_TABLE_H_
@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "component.h"
+
+void dump_component_stats(FILE *f) {
+  for (struct component_def **s = ({
+         extern struct component_def *__start_component_def_array;
+         &__start_component_def_array;
+       });
+       s != ({
+         extern struct component_def *__stop_component_def_array;
+         &__stop_component_def_array;
+       });
+       s++) {
+    struct hash_table_stats stats;
+    (*s)->stats(&stats);
+
+    fprintf(f,
+            "%s: cap=%u elems=%u tombstones=%u load=%.1f%% mean_probes=%.2f "
+            "max_probes=%u bytes=%zu hist=",
+            (*s)->name, stats.cap, stats.num_elems, stats.num_tombstones,
+            stats.cap ? (100.0 * (stats.num_elems + stats.num_tombstones)) /
+                            stats.cap
+                      : 0.0,
+            stats.mean_probes, stats.max_probes, stats.bytes_allocated);
+
+    for (uint32_t i = 0; i < HASH_TABLE_STATS_HIST_BUCKETS; i++) {
+      fprintf(f, i ? ",%u" : "%u", stats.probe_hist[i]);
+    }
+
+    fprintf(f, "\n");
+  }
+}
+
+bool save_component_capacity_hints(const char *path) {
+  FILE *f = fopen(path, "w");
+
+  if (!f) {
+    return false;
+  }
+
+  for (struct component_def **s = ({
+         extern struct component_def *__start_component_def_array;
+         &__start_component_def_array;
+       });
+       s != ({
+         extern struct component_def *__stop_component_def_array;
+         &__stop_component_def_array;
+       });
+       s++) {
+    fprintf(f, "%s %u\n", (*s)->name, (*s)->high_water());
+  }
+
+  return fclose(f) == 0;
+}
+
+bool load_component_capacity_hints(const char *path) {
+  FILE *f = fopen(path, "r");
+  char name[256];
+  uint32_t num_elems;
+
+  if (!f) {
+    return false;
+  }
+
+  while (fscanf(f, "%255s %u", name, &num_elems) == 2) {
+    for (struct component_def **s = ({
+           extern struct component_def *__start_component_def_array;
+           &__start_component_def_array;
+         });
+         s != ({
+           extern struct component_def *__stop_component_def_array;
+           &__stop_component_def_array;
+         });
+         s++) {
+      if (strcmp((*s)->name, name) == 0) {
+        (*s)->reserve(num_elems);
+        break;
+      }
+    }
+  }
+
+  fclose(f);
+  return true;
+}
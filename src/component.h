@@ -5,8 +5,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "compact_hash_table.h"
+#include "concurrent_hash_table.h"
 #include "hash_set.h"
 #include "hash_table.h"
+#include "segmented_hash_table.h"
 
 #define STRUCT_MEMBER_TYPE(TYPE, MEMBER) typeof(((TYPE *)0)->MEMBER)
 
@@ -20,56 +23,273 @@ struct component_def {
   void *(*const lookup_value)(uint32_t ent_id);
   void (*const delete_value)(uint32_t ent_id);
   void (*const clear_everything)(void);
+  uint32_t (*const count)(void);
+  void (*const stats)(struct hash_table_stats *out);
+  void (*const reset_storage)(void);
+  void (*const reclaim)(void);
+  uint32_t (*const high_water)(void);
+  void (*const reserve)(uint32_t num_elems);
+  void (*const shrink)(void);
+  const size_t value_size;
+  bool (*const add_raw)(uint32_t ent_id, const void *val);
 };
 
+/**
+ * Callbacks run when values of a component are added or deleted, used to keep
+ * secondary indexes up to date. `on_clear` runs when every value is removed,
+ * with `reset` set when the storage is being forgotten rather than freed, see
+ * `reset_component_storage`.
+ */
+struct component_hook {
+  struct component_hook *next;
+  void (*const on_add)(uint32_t ent_id, const void *val);
+  void (*const on_delete)(uint32_t ent_id, const void *val);
+  void (*const on_clear)(bool reset);
+};
+
+static inline void component_hooks_add(struct component_hook *h,
+                                       uint32_t ent_id, const void *val) {
+  for (; h; h = h->next) {
+    h->on_add(ent_id, val);
+  }
+}
+
+static inline void component_hooks_delete(struct component_hook *h,
+                                          uint32_t ent_id, const void *val) {
+  for (; h; h = h->next) {
+    h->on_delete(ent_id, val);
+  }
+}
+
+static inline void component_hooks_clear(struct component_hook *h,
+                                         bool reset) {
+  for (; h; h = h->next) {
+    h->on_clear(reset);
+  }
+}
+
+/* raise the most values a component has held at once to `n` */
+static inline void component_note_high_water(uint32_t *hw, uint32_t n) {
+  uint32_t seen = __atomic_load_n(hw, __ATOMIC_RELAXED);
+
+  while (n > seen && !__atomic_compare_exchange_n(hw, &seen, n, true,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED)) {
+  }
+}
+
 #define COMPONENT_DEF(NAME, TYPE)                                              \
   struct component_##NAME##_def {                                              \
     const char *const name;                                                    \
     const uint32_t id;                                                         \
     struct hash_table_component_##NAME##_storage *const storage;               \
-    void (*const add_value)(uint32_t ent_id, TYPE val);                        \
+    bool (*const add_value)(uint32_t ent_id, TYPE val);                        \
     TYPE *(*const lookup_value)(uint32_t ent_id);                              \
     void (*const delete_value)(uint32_t ent_id);                               \
     void (*const clear_everything)(void);                                      \
+    uint32_t (*const count)(void);                                             \
+    void (*const stats)(struct hash_table_stats *out);                         \
+    void (*const reset_storage)(void);                                         \
+    void (*const reclaim)(void);                                               \
+    uint32_t (*const high_water)(void);                                        \
+    void (*const reserve)(uint32_t num_elems);                                 \
+    void (*const shrink)(void);                                                \
+    const size_t value_size;                                                   \
+    bool (*const add_raw)(uint32_t ent_id, const void *val);                   \
   };
 
-#define DEFINE_COMPONENT(NAME, TYPE)                                           \
-  DEFINE_HASH(TYPE, component_##NAME##_storage);                               \
+#define DEFINE_COMPONENT(NAME, TYPE) DEFINE_COMPONENT_OF(NAME, TYPE, HASH)
+
+/**
+ * Define a component stored in a `KIND` table: `HASH` for the default robin
+ * hood table, `CONCURRENT_HASH` for one that can be used from several threads
+ * at once, `SEGMENTED_HASH` for one whose values never move so pointers from
+ * `lookup_value` and joins stay valid until the value is deleted, or
+ * `COMPACT_HASH` for one that stores nothing but keys and values, best for
+ * small values keyed by sequential entity ids. The component must be
+ * registered with the same kind. Every kind allows deleting values, the
+ * current one or others, while a join walks the table.
+ */
+#define DEFINE_COMPONENT_OF(NAME, TYPE, KIND)                                  \
+  DEFINE_##KIND(TYPE, component_##NAME##_storage);                             \
   COMPONENT_DEF(NAME, TYPE);                                                   \
+  extern struct component_hook *component_##NAME##_hooks;                      \
   extern struct component_##NAME##_def NAME;
 
+#define DEFINE_CONCURRENT_COMPONENT(NAME, TYPE)                                \
+  DEFINE_COMPONENT_OF(NAME, TYPE, CONCURRENT_HASH)
+
+#define DEFINE_SEGMENTED_COMPONENT(NAME, TYPE)                                 \
+  DEFINE_COMPONENT_OF(NAME, TYPE, SEGMENTED_HASH)
+
+#define DEFINE_COMPACT_COMPONENT(NAME, TYPE)                                   \
+  DEFINE_COMPONENT_OF(NAME, TYPE, COMPACT_HASH)
+
+/**
+ * Storage of a component holding up to `MAX` entities.
+ *
+ * With ECS_STATIC_STORAGE the table lives in static memory and never grows,
+ * `add_value` returns false once it is full. Otherwise `MAX` only pre-sizes
+ * the table.
+ */
+#define COMPONENT_STORAGE(NAME, MAX)                                           \
+  HASH_TABLE_STORAGE(component_##NAME##_storage, component_##NAME##_table,     \
+                     MAX)
+
+#ifdef ECS_STATIC_STORAGE
+#define DEFAULT_COMPONENT_CAPACITY ECS_STATIC_DEFAULT_CAPACITY
+#else
+#define DEFAULT_COMPONENT_CAPACITY 0
+#endif // ECS_STATIC_STORAGE
+
 #define REGISTER_COMPONENT(NAME, TYPE)                                         \
-  MAKE_HASH(TYPE, component_##NAME##_storage);                                 \
+  REGISTER_COMPONENT_OF(NAME, TYPE, HASH, DEFAULT_COMPONENT_CAPACITY)
+
+/**
+ * Register a component that holds up to `MAX` entities, see
+ * `COMPONENT_STORAGE`.
+ */
+#define REGISTER_COMPONENT_CAPACITY(NAME, TYPE, MAX)                           \
+  REGISTER_COMPONENT_OF(NAME, TYPE, HASH, MAX)
+
+#define REGISTER_CONCURRENT_COMPONENT(NAME, TYPE)                              \
+  REGISTER_COMPONENT_OF(NAME, TYPE, CONCURRENT_HASH,                           \
+                        DEFAULT_COMPONENT_CAPACITY)
+
+#define REGISTER_SEGMENTED_COMPONENT(NAME, TYPE)                               \
+  REGISTER_COMPONENT_OF(NAME, TYPE, SEGMENTED_HASH,                            \
+                        DEFAULT_COMPONENT_CAPACITY)
+
+#define REGISTER_COMPACT_COMPONENT(NAME, TYPE)                                 \
+  REGISTER_COMPONENT_OF(NAME, TYPE, COMPACT_HASH, DEFAULT_COMPONENT_CAPACITY)
+
+/**
+ * Register a component stored in a `KIND` table holding up to `MAX` entities,
+ * see `DEFINE_COMPONENT_OF` and `COMPONENT_STORAGE`.
+ */
+#define REGISTER_COMPONENT_OF(NAME, TYPE, KIND, MAX)                           \
+  MAKE_##KIND(TYPE, component_##NAME##_storage);                               \
+  COMPONENT_STORAGE(NAME, MAX);                                                \
   struct component_##NAME##_def NAME;                                          \
   static struct component_##NAME##_def *component_ptr__##NAME                  \
       __attribute__((used, section("component_def_array"))) = &NAME;           \
   static const uint32_t component_##NAME##_id = __COUNTER__;                   \
-  void component_##NAME##_add_value(uint32_t ent_id, TYPE val) {               \
-    hash_table_component_##NAME##_storage_insert(NAME.storage, ent_id, val);   \
+  struct component_hook *component_##NAME##_hooks;                             \
+  static uint32_t component_##NAME##_high_water_mark;                          \
+  bool component_##NAME##_add_value(uint32_t ent_id, TYPE val) {               \
+    if (component_##NAME##_hooks) {                                            \
+      TYPE *old =                                                              \
+          hash_table_component_##NAME##_storage_lookup(NAME.storage, ent_id);  \
+      if (old) {                                                               \
+        component_hooks_delete(component_##NAME##_hooks, ent_id, old);         \
+        *old = val;                                                            \
+        component_hooks_add(component_##NAME##_hooks, ent_id, old);            \
+        return true;                                                           \
+      }                                                                        \
+    }                                                                          \
+    if (!hash_table_component_##NAME##_storage_insert(NAME.storage, ent_id,    \
+                                                      val)) {                  \
+      return false;                                                            \
+    }                                                                          \
+    component_note_high_water(                                                 \
+        &component_##NAME##_high_water_mark,                                   \
+        hash_table_component_##NAME##_storage_count(NAME.storage));            \
+    component_hooks_add(component_##NAME##_hooks, ent_id, &val);               \
+    return true;                                                               \
   }                                                                            \
   TYPE *component_##NAME##_lookup_value(uint32_t ent_id) {                     \
     return hash_table_component_##NAME##_storage_lookup(NAME.storage, ent_id); \
   }                                                                            \
   void component_##NAME##_delete_value(uint32_t ent_id) {                      \
+    if (component_##NAME##_hooks) {                                            \
+      TYPE *old =                                                              \
+          hash_table_component_##NAME##_storage_lookup(NAME.storage, ent_id);  \
+      if (!old) {                                                              \
+        return;                                                                \
+      }                                                                        \
+      component_hooks_delete(component_##NAME##_hooks, ent_id, old);           \
+    }                                                                          \
     hash_table_component_##NAME##_storage_delete(NAME.storage, ent_id);        \
   }                                                                            \
   void component_##NAME##_clear_everything(void) {                             \
     hash_table_component_##NAME##_storage_clear(NAME.storage);                 \
+    component_hooks_clear(component_##NAME##_hooks, false);                    \
+  }                                                                            \
+  uint32_t component_##NAME##_count(void) {                                    \
+    return hash_table_component_##NAME##_storage_count(NAME.storage);          \
+  }                                                                            \
+  void component_##NAME##_stats(struct hash_table_stats *out) {                \
+    hash_table_component_##NAME##_storage_stats(NAME.storage, out);            \
+  }                                                                            \
+  void component_##NAME##_reset_storage(void) {                                \
+    component_##NAME##_table_init();                                           \
+    component_hooks_clear(component_##NAME##_hooks, true);                     \
+  }                                                                            \
+  void component_##NAME##_reclaim(void) {                                      \
+    hash_table_component_##NAME##_storage_reclaim(NAME.storage);               \
+  }                                                                            \
+  uint32_t component_##NAME##_high_water(void) {                               \
+    return __atomic_load_n(&component_##NAME##_high_water_mark,                \
+                           __ATOMIC_RELAXED);                                  \
+  }                                                                            \
+  void component_##NAME##_reserve(uint32_t num_elems) {                        \
+    hash_table_component_##NAME##_storage_reserve(NAME.storage, num_elems);    \
+  }                                                                            \
+  void component_##NAME##_shrink(void) {                                       \
+    hash_table_component_##NAME##_storage_shrink(NAME.storage);                \
+  }                                                                            \
+  /* add_value for code that only knows the size of the value */               \
+  bool component_##NAME##_add_raw(uint32_t ent_id, const void *val) {          \
+    TYPE v;                                                                    \
+    memcpy(&v, val, sizeof(TYPE));                                             \
+    return component_##NAME##_add_value(ent_id, v);                            \
   }                                                                            \
   static void component_init__##NAME(void) __attribute__((constructor));       \
   static void component_init__##NAME(void) {                                   \
+    component_##NAME##_table_init();                                           \
     memcpy(&NAME,                                                              \
            &(struct component_##NAME##_def){                                   \
                .name = #NAME,                                                  \
                .id = component_##NAME##_id,                                    \
-               .storage = hash_table_component_##NAME##_storage_new(),         \
+               .storage = &component_##NAME##_table,                           \
                .add_value = &component_##NAME##_add_value,                     \
                .lookup_value = &component_##NAME##_lookup_value,               \
                .delete_value = &component_##NAME##_delete_value,               \
-               .clear_everything = &component_##NAME##_clear_everything},      \
+               .clear_everything = &component_##NAME##_clear_everything,       \
+               .count = &component_##NAME##_count,                             \
+               .stats = &component_##NAME##_stats,                             \
+               .reset_storage = &component_##NAME##_reset_storage,             \
+               .reclaim = &component_##NAME##_reclaim,                         \
+               .high_water = &component_##NAME##_high_water,                   \
+               .reserve = &component_##NAME##_reserve,                         \
+               .shrink = &component_##NAME##_shrink,                           \
+               .value_size = sizeof(TYPE),                                     \
+               .add_raw = &component_##NAME##_add_raw},                        \
            sizeof(struct component_##NAME##_def));                             \
   }
 
+/**
+ * Write the storage statistics of every registered component to `f`, one line
+ * per component.
+ */
+void dump_component_stats(FILE *f);
+
+/**
+ * Write the most values each registered component has held at once to
+ * `path`, one `name count` line per component. Returns false if the file
+ * can't be written.
+ */
+bool save_component_capacity_hints(const char *path);
+
+/**
+ * Reserve room in every registered component for the count a previous run
+ * saved with `save_component_capacity_hints`, so storage is allocated once at
+ * its final size instead of growing through every power of two. Components
+ * missing from the file are left alone. Returns false if the file can't be
+ * read.
+ */
+bool load_component_capacity_hints(const char *path);
+
 /**
  * Union of all entities that have the given components.
  *
@@ -155,7 +375,8 @@ struct component_def {
  * i.my_other_component->something, i.another_component->it);
  * });
  */
-#define FOR_JOIN_COMPONENT_3(COMP_NAME_0, COMP_NAME_1, ITER_VAR, ...)          \
+#define FOR_JOIN_COMPONENT_3(COMP_NAME_0, COMP_NAME_1, COMP_NAME_2, ITER_VAR,  \
+                             ...)                                              \
   do {                                                                         \
     HASH_TABLE_ITER(                                                           \
         component_##COMP_NAME_0##_storage, k_0, v_0, COMP_NAME_0.storage, {    \
@@ -168,7 +389,7 @@ struct component_def {
               struct hash_table_component_##COMP_NAME_2##_storage_elem,        \
               val) *v_2 =                                                      \
               hash_table_component_##COMP_NAME_2##_storage_lookup(             \
-                  COMP_NAME_1.storage, k_0);                                   \
+                  COMP_NAME_2.storage, k_0);                                   \
           if (v_1 != NULL && v_2 != NULL) {                                    \
             struct {                                                           \
               uint32_t id;                                                     \
@@ -0,0 +1,346 @@
+#ifndef __COMPONENT_INDEX_H_
+#define __COMPONENT_INDEX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common_macros.h"
+#include "component.h"
+#include "hash_table.h"
+#include "vec.h"
+
+// Secondary indexes on component fields
+//
+// An index maps the value of one field of a component to the entities holding
+// it. It is kept up to date by the component's `add_value`, `delete_value` and
+// `clear_everything`; after changing the field through a `lookup_value`
+// pointer call `index_<comp>_<field>_reindex(ent_id)`.
+//
+// `HASH_INDEX` indexes answer equality lookups in constant time, they chain
+// the entities sharing a value through a table keyed by entity, so the field
+// has to be an integer of at most 32 bits. `RANGE_INDEX` indexes keep
+// (value, entity) pairs in a sorted array and also answer range queries, the
+// field can be any type ordered by `<`, but adding and deleting moves the
+// entries after the changed one.
+//
+// Indexes are single threaded, don't index a concurrent component that is
+// written from several threads at once.
+
+#define COMPONENT_INDEX_NONE UINT32_MAX
+
+// whether `TYPE` is an integer (or enum) type, floats and structs are not
+#define COMPONENT_INDEX_IS_INTEGER(TYPE)                                       \
+  _Generic((TYPE)0,                                                            \
+      _Bool: 1,                                                                \
+      char: 1,                                                                 \
+      signed char: 1,                                                          \
+      unsigned char: 1,                                                        \
+      short: 1,                                                                \
+      unsigned short: 1,                                                       \
+      int: 1,                                                                  \
+      unsigned int: 1,                                                         \
+      long: 1,                                                                 \
+      unsigned long: 1,                                                        \
+      long long: 1,                                                            \
+      unsigned long long: 1,                                                   \
+      default: 0)
+
+#define COMPONENT_INDEX_KEY(COMP, FIELD)                                       \
+  STRUCT_MEMBER_TYPE(                                                          \
+      STRUCT_MEMBER_TYPE(struct hash_table_component_##COMP##_storage_elem,    \
+                         val),                                                 \
+      FIELD)
+
+#define DEFINE_COMPONENT_INDEX(COMP, FIELD)                                    \
+  DEFINE_COMPONENT_INDEX_OF(COMP, FIELD, HASH_INDEX)
+
+#define DEFINE_COMPONENT_RANGE_INDEX(COMP, FIELD)                              \
+  DEFINE_COMPONENT_INDEX_OF(COMP, FIELD, RANGE_INDEX)
+
+/**
+ * Define an index of kind `KIND`, `HASH_INDEX` or `RANGE_INDEX`, on field
+ * `FIELD` of component `COMP`, usage:
+ *
+ * DEFINE_COMPONENT_INDEX(player, player_id);
+ *
+ * uint32_t ent;
+ * if (index_player_player_id_lookup(42, &ent, 1)) { ... }
+ *
+ * `lookup` and `range` write up to `max` matching entity ids to `out` and
+ * return the number of matches, which may be more than `max`. `range` matches
+ * values from `lo` to `hi` inclusive, in order, and is only there for
+ * `RANGE_INDEX` indexes.
+ */
+#define DEFINE_COMPONENT_INDEX_OF(COMP, FIELD, KIND)                           \
+  typedef COMPONENT_INDEX_KEY(COMP, FIELD) index_##COMP##_##FIELD##_key;       \
+  size_t index_##COMP##_##FIELD##_lookup(index_##COMP##_##FIELD##_key key,     \
+                                         uint32_t *out, size_t max);           \
+  void index_##COMP##_##FIELD##_reindex(uint32_t ent_id);                      \
+  DEFINE_##KIND##_EXTRA(COMP, FIELD)
+
+#define DEFINE_HASH_INDEX_EXTRA(COMP, FIELD)
+
+#define DEFINE_RANGE_INDEX_EXTRA(COMP, FIELD)                                  \
+  size_t index_##COMP##_##FIELD##_range(index_##COMP##_##FIELD##_key lo,       \
+                                        index_##COMP##_##FIELD##_key hi,       \
+                                        uint32_t *out, size_t max);
+
+#define REGISTER_COMPONENT_INDEX(COMP, FIELD)                                  \
+  REGISTER_COMPONENT_INDEX_OF(COMP, FIELD, HASH_INDEX,                         \
+                              DEFAULT_COMPONENT_CAPACITY)
+
+#define REGISTER_COMPONENT_RANGE_INDEX(COMP, FIELD)                            \
+  REGISTER_COMPONENT_INDEX_OF(COMP, FIELD, RANGE_INDEX,                        \
+                              DEFAULT_COMPONENT_CAPACITY)
+
+/**
+ * Register an index defined with `DEFINE_COMPONENT_INDEX_OF`, `MAX` is the
+ * capacity of the indexed component, see `COMPONENT_STORAGE`.
+ */
+#define REGISTER_COMPONENT_INDEX_OF(COMP, FIELD, KIND, MAX)                    \
+  MAKE_##KIND(COMP, FIELD, MAX);                                               \
+  static void index_##COMP##_##FIELD##_on_add(uint32_t ent_id,                 \
+                                              const void *val) {               \
+    index_##COMP##_##FIELD##__insert(                                          \
+        ent_id,                                                                \
+        ((const STRUCT_MEMBER_TYPE(                                            \
+            struct hash_table_component_##COMP##_storage_elem, val) *)val)     \
+            ->FIELD);                                                          \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##_on_delete(uint32_t ent_id,              \
+                                                 const void *val) {            \
+    index_##COMP##_##FIELD##__remove(ent_id);                                  \
+  }                                                                            \
+  void index_##COMP##_##FIELD##_reindex(uint32_t ent_id) {                     \
+    index_##COMP##_##FIELD##__remove(ent_id);                                  \
+    typeof(COMP.lookup_value(0)) val = COMP.lookup_value(ent_id);              \
+    if (val) {                                                                 \
+      index_##COMP##_##FIELD##__insert(ent_id, val->FIELD);                    \
+    }                                                                          \
+  }                                                                            \
+  static struct component_hook index_##COMP##_##FIELD##_hook = {               \
+      .on_add = &index_##COMP##_##FIELD##_on_add,                              \
+      .on_delete = &index_##COMP##_##FIELD##_on_delete,                        \
+      .on_clear = &index_##COMP##_##FIELD##__clear};                           \
+  static void index_init__##COMP##_##FIELD(void)                               \
+      __attribute__((constructor));                                            \
+  static void index_init__##COMP##_##FIELD(void) {                             \
+    index_##COMP##_##FIELD##__clear(true);                                     \
+    index_##COMP##_##FIELD##_hook.next = component_##COMP##_hooks;             \
+    component_##COMP##_hooks = &index_##COMP##_##FIELD##_hook;                 \
+  }
+
+// entities sharing a value form a doubly linked list starting at `heads[value]`
+#define MAKE_HASH_INDEX(COMP, FIELD, MAX)                                      \
+  _Static_assert(COMPONENT_INDEX_IS_INTEGER(index_##COMP##_##FIELD##_key) &&   \
+                     sizeof(index_##COMP##_##FIELD##_key) <= sizeof(uint32_t), \
+                 "hash indexes need an integer field of at most 32 bits");     \
+  struct index_##COMP##_##FIELD##_link {                                       \
+    uint32_t key;                                                              \
+    uint32_t prev;                                                             \
+    uint32_t next;                                                             \
+  };                                                                           \
+  DEFINE_HASH(struct index_##COMP##_##FIELD##_link,                            \
+              index_##COMP##_##FIELD##_links);                                 \
+  MAKE_HASH(struct index_##COMP##_##FIELD##_link,                              \
+            index_##COMP##_##FIELD##_links);                                   \
+  DEFINE_HASH(uint32_t, index_##COMP##_##FIELD##_heads);                       \
+  MAKE_HASH(uint32_t, index_##COMP##_##FIELD##_heads);                         \
+  HASH_TABLE_STORAGE(index_##COMP##_##FIELD##_links,                           \
+                     index_##COMP##_##FIELD##_links_table, MAX);               \
+  HASH_TABLE_STORAGE(index_##COMP##_##FIELD##_heads,                           \
+                     index_##COMP##_##FIELD##_heads_table, MAX);               \
+  static void index_##COMP##_##FIELD##__insert(                                \
+      uint32_t ent_id, index_##COMP##_##FIELD##_key value) {                   \
+    uint32_t key = (uint32_t)value;                                            \
+    uint32_t *head = hash_table_index_##COMP##_##FIELD##_heads_lookup(         \
+        &index_##COMP##_##FIELD##_heads_table, key);                           \
+    uint32_t next = head ? *head : COMPONENT_INDEX_NONE;                       \
+    if (!hash_table_index_##COMP##_##FIELD##_links_insert(                     \
+            &index_##COMP##_##FIELD##_links_table, ent_id,                     \
+            (struct index_##COMP##_##FIELD##_link){                            \
+                key, COMPONENT_INDEX_NONE, next})) {                           \
+      RUNTIME_ERROR("Index %s.%s is full", #COMP, #FIELD);                     \
+    }                                                                          \
+    if (head) {                                                                \
+      hash_table_index_##COMP##_##FIELD##_links_lookup(                        \
+          &index_##COMP##_##FIELD##_links_table, next)                         \
+          ->prev = ent_id;                                                     \
+      *head = ent_id;                                                          \
+    } else {                                                                   \
+      hash_table_index_##COMP##_##FIELD##_heads_insert(                        \
+          &index_##COMP##_##FIELD##_heads_table, key, ent_id);                 \
+    }                                                                          \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##__remove(uint32_t ent_id) {              \
+    struct index_##COMP##_##FIELD##_link *l =                                  \
+        hash_table_index_##COMP##_##FIELD##_links_lookup(                      \
+            &index_##COMP##_##FIELD##_links_table, ent_id);                    \
+    if (!l) {                                                                  \
+      return;                                                                  \
+    }                                                                          \
+    struct index_##COMP##_##FIELD##_link link = *l;                            \
+    if (link.prev != COMPONENT_INDEX_NONE) {                                   \
+      hash_table_index_##COMP##_##FIELD##_links_lookup(                        \
+          &index_##COMP##_##FIELD##_links_table, link.prev)                    \
+          ->next = link.next;                                                  \
+    } else if (link.next != COMPONENT_INDEX_NONE) {                            \
+      *hash_table_index_##COMP##_##FIELD##_heads_lookup(                       \
+          &index_##COMP##_##FIELD##_heads_table, link.key) = link.next;        \
+    } else {                                                                   \
+      hash_table_index_##COMP##_##FIELD##_heads_delete(                        \
+          &index_##COMP##_##FIELD##_heads_table, link.key);                    \
+    }                                                                          \
+    if (link.next != COMPONENT_INDEX_NONE) {                                   \
+      hash_table_index_##COMP##_##FIELD##_links_lookup(                        \
+          &index_##COMP##_##FIELD##_links_table, link.next)                    \
+          ->prev = link.prev;                                                  \
+    }                                                                          \
+    hash_table_index_##COMP##_##FIELD##_links_delete(                          \
+        &index_##COMP##_##FIELD##_links_table, ent_id);                        \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##__clear(bool reset) {                    \
+    if (reset) {                                                               \
+      index_##COMP##_##FIELD##_links_table_init();                             \
+      index_##COMP##_##FIELD##_heads_table_init();                             \
+    } else {                                                                   \
+      hash_table_index_##COMP##_##FIELD##_links_clear(                         \
+          &index_##COMP##_##FIELD##_links_table);                              \
+      hash_table_index_##COMP##_##FIELD##_heads_clear(                         \
+          &index_##COMP##_##FIELD##_heads_table);                              \
+    }                                                                          \
+  }                                                                            \
+  size_t index_##COMP##_##FIELD##_lookup(index_##COMP##_##FIELD##_key key,     \
+                                         uint32_t *out, size_t max) {          \
+    uint32_t *head = hash_table_index_##COMP##_##FIELD##_heads_lookup(         \
+        &index_##COMP##_##FIELD##_heads_table, (uint32_t)key);                 \
+    size_t n = 0;                                                              \
+    for (uint32_t id = head ? *head : COMPONENT_INDEX_NONE;                    \
+         id != COMPONENT_INDEX_NONE;                                           \
+         id = hash_table_index_##COMP##_##FIELD##_links_lookup(                \
+                  &index_##COMP##_##FIELD##_links_table, id)                   \
+                  ->next) {                                                    \
+      if (n < max) {                                                           \
+        out[n] = id;                                                           \
+      }                                                                        \
+      n++;                                                                     \
+    }                                                                          \
+    return n;                                                                  \
+  }
+
+// (value, entity) pairs sorted by value then entity, and each entity's value
+#define MAKE_RANGE_INDEX(COMP, FIELD, MAX)                                     \
+  struct index_##COMP##_##FIELD##_entry {                                      \
+    index_##COMP##_##FIELD##_key key;                                          \
+    uint32_t id;                                                               \
+  };                                                                           \
+  DEFINE_VECTOR(struct index_##COMP##_##FIELD##_entry,                         \
+                index_##COMP##_##FIELD##_entries);                             \
+  MAKE_VECTOR(struct index_##COMP##_##FIELD##_entry,                           \
+              index_##COMP##_##FIELD##_entries);                               \
+  DEFINE_HASH(index_##COMP##_##FIELD##_key, index_##COMP##_##FIELD##_keys);    \
+  MAKE_HASH(index_##COMP##_##FIELD##_key, index_##COMP##_##FIELD##_keys);      \
+  HASH_TABLE_STORAGE(index_##COMP##_##FIELD##_keys,                            \
+                     index_##COMP##_##FIELD##_keys_table, MAX);                \
+  INDEX_ENTRIES_STORAGE(COMP, FIELD, MAX);                                     \
+  /* first entry not ordered before (key, id) */                               \
+  static size_t index_##COMP##_##FIELD##__lower_bound(                         \
+      index_##COMP##_##FIELD##_key key, uint32_t id) {                         \
+    struct index_##COMP##_##FIELD##_entry *e =                                 \
+        index_##COMP##_##FIELD##_entries.data;                                 \
+    size_t lo = 0, hi = index_##COMP##_##FIELD##_entries.length;               \
+    while (lo < hi) {                                                          \
+      size_t mid = lo + (hi - lo) / 2;                                         \
+      if (e[mid].key < key || (!(key < e[mid].key) && e[mid].id < id)) {       \
+        lo = mid + 1;                                                          \
+      } else {                                                                 \
+        hi = mid;                                                              \
+      }                                                                        \
+    }                                                                          \
+    return lo;                                                                 \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##__insert(                                \
+      uint32_t ent_id, index_##COMP##_##FIELD##_key key) {                     \
+    struct vector_index_##COMP##_##FIELD##_entries *v =                        \
+        &index_##COMP##_##FIELD##_entries;                                     \
+    size_t idx = index_##COMP##_##FIELD##__lower_bound(key, ent_id);           \
+    struct index_##COMP##_##FIELD##_entry e = {key, ent_id};                   \
+    if (!hash_table_index_##COMP##_##FIELD##_keys_insert(                      \
+            &index_##COMP##_##FIELD##_keys_table, ent_id, key) ||              \
+        vector_index_##COMP##_##FIELD##_entries_push(v, e) ==                  \
+            VECTOR_PUSH_FAILED) {                                              \
+      RUNTIME_ERROR("Index %s.%s is full", #COMP, #FIELD);                     \
+    }                                                                          \
+    memmove(&v->data[idx + 1], &v->data[idx],                                  \
+            (v->length - idx - 1) * sizeof(e));                                \
+    v->data[idx] = e;                                                          \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##__remove(uint32_t ent_id) {              \
+    index_##COMP##_##FIELD##_key *key =                                        \
+        hash_table_index_##COMP##_##FIELD##_keys_lookup(                       \
+            &index_##COMP##_##FIELD##_keys_table, ent_id);                     \
+    if (!key) {                                                                \
+      return;                                                                  \
+    }                                                                          \
+    vector_index_##COMP##_##FIELD##_entries_remove(                            \
+        &index_##COMP##_##FIELD##_entries,                                     \
+        index_##COMP##_##FIELD##__lower_bound(*key, ent_id));                  \
+    hash_table_index_##COMP##_##FIELD##_keys_delete(                           \
+        &index_##COMP##_##FIELD##_keys_table, ent_id);                         \
+  }                                                                            \
+  static void index_##COMP##_##FIELD##__clear(bool reset) {                    \
+    if (reset) {                                                               \
+      index_##COMP##_##FIELD##_keys_table_init();                              \
+      index_##COMP##_##FIELD##_entries_init();                                 \
+    } else {                                                                   \
+      hash_table_index_##COMP##_##FIELD##_keys_clear(                          \
+          &index_##COMP##_##FIELD##_keys_table);                               \
+      index_##COMP##_##FIELD##_entries.length = 0;                             \
+    }                                                                          \
+  }                                                                            \
+  size_t index_##COMP##_##FIELD##_range(index_##COMP##_##FIELD##_key lo,       \
+                                        index_##COMP##_##FIELD##_key hi,       \
+                                        uint32_t *out, size_t max) {           \
+    struct vector_index_##COMP##_##FIELD##_entries *v =                        \
+        &index_##COMP##_##FIELD##_entries;                                     \
+    size_t n = 0;                                                              \
+    for (size_t i = index_##COMP##_##FIELD##__lower_bound(lo, 0);              \
+         i < v->length && !(hi < v->data[i].key); i++) {                       \
+      if (n < max) {                                                           \
+        out[n] = v->data[i].id;                                                \
+      }                                                                        \
+      n++;                                                                     \
+    }                                                                          \
+    return n;                                                                  \
+  }                                                                            \
+  size_t index_##COMP##_##FIELD##_lookup(index_##COMP##_##FIELD##_key key,     \
+                                         uint32_t *out, size_t max) {          \
+    return index_##COMP##_##FIELD##_range(key, key, out, max);                 \
+  }
+
+/**
+ * The sorted entries of a range index, see `HASH_TABLE_STORAGE`.
+ */
+#ifdef ECS_STATIC_STORAGE
+#define INDEX_ENTRIES_STORAGE(COMP, FIELD, MAX)                                \
+  static struct vector_index_##COMP##_##FIELD##_entries                        \
+      index_##COMP##_##FIELD##_entries;                                        \
+  static struct index_##COMP##_##FIELD##_entry                                 \
+      index_##COMP##_##FIELD##_entries_buf[MAX];                               \
+  static void index_##COMP##_##FIELD##_entries_init(void) {                    \
+    index_##COMP##_##FIELD##_entries =                                         \
+        vector_index_##COMP##_##FIELD##_entries_from_buffer(                   \
+            index_##COMP##_##FIELD##_entries_buf, MAX);                        \
+  }
+#else
+#define INDEX_ENTRIES_STORAGE(COMP, FIELD, MAX)                                \
+  static struct vector_index_##COMP##_##FIELD##_entries                        \
+      index_##COMP##_##FIELD##_entries;                                        \
+  static void index_##COMP##_##FIELD##_entries_init(void) {                    \
+    index_##COMP##_##FIELD##_entries =                                         \
+        vector_index_##COMP##_##FIELD##_entries_new(MAX);                      \
+  }
+#endif // ECS_STATIC_STORAGE
+
+#endif // __COMPONENT_INDEX_H_
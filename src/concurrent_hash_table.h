@@ -0,0 +1,860 @@
+#ifndef __CONCURRENT_HASH_TABLE_H_
+#define __CONCURRENT_HASH_TABLE_H_
+
+// A hash table that can be used from several threads at once
+//
+// Open addressing with linear probing. Each slot has a 64 bit tag holding its
+// state and key which is only ever changed with compare and swap:
+//
+//   EMPTY -> BUSY(k) -> READY(k) <-> WRITING(k)
+//                        ^   |
+//                        |   v
+//                      DELETED(k)
+//
+// and when the array is being copied into a bigger one, READY -> COPYING ->
+// MOVED, DELETED -> MOVED and EMPTY -> MOVED_EMPTY.
+//
+// Lookups never write and never wait. Writes are not lock free: inserts and
+// deletes wait on a slot that another thread is in the middle of writing, and
+// on a copy to a bigger array until every chunk of it has been copied, so a
+// writer preempted mid way stalls the writers that run into its slot or its
+// copy. In tables that grow a slot is only ever reused for the key that first
+// claimed it, tombstones are dropped when the array is copied. Copying is
+// cooperative: once a new array has been installed every writer that runs into
+// the old one helps copy chunks of it across, then waits for the others to
+// finish theirs.
+//
+// Fixed tables are never copied, so an insert there takes the first tombstone
+// in the run whatever its key and lookups and deletes look past tombstones and
+// unfinished inserts of their key. Two inserts of the same key may then claim
+// different slots, the one nearer the start of the run takes the other away
+// before publishing its value.
+//
+// Old arrays are retired rather than freed as readers may still be looking at
+// them, `hash_table_<name>_reclaim` frees them once no other thread is using
+// the table. Tables allocate from the allocator that was current when they were
+// created, which must be thread safe (the default libc one is).
+//
+// Pointers returned by lookup stay valid until the next resize, as with the
+// single threaded table. Writes through them are not synchronised with other
+// threads reading the same value. `HASH_TABLE_ITER` should not run at the same
+// time as inserts.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "hash_table.h"
+
+enum concurrent_hash_state {
+  CONCURRENT_HASH_EMPTY = 0,
+  CONCURRENT_HASH_BUSY,
+  CONCURRENT_HASH_READY,
+  CONCURRENT_HASH_WRITING,
+  CONCURRENT_HASH_DELETED,
+  CONCURRENT_HASH_COPYING,
+  CONCURRENT_HASH_MOVED,
+  CONCURRENT_HASH_MOVED_EMPTY,
+};
+
+enum concurrent_hash_insert_result {
+  CONCURRENT_HASH_INSERTED,
+  CONCURRENT_HASH_FULL,
+  CONCURRENT_HASH_MIGRATING,
+};
+
+static const uint32_t concurrent_hash_initial_cap = 64;
+static const uint8_t concurrent_hash_load_factor_to_grow = 75;
+// slots copied at a time by each thread helping with a resize
+static const uint32_t concurrent_hash_migrate_chunk = 256;
+
+#define CONCURRENT_HASH_TAG(STATE, KEY) (((uint64_t)(STATE) << 32) | (KEY))
+#define CONCURRENT_HASH_TAG_STATE(TAG) ((uint32_t)((TAG) >> 32))
+#define CONCURRENT_HASH_TAG_KEY(TAG) ((uint32_t)(TAG))
+
+static inline void concurrent_hash_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+#define DEFINE_CONCURRENT_HASH(VALTYPE, NAME)                                  \
+  struct hash_table_##NAME##_elem {                                            \
+    uint64_t tag;                                                              \
+    VALTYPE val;                                                               \
+  };                                                                           \
+                                                                               \
+  struct hash_table_##NAME##__array {                                          \
+    struct hash_table_##NAME##_elem *elems;                                    \
+    uint32_t cap;                                                              \
+    uint32_t mask;                                                             \
+    uint32_t resize_thresh;                                                    \
+    /* slots ever claimed, tombstones included */                              \
+    uint32_t num_used;                                                         \
+    /* next chunk to be copied and number of chunks done */                    \
+    uint32_t migrate_cursor;                                                   \
+    uint32_t migrated_chunks;                                                  \
+    struct hash_table_##NAME##__array *next;                                   \
+    struct hash_table_##NAME##__array *retired_next;                           \
+  };                                                                           \
+                                                                               \
+  struct hash_table_##NAME {                                                   \
+    struct hash_table_##NAME##__array *current;                                \
+    struct hash_table_##NAME##__array *retired;                                \
+    /* the array used by fixed tables, which never resize, and the empty */    \
+    /* one other tables start with */                                          \
+    struct hash_table_##NAME##__array fixed_array;                             \
+    uint32_t num_elems;                                                        \
+    uint32_t max_elems;                                                        \
+    /* capacity allocated by the first insert */                               \
+    uint32_t lazy_cap;                                                         \
+    struct ecs_allocator *alloc;                                               \
+    bool fixed;                                                                \
+  };                                                                           \
+  struct hash_table_##NAME *hash_table_##NAME##_new();                         \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table);              \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems);                           \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems);                     \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table);           \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v);                                  \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k);                             \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k);                                 \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table);             \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems);                        \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table);            \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out);                \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table);           \
+  static inline uint32_t hash_table_##NAME##_count(                            \
+      struct hash_table_##NAME *table) {                                       \
+    return __atomic_load_n(&table->num_elems, __ATOMIC_RELAXED);               \
+  }                                                                            \
+  struct hash_table_##NAME##__array *hash_table_##NAME##__settle(              \
+      struct hash_table_##NAME *table);                                        \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##__slot_count(                      \
+      struct hash_table_##NAME *table) {                                       \
+    return hash_table_##NAME##__settle(table)->cap;                            \
+  }                                                                            \
+                                                                               \
+  static inline VALTYPE *hash_table_##NAME##__slot(                            \
+      struct hash_table_##NAME *table, uint32_t idx, uint32_t *key) {          \
+    struct hash_table_##NAME##__array *arr =                                   \
+        __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);                    \
+    struct hash_table_##NAME##_elem *e = &arr->elems[idx];                     \
+    uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                 \
+    uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                           \
+                                                                               \
+    if (state != CONCURRENT_HASH_READY && state != CONCURRENT_HASH_WRITING) {  \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    *key = CONCURRENT_HASH_TAG_KEY(tag);                                       \
+    return &e->val;                                                            \
+  }
+
+#define MAKE_CONCURRENT_HASH(VALTYPE, NAME)                                    \
+  static uint32_t hash_table_##NAME##__hash_fun(uint32_t k) {                  \
+    const uint32_t hash_constant = 0x45d9f3b;                                  \
+                                                                               \
+    k = ((k >> 16) ^ k) * hash_constant;                                       \
+    k = ((k >> 16) ^ k) * hash_constant;                                       \
+    k = ((k >> 16) ^ k) * hash_constant;                                       \
+                                                                               \
+    return k;                                                                  \
+  }                                                                            \
+                                                                               \
+  static struct hash_table_##NAME##__array *hash_table_##NAME##__array_new(    \
+      struct ecs_allocator *alloc, uint32_t cap) {                             \
+    struct hash_table_##NAME##__array *arr =                                   \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME##__array));           \
+                                                                               \
+    arr->elems =                                                               \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME##_elem) * cap);       \
+    arr->cap = cap;                                                            \
+    arr->mask = cap - 1;                                                       \
+    arr->resize_thresh = (cap * concurrent_hash_load_factor_to_grow) / 100;    \
+                                                                               \
+    return arr;                                                                \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__array_free(                                 \
+      struct ecs_allocator *alloc, struct hash_table_##NAME##__array *arr) {   \
+    ecs_free(alloc, arr->elems,                                                \
+             sizeof(struct hash_table_##NAME##_elem) * arr->cap);              \
+    ecs_free(alloc, arr, sizeof(struct hash_table_##NAME##__array));           \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__retire(                                     \
+      struct hash_table_##NAME *table,                                         \
+      struct hash_table_##NAME##__array *arr) {                                \
+    struct hash_table_##NAME##__array *head =                                  \
+        __atomic_load_n(&table->retired, __ATOMIC_RELAXED);                    \
+                                                                               \
+    do {                                                                       \
+      arr->retired_next = head;                                                \
+    } while (!__atomic_compare_exchange_n(&table->retired, &head, arr, true,   \
+                                          __ATOMIC_RELEASE,                    \
+                                          __ATOMIC_RELAXED));                  \
+  }                                                                            \
+                                                                               \
+  /* copy a live value into the array being migrated to, keys are unique */    \
+  static void hash_table_##NAME##__copy_into(                                  \
+      struct hash_table_##NAME##__array *arr, uint32_t k, VALTYPE *v) {        \
+    uint32_t idx = hash_table_##NAME##__hash_fun(k) & arr->mask;               \
+                                                                               \
+    for (;;) {                                                                 \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = CONCURRENT_HASH_TAG(CONCURRENT_HASH_EMPTY, 0);            \
+                                                                               \
+      if (__atomic_compare_exchange_n(                                         \
+              &e->tag, &tag, CONCURRENT_HASH_TAG(CONCURRENT_HASH_BUSY, k),     \
+              false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {                    \
+        e->val = *v;                                                           \
+        __atomic_store_n(&e->tag,                                              \
+                         CONCURRENT_HASH_TAG(CONCURRENT_HASH_READY, k),        \
+                         __ATOMIC_RELEASE);                                    \
+        __atomic_fetch_add(&arr->num_used, 1, __ATOMIC_RELAXED);               \
+        return;                                                                \
+      }                                                                        \
+                                                                               \
+      idx = (idx + 1) & arr->mask;                                             \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__migrate_slot(                               \
+      struct hash_table_##NAME##__array *arr,                                  \
+      struct hash_table_##NAME##__array *next, uint32_t idx) {                 \
+    struct hash_table_##NAME##_elem *e = &arr->elems[idx];                     \
+    uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                 \
+                                                                               \
+    for (;;) {                                                                 \
+      uint32_t k = CONCURRENT_HASH_TAG_KEY(tag);                               \
+      uint64_t frozen;                                                         \
+                                                                               \
+      switch (CONCURRENT_HASH_TAG_STATE(tag)) {                                \
+      case CONCURRENT_HASH_BUSY:                                               \
+      case CONCURRENT_HASH_WRITING:                                            \
+        /* a writer is mid way through this slot, let it finish */             \
+        concurrent_hash_pause();                                               \
+        tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                      \
+        continue;                                                              \
+      case CONCURRENT_HASH_READY:                                              \
+        frozen = CONCURRENT_HASH_TAG(CONCURRENT_HASH_COPYING, k);              \
+                                                                               \
+        if (__atomic_compare_exchange_n(&e->tag, &tag, frozen, false,          \
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) { \
+          hash_table_##NAME##__copy_into(next, k, &e->val);                    \
+          __atomic_store_n(&e->tag,                                            \
+                           CONCURRENT_HASH_TAG(CONCURRENT_HASH_MOVED, k),      \
+                           __ATOMIC_RELEASE);                                  \
+          return;                                                              \
+        }                                                                      \
+        continue;                                                              \
+      case CONCURRENT_HASH_EMPTY:                                              \
+        frozen = CONCURRENT_HASH_TAG(CONCURRENT_HASH_MOVED_EMPTY, 0);          \
+        break;                                                                 \
+      case CONCURRENT_HASH_DELETED:                                            \
+        frozen = CONCURRENT_HASH_TAG(CONCURRENT_HASH_MOVED, k);                \
+        break;                                                                 \
+      default:                                                                 \
+        /* chunks are only ever copied by one thread */                        \
+        return;                                                                \
+      }                                                                        \
+                                                                               \
+      if (__atomic_compare_exchange_n(&e->tag, &tag, frozen, false,            \
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {   \
+        return;                                                                \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* copy chunks of `arr` across until there are none left, then wait for */   \
+  /* the other helpers to finish theirs */                                     \
+  static void hash_table_##NAME##__help_migrate(                               \
+      struct hash_table_##NAME *table,                                         \
+      struct hash_table_##NAME##__array *arr) {                                \
+    struct hash_table_##NAME##__array *next =                                  \
+        __atomic_load_n(&arr->next, __ATOMIC_ACQUIRE);                         \
+    uint32_t num_chunks = (arr->cap + concurrent_hash_migrate_chunk - 1) /     \
+                          concurrent_hash_migrate_chunk;                       \
+                                                                               \
+    /* the empty starting array has nothing to copy and isn't freed */         \
+    if (!num_chunks) {                                                         \
+      __atomic_compare_exchange_n(&table->current, &arr, next, false,          \
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED);         \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    while (__atomic_load_n(&arr->migrate_cursor, __ATOMIC_RELAXED) <           \
+           num_chunks) {                                                       \
+      uint32_t chunk =                                                         \
+          __atomic_fetch_add(&arr->migrate_cursor, 1, __ATOMIC_RELAXED);       \
+                                                                               \
+      if (chunk >= num_chunks) {                                               \
+        break;                                                                 \
+      }                                                                        \
+                                                                               \
+      uint32_t start = chunk * concurrent_hash_migrate_chunk;                  \
+      uint32_t end = MIN(start + concurrent_hash_migrate_chunk, arr->cap);     \
+                                                                               \
+      for (uint32_t i = start; i < end; i++) {                                 \
+        hash_table_##NAME##__migrate_slot(arr, next, i);                       \
+      }                                                                        \
+                                                                               \
+      if (__atomic_add_fetch(&arr->migrated_chunks, 1, __ATOMIC_ACQ_REL) ==    \
+          num_chunks) {                                                        \
+        __atomic_store_n(&table->current, next, __ATOMIC_RELEASE);             \
+        hash_table_##NAME##__retire(table, arr);                               \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    while (__atomic_load_n(&table->current, __ATOMIC_ACQUIRE) == arr) {        \
+      concurrent_hash_pause();                                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__start_resize(                               \
+      struct hash_table_##NAME *table,                                         \
+      struct hash_table_##NAME##__array *arr) {                                \
+    if (__atomic_load_n(&arr->next, __ATOMIC_ACQUIRE)) {                       \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    /* leave room for the live elements to double, an array that filled up */  \
+    /* with tombstones is rebuilt at the same size */                          \
+    uint32_t live = __atomic_load_n(&table->num_elems, __ATOMIC_RELAXED);      \
+    uint32_t cap = MAX(arr->cap, table->lazy_cap);                             \
+                                                                               \
+    while ((cap * concurrent_hash_load_factor_to_grow) / 100 <= live * 2) {    \
+      cap *= 2;                                                                \
+    }                                                                          \
+                                                                               \
+    struct hash_table_##NAME##__array *next =                                  \
+        hash_table_##NAME##__array_new(table->alloc, cap);                     \
+    struct hash_table_##NAME##__array *expected = NULL;                        \
+                                                                               \
+    if (!__atomic_compare_exchange_n(&arr->next, &expected, next, false,       \
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {    \
+      hash_table_##NAME##__array_free(table->alloc, next);                     \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* count a new live element, fixed tables refuse to go over capacity */      \
+  static bool hash_table_##NAME##__reserve(struct hash_table_##NAME *table) {  \
+    uint32_t n = __atomic_add_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);   \
+                                                                               \
+    if (table->fixed && n > table->max_elems) {                                \
+      __atomic_sub_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);              \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static enum concurrent_hash_insert_result hash_table_##NAME##__insert(       \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##__array *arr, \
+      uint32_t k, VALTYPE *v) {                                                \
+    uint32_t idx = hash_table_##NAME##__hash_fun(k) & arr->mask;               \
+                                                                               \
+    for (uint32_t probes = 0; probes < arr->cap; probes++) {                   \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);               \
+                                                                               \
+      for (;;) {                                                               \
+        uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                       \
+        bool claiming = state == CONCURRENT_HASH_EMPTY ||                      \
+                        state == CONCURRENT_HASH_DELETED;                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_COPYING ||                                \
+            state == CONCURRENT_HASH_MOVED ||                                  \
+            state == CONCURRENT_HASH_MOVED_EMPTY) {                            \
+          return CONCURRENT_HASH_MIGRATING;                                    \
+        }                                                                      \
+                                                                               \
+        if (state != CONCURRENT_HASH_EMPTY &&                                  \
+            CONCURRENT_HASH_TAG_KEY(tag) != k) {                               \
+          break;                                                               \
+        }                                                                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_BUSY ||                                   \
+            state == CONCURRENT_HASH_WRITING) {                                \
+          concurrent_hash_pause();                                             \
+          tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                    \
+          continue;                                                            \
+        }                                                                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_EMPTY &&                                  \
+            __atomic_load_n(&arr->num_used, __ATOMIC_RELAXED) >=               \
+                arr->resize_thresh) {                                          \
+          return CONCURRENT_HASH_FULL;                                         \
+        }                                                                      \
+                                                                               \
+        if (claiming && !hash_table_##NAME##__reserve(table)) {                \
+          return CONCURRENT_HASH_FULL;                                         \
+        }                                                                      \
+                                                                               \
+        uint64_t writing = CONCURRENT_HASH_TAG(                                \
+            claiming ? CONCURRENT_HASH_BUSY : CONCURRENT_HASH_WRITING, k);     \
+                                                                               \
+        if (__atomic_compare_exchange_n(&e->tag, &tag, writing, false,         \
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) { \
+          e->val = *v;                                                         \
+          __atomic_store_n(&e->tag,                                            \
+                           CONCURRENT_HASH_TAG(CONCURRENT_HASH_READY, k),      \
+                           __ATOMIC_RELEASE);                                  \
+                                                                               \
+          if (state == CONCURRENT_HASH_EMPTY) {                                \
+            __atomic_fetch_add(&arr->num_used, 1, __ATOMIC_RELAXED);           \
+          }                                                                    \
+                                                                               \
+          return CONCURRENT_HASH_INSERTED;                                     \
+        }                                                                      \
+                                                                               \
+        /* lost the race for the slot, look at it again */                     \
+        if (claiming) {                                                        \
+          __atomic_sub_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);          \
+        }                                                                      \
+      }                                                                        \
+                                                                               \
+      idx = (idx + 1) & arr->mask;                                             \
+    }                                                                          \
+                                                                               \
+    return CONCURRENT_HASH_FULL;                                               \
+  }                                                                            \
+                                                                               \
+  /* whether a claim of slot `mine` for k in a fixed table gives way to */     \
+  /* another: a published value wins, otherwise the claim nearer the start */  \
+  /* of the run does and takes the later ones away */                          \
+  static bool hash_table_##NAME##__claim_lost(                                 \
+      struct hash_table_##NAME##__array *arr, uint32_t k, uint32_t home,       \
+      uint32_t mine) {                                                         \
+    uint32_t mine_probes = (mine - home) & arr->mask;                          \
+                                                                               \
+    for (uint32_t probes = 0, idx = home; probes < arr->cap;                   \
+         probes++, idx = (idx + 1) & arr->mask) {                              \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);               \
+                                                                               \
+      for (;;) {                                                               \
+        uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                       \
+                                                                               \
+        if (state == CONCURRENT_HASH_EMPTY) {                                  \
+          return false;                                                        \
+        }                                                                      \
+                                                                               \
+        if (idx == mine || CONCURRENT_HASH_TAG_KEY(tag) != k ||                \
+            state == CONCURRENT_HASH_DELETED) {                                \
+          break;                                                               \
+        }                                                                      \
+                                                                               \
+        if (state != CONCURRENT_HASH_BUSY || probes < mine_probes) {           \
+          return true;                                                         \
+        }                                                                      \
+                                                                               \
+        uint64_t deleted = CONCURRENT_HASH_TAG(CONCURRENT_HASH_DELETED, k);    \
+                                                                               \
+        if (__atomic_compare_exchange_n(&e->tag, &tag, deleted, false,         \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { \
+          break;                                                               \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  /* fixed tables never copy their tombstones away, so an insert takes the */  \
+  /* first deleted slot of any key in the run. Another insert of k may be */   \
+  /* claiming a slot at the same time, the value is only published if this */  \
+  /* claim doesn't lose to it */                                               \
+  static enum concurrent_hash_insert_result hash_table_##NAME##__insert_fixed( \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##__array *arr, \
+      uint32_t k, VALTYPE *v) {                                                \
+    uint32_t home = hash_table_##NAME##__hash_fun(k) & arr->mask;              \
+    uint64_t busy = CONCURRENT_HASH_TAG(CONCURRENT_HASH_BUSY, k);              \
+    uint64_t deleted = CONCURRENT_HASH_TAG(CONCURRENT_HASH_DELETED, k);        \
+                                                                               \
+  retry:;                                                                      \
+    /* the first tombstone in the run or the empty slot ending it, MOVED */    \
+    /* while there is neither */                                               \
+    uint32_t free_idx = 0;                                                     \
+    uint64_t free_tag = CONCURRENT_HASH_TAG(CONCURRENT_HASH_MOVED, 0);         \
+                                                                               \
+    for (uint32_t probes = 0, idx = home; probes < arr->cap;                   \
+         probes++, idx = (idx + 1) & arr->mask) {                              \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);               \
+                                                                               \
+      for (;;) {                                                               \
+        uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                       \
+                                                                               \
+        if (state == CONCURRENT_HASH_EMPTY ||                                  \
+            state == CONCURRENT_HASH_DELETED) {                                \
+          if (CONCURRENT_HASH_TAG_STATE(free_tag) == CONCURRENT_HASH_MOVED) {  \
+            free_idx = idx;                                                    \
+            free_tag = tag;                                                    \
+          }                                                                    \
+          if (state == CONCURRENT_HASH_EMPTY) {                                \
+            goto claim;                                                        \
+          }                                                                    \
+          break;                                                               \
+        }                                                                      \
+                                                                               \
+        if (CONCURRENT_HASH_TAG_KEY(tag) != k) {                               \
+          break;                                                               \
+        }                                                                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_BUSY ||                                   \
+            state == CONCURRENT_HASH_WRITING) {                                \
+          concurrent_hash_pause();                                             \
+          tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                    \
+          continue;                                                            \
+        }                                                                      \
+                                                                               \
+        uint64_t writing = CONCURRENT_HASH_TAG(CONCURRENT_HASH_WRITING, k);    \
+                                                                               \
+        if (__atomic_compare_exchange_n(&e->tag, &tag, writing, false,         \
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) { \
+          e->val = *v;                                                         \
+          __atomic_store_n(&e->tag,                                            \
+                           CONCURRENT_HASH_TAG(CONCURRENT_HASH_READY, k),      \
+                           __ATOMIC_RELEASE);                                  \
+          return CONCURRENT_HASH_INSERTED;                                     \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+  claim:;                                                                      \
+    uint32_t free_state = CONCURRENT_HASH_TAG_STATE(free_tag);                 \
+                                                                               \
+    if (free_state == CONCURRENT_HASH_MOVED ||                                 \
+        (free_state == CONCURRENT_HASH_EMPTY &&                                \
+         __atomic_load_n(&arr->num_used, __ATOMIC_RELAXED) >=                  \
+             arr->resize_thresh) ||                                            \
+        !hash_table_##NAME##__reserve(table)) {                                \
+      return CONCURRENT_HASH_FULL;                                             \
+    }                                                                          \
+                                                                               \
+    struct hash_table_##NAME##_elem *e = &arr->elems[free_idx];                \
+    uint64_t tag = busy;                                                       \
+                                                                               \
+    if (!__atomic_compare_exchange_n(&e->tag, &free_tag, busy, false,          \
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {    \
+      __atomic_sub_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);              \
+      goto retry;                                                              \
+    }                                                                          \
+                                                                               \
+    if (free_state == CONCURRENT_HASH_EMPTY) {                                 \
+      __atomic_fetch_add(&arr->num_used, 1, __ATOMIC_RELAXED);                 \
+    }                                                                          \
+                                                                               \
+    e->val = *v;                                                               \
+                                                                               \
+    if (hash_table_##NAME##__claim_lost(arr, k, home, free_idx) ||             \
+        !__atomic_compare_exchange_n(                                          \
+            &e->tag, &tag, CONCURRENT_HASH_TAG(CONCURRENT_HASH_READY, k),      \
+            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {                      \
+      /* leave a tombstone, unless a claim before this one already did */      \
+      tag = busy;                                                              \
+      __atomic_compare_exchange_n(&e->tag, &tag, deleted, false,               \
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);         \
+      __atomic_sub_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);              \
+      goto retry;                                                              \
+    }                                                                          \
+                                                                               \
+    return CONCURRENT_HASH_INSERTED;                                           \
+  }                                                                            \
+                                                                               \
+  struct hash_table_##NAME##__array *hash_table_##NAME##__settle(              \
+      struct hash_table_##NAME *table) {                                       \
+    struct hash_table_##NAME##__array *arr;                                    \
+                                                                               \
+    while ((arr = __atomic_load_n(&table->current, __ATOMIC_ACQUIRE)),         \
+           __atomic_load_n(&arr->next, __ATOMIC_ACQUIRE)) {                    \
+      hash_table_##NAME##__help_migrate(table, arr);                           \
+    }                                                                          \
+                                                                               \
+    return arr;                                                                \
+  }                                                                            \
+                                                                               \
+  struct hash_table_##NAME *hash_table_##NAME##_new() {                        \
+    struct ecs_allocator *alloc = ecs_current_allocator();                     \
+    struct hash_table_##NAME *table =                                          \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME));                    \
+    hash_table_##NAME##_init(table, 0);                                        \
+    return table;                                                              \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table) {             \
+    hash_table_##NAME##_destroy(table);                                        \
+    ecs_free(table->alloc, table, sizeof(struct hash_table_##NAME));           \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems) {                          \
+    uint32_t cap = concurrent_hash_initial_cap;                                \
+                                                                               \
+    while ((cap * concurrent_hash_load_factor_to_grow) / 100 <= num_elems) {   \
+      cap *= 2;                                                                \
+    }                                                                          \
+                                                                               \
+    /* nothing is allocated until the first insert resizes the empty array */  \
+    memset(table, 0, sizeof(struct hash_table_##NAME));                        \
+    table->alloc = ecs_current_allocator();                                    \
+    table->lazy_cap = cap;                                                     \
+    table->current = &table->fixed_array;                                      \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems) {                    \
+    memset(table, 0, sizeof(struct hash_table_##NAME));                        \
+    memset(elems, 0, sizeof(struct hash_table_##NAME##_elem) * cap);           \
+    table->fixed_array.elems = elems;                                          \
+    table->fixed_array.cap = cap;                                              \
+    table->fixed_array.mask = cap - 1;                                         \
+    table->fixed_array.resize_thresh = cap;                                    \
+    table->current = &table->fixed_array;                                      \
+    table->max_elems = max_elems;                                              \
+    table->fixed = true;                                                       \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table) {          \
+    hash_table_##NAME##_reclaim(table);                                        \
+                                                                               \
+    if (table->fixed) {                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    if (table->current->next) {                                                \
+      hash_table_##NAME##__array_free(table->alloc, table->current->next);     \
+    }                                                                          \
+    if (table->current != &table->fixed_array) {                               \
+      hash_table_##NAME##__array_free(table->alloc, table->current);           \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v) {                                 \
+    for (;;) {                                                                 \
+      struct hash_table_##NAME##__array *arr =                                 \
+          hash_table_##NAME##__settle(table);                                  \
+                                                                               \
+      enum concurrent_hash_insert_result result =                              \
+          table->fixed ? hash_table_##NAME##__insert_fixed(table, arr, k, &v)  \
+                       : hash_table_##NAME##__insert(table, arr, k, &v);       \
+                                                                               \
+      switch (result) {                                                        \
+      case CONCURRENT_HASH_INSERTED:                                           \
+        return true;                                                           \
+      case CONCURRENT_HASH_FULL:                                               \
+        if (table->fixed) {                                                    \
+          return false;                                                        \
+        }                                                                      \
+        hash_table_##NAME##__start_resize(table, arr);                         \
+        break;                                                                 \
+      case CONCURRENT_HASH_MIGRATING:                                          \
+        break;                                                                 \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k) {                            \
+    struct hash_table_##NAME##__array *arr =                                   \
+        __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);                    \
+    uint32_t hash = hash_table_##NAME##__hash_fun(k);                          \
+                                                                               \
+  next_array:                                                                  \
+    for (uint32_t probes = 0, idx = hash & arr->mask; probes < arr->cap;       \
+         probes++, idx = (idx + 1) & arr->mask) {                              \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);               \
+      uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                         \
+                                                                               \
+      if (state == CONCURRENT_HASH_EMPTY ||                                    \
+          state == CONCURRENT_HASH_MOVED_EMPTY) {                              \
+        return NULL;                                                           \
+      }                                                                        \
+                                                                               \
+      if (CONCURRENT_HASH_TAG_KEY(tag) != k) {                                 \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      switch (state) {                                                         \
+      case CONCURRENT_HASH_READY:                                              \
+      case CONCURRENT_HASH_WRITING:                                            \
+      case CONCURRENT_HASH_COPYING:                                            \
+        return &e->val;                                                        \
+      case CONCURRENT_HASH_MOVED:                                              \
+        arr = __atomic_load_n(&arr->next, __ATOMIC_ACQUIRE);                   \
+        goto next_array;                                                       \
+      default:                                                                 \
+        /* deleted, or an insert that hasn't finished yet. In fixed tables */  \
+        /* the key may have been inserted again further on */                  \
+        if (table->fixed) {                                                    \
+          continue;                                                            \
+        }                                                                      \
+        return NULL;                                                           \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k) {                                \
+  retry:;                                                                      \
+    struct hash_table_##NAME##__array *arr =                                   \
+        hash_table_##NAME##__settle(table);                                    \
+                                                                               \
+    uint32_t hash = hash_table_##NAME##__hash_fun(k);                          \
+                                                                               \
+    for (uint32_t probes = 0, idx = hash & arr->mask; probes < arr->cap;       \
+         probes++, idx = (idx + 1) & arr->mask) {                              \
+      struct hash_table_##NAME##_elem *e = &arr->elems[idx];                   \
+      uint64_t tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);               \
+                                                                               \
+      for (;;) {                                                               \
+        uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                       \
+                                                                               \
+        if (state == CONCURRENT_HASH_EMPTY) {                                  \
+          return false;                                                        \
+        }                                                                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_COPYING ||                                \
+            state == CONCURRENT_HASH_MOVED ||                                  \
+            state == CONCURRENT_HASH_MOVED_EMPTY) {                            \
+          goto retry;                                                          \
+        }                                                                      \
+                                                                               \
+        if (CONCURRENT_HASH_TAG_KEY(tag) != k) {                               \
+          break;                                                               \
+        }                                                                      \
+                                                                               \
+        if (state == CONCURRENT_HASH_WRITING) {                                \
+          concurrent_hash_pause();                                             \
+          tag = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);                    \
+          continue;                                                            \
+        }                                                                      \
+                                                                               \
+        if (state != CONCURRENT_HASH_READY) {                                  \
+          if (table->fixed) {                                                  \
+            break;                                                             \
+          }                                                                    \
+          return false;                                                        \
+        }                                                                      \
+                                                                               \
+        uint64_t deleted = CONCURRENT_HASH_TAG(CONCURRENT_HASH_DELETED, k);    \
+                                                                               \
+        if (__atomic_compare_exchange_n(&e->tag, &tag, deleted, false,         \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { \
+          __atomic_sub_fetch(&table->num_elems, 1, __ATOMIC_RELAXED);          \
+          return true;                                                         \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  /* not thread safe, like reclaim */                                          \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table) {            \
+    struct hash_table_##NAME##__array *arr =                                   \
+        hash_table_##NAME##__settle(table);                                    \
+                                                                               \
+    if (arr->cap) {                                                            \
+      memset(arr->elems, 0,                                                    \
+             sizeof(struct hash_table_##NAME##_elem) * arr->cap);              \
+    }                                                                          \
+    arr->num_used = 0;                                                         \
+    table->num_elems = 0;                                                      \
+  }                                                                            \
+                                                                               \
+  /* only sizes the first array, a table already in use grows as it fills */   \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems) {                       \
+    uint32_t cap = table->lazy_cap;                                            \
+                                                                               \
+    if (table->fixed ||                                                        \
+        __atomic_load_n(&table->current, __ATOMIC_ACQUIRE) !=                  \
+            &table->fixed_array) {                                             \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    while ((cap * concurrent_hash_load_factor_to_grow) / 100 <= num_elems) {   \
+      cap *= 2;                                                                \
+    }                                                                          \
+    table->lazy_cap = cap;                                                     \
+  }                                                                            \
+                                                                               \
+  /* arrays only ever grow, a smaller one would need its own migration */      \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table) {}          \
+                                                                               \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out) {               \
+    struct hash_table_##NAME##__array *arr =                                   \
+        __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);                    \
+    uint64_t total_probes = 0;                                                 \
+                                                                               \
+    memset(out, 0, sizeof(*out));                                              \
+    out->cap = arr->cap;                                                       \
+    out->bytes_allocated = sizeof(struct hash_table_##NAME##_elem) * arr->cap; \
+                                                                               \
+    for (uint32_t i = 0; i < arr->cap; i++) {                                  \
+      uint64_t tag = __atomic_load_n(&arr->elems[i].tag, __ATOMIC_RELAXED);    \
+      uint32_t state = CONCURRENT_HASH_TAG_STATE(tag);                         \
+                                                                               \
+      if (state == CONCURRENT_HASH_DELETED) {                                  \
+        out->num_tombstones++;                                                 \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      if (state != CONCURRENT_HASH_READY &&                                    \
+          state != CONCURRENT_HASH_WRITING) {                                  \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      uint32_t home =                                                          \
+          hash_table_##NAME##__hash_fun(CONCURRENT_HASH_TAG_KEY(tag)) &        \
+          arr->mask;                                                           \
+      uint32_t probes = (i - home) & arr->mask;                                \
+      uint32_t bucket = probes < HASH_TABLE_STATS_HIST_BUCKETS                 \
+                            ? probes                                           \
+                            : HASH_TABLE_STATS_HIST_BUCKETS - 1;               \
+                                                                               \
+      out->num_elems++;                                                        \
+      out->probe_hist[bucket]++;                                               \
+      total_probes += probes;                                                  \
+      if (probes > out->max_probes) {                                          \
+        out->max_probes = probes;                                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    if (out->num_elems) {                                                      \
+      out->mean_probes = (double)total_probes / out->num_elems;                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table) {          \
+    struct hash_table_##NAME##__array *arr =                                   \
+        __atomic_exchange_n(&table->retired, NULL, __ATOMIC_ACQUIRE);          \
+                                                                               \
+    while (arr) {                                                              \
+      struct hash_table_##NAME##__array *next = arr->retired_next;             \
+      hash_table_##NAME##__array_free(table->alloc, arr);                      \
+      arr = next;                                                              \
+    }                                                                          \
+  }
+
+#endif // __CONCURRENT_HASH_TABLE_H_
@@ -6,16 +6,34 @@
 
 static uint32_t id_counter = 0;
 
-uint32_t new_entity_id(void) {
-  if (id_counter == UINT32_MAX) {
-    fprintf(stderr, "out of entities");
-    exit(1);
+uint32_t new_entity_id(void) { return new_entity_id_block(1); }
+
+uint32_t new_entity_id_block(uint32_t n) {
+  uint32_t first = __atomic_load_n(&id_counter, __ATOMIC_RELAXED);
+
+  do {
+    if (UINT32_MAX - first < n) {
+      fprintf(stderr, "out of entities");
+      exit(1);
+    }
+  } while (!__atomic_compare_exchange_n(&id_counter, &first, first + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return first;
+}
+
+uint32_t entity_id_block_next(struct entity_id_block *block) {
+  if (block->next == block->end) {
+    block->next = new_entity_id_block(entity_id_block_size);
+    block->end = block->next + entity_id_block_size;
   }
 
-  return id_counter++;
+  return block->next++;
 }
 
-void reset_ent_counter(void) { id_counter = 0; }
+void reset_ent_counter(void) {
+  __atomic_store_n(&id_counter, 0, __ATOMIC_RELAXED);
+}
 
 void kill_entity(uint32_t id) {
   for (struct component_def **s = ({
@@ -44,3 +62,45 @@ void remove_all_entities(void) {
     (*s)->clear_everything();
   }
 }
+
+void reset_component_storage(void) {
+  for (struct component_def **s = ({
+         extern struct component_def *__start_component_def_array;
+         &__start_component_def_array;
+       });
+       s != ({
+         extern struct component_def *__stop_component_def_array;
+         &__stop_component_def_array;
+       });
+       s++) {
+    (*s)->reset_storage();
+  }
+}
+
+void reclaim_component_storage(void) {
+  for (struct component_def **s = ({
+         extern struct component_def *__start_component_def_array;
+         &__start_component_def_array;
+       });
+       s != ({
+         extern struct component_def *__stop_component_def_array;
+         &__stop_component_def_array;
+       });
+       s++) {
+    (*s)->reclaim();
+  }
+}
+
+void shrink_component_storage(void) {
+  for (struct component_def **s = ({
+         extern struct component_def *__start_component_def_array;
+         &__start_component_def_array;
+       });
+       s != ({
+         extern struct component_def *__stop_component_def_array;
+         &__stop_component_def_array;
+       });
+       s++) {
+    (*s)->shrink();
+  }
+}
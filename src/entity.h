@@ -3,12 +3,59 @@
 
 #include <stdint.h>
 
+static const uint32_t entity_id_block_size = 1024;
+
 /**
- * Get a new entity id.
+ * Get a new entity id, safe to call from any thread.
  */
 uint32_t new_entity_id(void);
+
+/**
+ * Reserve `n` consecutive entity ids, returns the first one. Safe to call from
+ * any thread.
+ */
+uint32_t new_entity_id_block(uint32_t n);
+
+/**
+ * A block of entity ids owned by one thread, so spawning from a worker doesn't
+ * touch the shared counter for every entity. Zero initialise it.
+ */
+struct entity_id_block {
+  uint32_t next;
+  uint32_t end;
+};
+
+/**
+ * Get a new entity id from a block, reserving a new block when it runs out.
+ */
+uint32_t entity_id_block_next(struct entity_id_block *block);
+
 void reset_ent_counter(void);
 void kill_entity(uint32_t id);
 void remove_all_entities(void);
 
+/**
+ * Forget the storage of every component without freeing it and start again
+ * with empty tables from the current allocator.
+ *
+ * Used to throw away a whole world in one go after releasing the arena its
+ * storage was allocated from with `ecs_arena_release`.
+ */
+void reset_component_storage(void);
+
+/**
+ * Free memory that concurrent component tables retired while resizing.
+ *
+ * Must be called at a point where no other thread is using any component, for
+ * example once per tick after the worker threads have finished.
+ */
+void reclaim_component_storage(void);
+
+/**
+ * Shrink the storage of every component to fit the values it holds now, for
+ * after many entities were killed or hibernated. Concurrent tables keep their
+ * size and segmented tables keep their records.
+ */
+void shrink_component_storage(void);
+
 #endif // __ENTITY_H_
@@ -0,0 +1,601 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "entity_set.h"
+#include "hash_set.h"
+
+// out of order inserts and deletes move every sorted id after them, past this
+// many ids a set switches to a bitmap or hash instead
+static const uint32_t entity_set_max_sorted_shift = 4096;
+
+static const uint32_t entity_set_min_ids_cap = 16;
+
+// Storage of each representation
+
+static void entity_set__free_ids(struct entity_set *set) {
+  if (set->ids_cap) {
+    ecs_free(set->alloc, set->ids, sizeof(uint32_t) * set->ids_cap);
+  }
+  set->ids = NULL;
+  set->ids_cap = 0;
+}
+
+static void entity_set__free_words(struct entity_set *set) {
+  if (set->num_words) {
+    ecs_free(set->alloc, set->words, sizeof(uint64_t) * set->num_words);
+  }
+  set->words = NULL;
+  set->num_words = 0;
+  set->base = 0;
+}
+
+static void entity_set__free_hash(struct entity_set *set) {
+  if (set->hash) {
+    hash_set_free(set->hash);
+  }
+  set->hash = NULL;
+}
+
+static void entity_set__reserve_ids(struct entity_set *set, uint32_t n) {
+  if (n <= set->ids_cap) {
+    return;
+  }
+
+  uint32_t cap = MAX(MAX(n, set->ids_cap * 2), entity_set_min_ids_cap);
+
+  if (set->ids_cap) {
+    set->ids = ecs_realloc(set->alloc, set->ids,
+                           sizeof(uint32_t) * set->ids_cap,
+                           sizeof(uint32_t) * cap);
+  } else {
+    set->ids = ecs_alloc(set->alloc, sizeof(uint32_t) * cap);
+  }
+  set->ids_cap = cap;
+}
+
+// zeroed words for ids `base` to `base + num_words * 64 - 1`
+static uint64_t *entity_set__new_words(struct entity_set *set,
+                                       uint32_t num_words) {
+  uint64_t *words = ecs_alloc(set->alloc, sizeof(uint64_t) * num_words);
+
+  memset(words, 0, sizeof(uint64_t) * num_words);
+  return words;
+}
+
+static uint32_t entity_set__num_words(uint32_t lo, uint32_t hi) {
+  return hi / 64 - lo / 64 + 1;
+}
+
+// whether a bitmap over `lo` to `hi` is no bigger than `count` sorted ids
+static bool entity_set__dense(uint32_t count, uint32_t lo, uint32_t hi) {
+  return (uint64_t)entity_set__num_words(lo, hi) * sizeof(uint64_t) <=
+         (uint64_t)count * sizeof(uint32_t);
+}
+
+static uint32_t entity_set__popcount(const uint64_t *words, uint32_t n) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < n; i++) {
+    count += __builtin_popcountll(words[i]);
+  }
+  return count;
+}
+
+static void entity_set__set_bit(struct entity_set *set, uint32_t id) {
+  uint32_t bit = id - set->base;
+
+  set->words[bit / 64] |= 1ull << (bit % 64);
+}
+
+static int entity_set__compare_ids(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Conversions, each leaves the set in the new form only
+
+static void entity_set__to_sorted(struct entity_set *set) {
+  uint32_t n = 0;
+
+  if (set->kind == ENTITY_SET_SORTED) {
+    return;
+  }
+
+  entity_set__reserve_ids(set, set->count);
+  if (set->kind == ENTITY_SET_BITMAP) {
+    FOR_EACH_ENTITY_SET(set, id, { set->ids[n++] = id; });
+    entity_set__free_words(set);
+  } else {
+    HASH_SET_ITER(id, set->hash, { set->ids[n++] = id; });
+    entity_set__free_hash(set);
+    qsort(set->ids, n, sizeof(uint32_t), &entity_set__compare_ids);
+  }
+  set->kind = ENTITY_SET_SORTED;
+}
+
+static void entity_set__to_bitmap(struct entity_set *set) {
+  entity_set__to_sorted(set);
+
+  uint32_t lo = set->ids[0], hi = set->ids[set->count - 1];
+
+  set->base = lo & ~63u;
+  set->num_words = entity_set__num_words(lo, hi);
+  set->words = entity_set__new_words(set, set->num_words);
+  for (uint32_t i = 0; i < set->count; i++) {
+    entity_set__set_bit(set, set->ids[i]);
+  }
+  entity_set__free_ids(set);
+  set->kind = ENTITY_SET_BITMAP;
+}
+
+static void entity_set__to_hash(struct entity_set *set) {
+  struct ecs_allocator *prev = ecs_set_allocator(set->alloc);
+  struct hash_set *hash = hash_set_new();
+
+  ecs_set_allocator(prev);
+  FOR_EACH_ENTITY_SET(set, id, { hash_set_insert(hash, id); });
+  entity_set__free_ids(set);
+  entity_set__free_words(set);
+  set->hash = hash;
+  set->kind = ENTITY_SET_HASH;
+}
+
+// leave the sorted form before an update that would shift too many ids,
+// `id` is the one about to be inserted or deleted
+static void entity_set__spill(struct entity_set *set, uint32_t id) {
+  uint32_t lo = MIN(set->ids[0], id);
+  uint32_t hi = MAX(set->ids[set->count - 1], id);
+
+  if (entity_set__dense(set->count + 1, lo, hi)) {
+    entity_set__to_bitmap(set);
+  } else {
+    entity_set__to_hash(set);
+  }
+}
+
+static uint32_t entity_set__lower_bound(const struct entity_set *set,
+                                        uint32_t id) {
+  uint32_t lo = 0, hi = set->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (set->ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// grow a bitmap to cover `id`, returns false if it would get too sparse
+static bool entity_set__cover(struct entity_set *set, uint32_t id) {
+  uint64_t end = (uint64_t)set->base + (uint64_t)set->num_words * 64;
+
+  if (id >= set->base && id < end) {
+    return true;
+  }
+
+  uint32_t lo = MIN(set->base, id);
+  uint32_t hi = id >= end ? id : (uint32_t)(end - 1);
+
+  if (!entity_set__dense(set->count + 1, lo, hi)) {
+    return false;
+  }
+
+  uint32_t base = lo & ~63u;
+  uint32_t num_words = entity_set__num_words(lo, hi);
+  uint64_t *words = entity_set__new_words(set, num_words);
+
+  memcpy(&words[(set->base - base) / 64], set->words,
+         sizeof(uint64_t) * set->num_words);
+  entity_set__free_words(set);
+  set->words = words;
+  set->base = base;
+  set->num_words = num_words;
+  return true;
+}
+
+void entity_set_init(struct entity_set *set) {
+  memset(set, 0, sizeof(struct entity_set));
+  set->kind = ENTITY_SET_SORTED;
+  set->alloc = ecs_current_allocator();
+}
+
+void entity_set_destroy(struct entity_set *set) {
+  entity_set__free_ids(set);
+  entity_set__free_words(set);
+  entity_set__free_hash(set);
+}
+
+void entity_set_clear(struct entity_set *set) {
+  if (set->kind == ENTITY_SET_BITMAP) {
+    memset(set->words, 0, sizeof(uint64_t) * set->num_words);
+  } else if (set->kind == ENTITY_SET_HASH) {
+    entity_set__free_hash(set);
+    set->kind = ENTITY_SET_SORTED;
+  }
+  set->count = 0;
+}
+
+bool entity_set_insert(struct entity_set *set, uint32_t id) {
+  switch (set->kind) {
+  case ENTITY_SET_SORTED: {
+    // ids mostly come in ascending order, skip the search for those
+    uint32_t pos = !set->count || set->ids[set->count - 1] < id
+                       ? set->count
+                       : entity_set__lower_bound(set, id);
+
+    if (pos < set->count && set->ids[pos] == id) {
+      return false;
+    }
+    if (pos < set->count && set->count >= entity_set_max_sorted_shift) {
+      entity_set__spill(set, id);
+      return entity_set_insert(set, id);
+    }
+
+    entity_set__reserve_ids(set, set->count + 1);
+    memmove(&set->ids[pos + 1], &set->ids[pos],
+            sizeof(uint32_t) * (set->count - pos));
+    set->ids[pos] = id;
+    break;
+  }
+  case ENTITY_SET_BITMAP:
+    if (entity_set_contains(set, id)) {
+      return false;
+    }
+    if (!entity_set__cover(set, id)) {
+      entity_set__to_hash(set);
+      return entity_set_insert(set, id);
+    }
+    entity_set__set_bit(set, id);
+    break;
+  case ENTITY_SET_HASH:
+    if (!hash_set_insert(set->hash, id)) {
+      return false;
+    }
+    break;
+  }
+
+  set->count++;
+  return true;
+}
+
+bool entity_set_delete(struct entity_set *set, uint32_t id) {
+  if (!entity_set_contains(set, id)) {
+    return false;
+  }
+
+  switch (set->kind) {
+  case ENTITY_SET_SORTED: {
+    uint32_t pos = entity_set__lower_bound(set, id);
+
+    if (pos + 1 < set->count && set->count >= entity_set_max_sorted_shift) {
+      entity_set__spill(set, id);
+      return entity_set_delete(set, id);
+    }
+
+    memmove(&set->ids[pos], &set->ids[pos + 1],
+            sizeof(uint32_t) * (set->count - pos - 1));
+    break;
+  }
+  case ENTITY_SET_BITMAP: {
+    uint32_t bit = id - set->base;
+
+    set->words[bit / 64] &= ~(1ull << (bit % 64));
+    break;
+  }
+  case ENTITY_SET_HASH:
+    hash_set_delete(set->hash, id);
+    break;
+  }
+
+  set->count--;
+  return true;
+}
+
+void entity_set_optimize(struct entity_set *set) {
+  if (!set->count) {
+    entity_set_destroy(set);
+    set->kind = ENTITY_SET_SORTED;
+    return;
+  }
+
+  // a bitmap is trimmed to the ids it holds on the way through
+  entity_set__to_sorted(set);
+  if (entity_set__dense(set->count, set->ids[0], set->ids[set->count - 1])) {
+    entity_set__to_bitmap(set);
+  }
+}
+
+// Set operations
+
+// only sorted sets and bitmaps take part in the operations below
+static void entity_set__prepare(struct entity_set *set) {
+  if (set->kind == ENTITY_SET_HASH) {
+    entity_set_optimize(set);
+  }
+}
+
+// make `out` an empty sorted set with room for `n` ids
+static void entity_set__reset_sorted(struct entity_set *out, uint32_t n) {
+  entity_set__free_words(out);
+  entity_set__free_hash(out);
+  out->kind = ENTITY_SET_SORTED;
+  out->count = 0;
+  entity_set__reserve_ids(out, n);
+}
+
+// make `out` an empty bitmap of `num_words` words from `base`
+static void entity_set__reset_bitmap(struct entity_set *out, uint32_t base,
+                                     uint32_t num_words) {
+  entity_set__free_ids(out);
+  entity_set__free_hash(out);
+  if (out->num_words != num_words) {
+    entity_set__free_words(out);
+    out->words = entity_set__new_words(out, num_words);
+    out->num_words = num_words;
+  } else {
+    memset(out->words, 0, sizeof(uint64_t) * num_words);
+  }
+  out->base = base;
+  out->kind = ENTITY_SET_BITMAP;
+  out->count = 0;
+}
+
+// pick the smaller form for a result and drop an empty one's memory
+static void entity_set__finish(struct entity_set *out) {
+  if (out->kind == ENTITY_SET_BITMAP) {
+    out->count = entity_set__popcount(out->words, out->num_words);
+  }
+
+  if (!out->count) {
+    entity_set_optimize(out);
+    return;
+  }
+
+  if (out->kind == ENTITY_SET_SORTED) {
+    if (entity_set__dense(out->count, out->ids[0],
+                          out->ids[out->count - 1])) {
+      entity_set__to_bitmap(out);
+    }
+  } else if (!entity_set__dense(out->count, out->base,
+                                out->base + (out->num_words - 1) * 64)) {
+    entity_set__to_sorted(out);
+  }
+}
+
+// `dst[i] OP= src[i]` over `n` words, two at a time where SSE2 is there
+#if defined(__SSE2__)
+#define ENTITY_SET__COMBINE(NAME, SIMD_OP, EXPR)                               \
+  static void entity_set__##NAME(uint64_t *dst, const uint64_t *src,           \
+                                 uint32_t n) {                                 \
+    uint32_t i = 0;                                                            \
+    for (; i + 2 <= n; i += 2) {                                               \
+      __m128i d = _mm_loadu_si128((const __m128i *)&dst[i]);                   \
+      __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);                   \
+      _mm_storeu_si128((__m128i *)&dst[i], SIMD_OP);                           \
+    }                                                                          \
+    for (; i < n; i++) {                                                       \
+      uint64_t d = dst[i], s = src[i];                                         \
+      dst[i] = EXPR;                                                           \
+    }                                                                          \
+  }
+#else
+#define ENTITY_SET__COMBINE(NAME, SIMD_OP, EXPR)                               \
+  static void entity_set__##NAME(uint64_t *dst, const uint64_t *src,           \
+                                 uint32_t n) {                                 \
+    for (uint32_t i = 0; i < n; i++) {                                         \
+      uint64_t d = dst[i], s = src[i];                                         \
+      dst[i] = EXPR;                                                           \
+    }                                                                          \
+  }
+#endif
+
+ENTITY_SET__COMBINE(and_words, _mm_and_si128(d, s), d & s)
+ENTITY_SET__COMBINE(or_words, _mm_or_si128(d, s), d | s)
+ENTITY_SET__COMBINE(andnot_words, _mm_andnot_si128(s, d), d & ~s)
+
+// ids in both sorted arrays, blocks of four are compared against each other
+// in one go and the ends finished one by one
+static uint32_t entity_set__intersect_ids(const uint32_t *a, uint32_t na,
+                                          const uint32_t *b, uint32_t nb,
+                                          uint32_t *out) {
+  uint32_t i = 0, j = 0, n = 0;
+
+#if defined(__SSE2__)
+  while (i + 4 <= na && j + 4 <= nb) {
+    __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+    __m128i vb = _mm_loadu_si128((const __m128i *)&b[j]);
+    // each id of `a` against every rotation of the block of `b`
+    __m128i vb_1 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+    __m128i vb_2 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2));
+    __m128i vb_3 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3));
+    __m128i eq = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, vb_1)),
+        _mm_or_si128(_mm_cmpeq_epi32(va, vb_2), _mm_cmpeq_epi32(va, vb_3)));
+    uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    uint32_t a_max = a[i + 3], b_max = b[j + 3];
+
+    while (mask) {
+      out[n++] = a[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+    i += a_max <= b_max ? 4 : 0;
+    j += b_max <= a_max ? 4 : 0;
+  }
+#endif
+
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return n;
+}
+
+// ids of the sorted set `s` that are (`keep`) or aren't in the bitmap `b`
+static void entity_set__filter(struct entity_set *out,
+                               const struct entity_set *s,
+                               const struct entity_set *b, bool keep) {
+  entity_set__reset_sorted(out, s->count);
+  for (uint32_t i = 0; i < s->count; i++) {
+    if (entity_set_contains(b, s->ids[i]) == keep) {
+      out->ids[out->count++] = s->ids[i];
+    }
+  }
+}
+
+// ids of `a`, `b` or both, in order, the sets may be in either form
+static void entity_set__merge(struct entity_set *out,
+                              const struct entity_set *a,
+                              const struct entity_set *b) {
+  struct entity_set_iter ia = {0}, ib = {0};
+  uint32_t x = 0, y = 0;
+  bool has_x = entity_set_next(a, &ia, &x);
+  bool has_y = entity_set_next(b, &ib, &y);
+
+  entity_set__reset_sorted(out, a->count + b->count);
+  while (has_x || has_y) {
+    if (has_x && (!has_y || x <= y)) {
+      out->ids[out->count++] = x;
+      has_y = has_y && x == y ? entity_set_next(b, &ib, &y) : has_y;
+      has_x = entity_set_next(a, &ia, &x);
+    } else {
+      out->ids[out->count++] = y;
+      has_y = entity_set_next(b, &ib, &y);
+    }
+  }
+}
+
+// copy the words of bitmap `b` into the bitmap `out` that covers them
+static void entity_set__copy_words(struct entity_set *out,
+                                   const struct entity_set *b) {
+  memcpy(&out->words[(b->base - out->base) / 64], b->words,
+         sizeof(uint64_t) * b->num_words);
+}
+
+void entity_set_intersect(struct entity_set *out, struct entity_set *a,
+                          struct entity_set *b) {
+  entity_set__prepare(a);
+  entity_set__prepare(b);
+
+  if (!a->count || !b->count) {
+    entity_set__reset_sorted(out, 0);
+  } else if (a->kind == ENTITY_SET_SORTED && b->kind == ENTITY_SET_SORTED) {
+    entity_set__reset_sorted(out, MIN(a->count, b->count));
+    out->count =
+        entity_set__intersect_ids(a->ids, a->count, b->ids, b->count, out->ids);
+  } else if (a->kind == ENTITY_SET_SORTED) {
+    entity_set__filter(out, a, b, true);
+  } else if (b->kind == ENTITY_SET_SORTED) {
+    entity_set__filter(out, b, a, true);
+  } else {
+    uint64_t a_end = (uint64_t)a->base + (uint64_t)a->num_words * 64;
+    uint64_t b_end = (uint64_t)b->base + (uint64_t)b->num_words * 64;
+    uint32_t base = MAX(a->base, b->base);
+    uint64_t end = MIN(a_end, b_end);
+
+    if (end <= base) {
+      entity_set__reset_sorted(out, 0);
+    } else {
+      entity_set__reset_bitmap(out, base, (end - base) / 64);
+      memcpy(out->words, &a->words[(base - a->base) / 64],
+             sizeof(uint64_t) * out->num_words);
+      entity_set__and_words(out->words, &b->words[(base - b->base) / 64],
+                            out->num_words);
+    }
+  }
+
+  entity_set__finish(out);
+}
+
+void entity_set_union(struct entity_set *out, struct entity_set *a,
+                      struct entity_set *b) {
+  entity_set__prepare(a);
+  entity_set__prepare(b);
+
+  if (a->kind == ENTITY_SET_BITMAP && b->kind == ENTITY_SET_BITMAP) {
+    uint64_t a_end = (uint64_t)a->base + (uint64_t)a->num_words * 64;
+    uint64_t b_end = (uint64_t)b->base + (uint64_t)b->num_words * 64;
+    uint32_t base = MIN(a->base, b->base);
+
+    entity_set__reset_bitmap(out, base, (MAX(a_end, b_end) - base) / 64);
+    entity_set__copy_words(out, a);
+    entity_set__or_words(&out->words[(b->base - base) / 64], b->words,
+                         b->num_words);
+  } else {
+    entity_set__merge(out, a, b);
+  }
+
+  entity_set__finish(out);
+}
+
+void entity_set_difference(struct entity_set *out, struct entity_set *a,
+                           struct entity_set *b) {
+  entity_set__prepare(a);
+  entity_set__prepare(b);
+
+  if (a->kind == ENTITY_SET_SORTED) {
+    if (b->kind == ENTITY_SET_SORTED) {
+      // ids of a not found by walking b alongside it
+      uint32_t j = 0;
+
+      entity_set__reset_sorted(out, a->count);
+      for (uint32_t i = 0; i < a->count; i++) {
+        while (j < b->count && b->ids[j] < a->ids[i]) {
+          j++;
+        }
+        if (j == b->count || b->ids[j] != a->ids[i]) {
+          out->ids[out->count++] = a->ids[i];
+        }
+      }
+    } else {
+      entity_set__filter(out, a, b, false);
+    }
+  } else if (!a->count) {
+    entity_set__reset_sorted(out, 0);
+  } else {
+    entity_set__reset_bitmap(out, a->base, a->num_words);
+    entity_set__copy_words(out, a);
+
+    if (b->kind == ENTITY_SET_BITMAP) {
+      uint64_t a_end = (uint64_t)a->base + (uint64_t)a->num_words * 64;
+      uint64_t b_end = (uint64_t)b->base + (uint64_t)b->num_words * 64;
+      uint32_t base = MAX(a->base, b->base);
+      uint64_t end = MIN(a_end, b_end);
+
+      if (base < end) {
+        entity_set__andnot_words(&out->words[(base - a->base) / 64],
+                                 &b->words[(base - b->base) / 64],
+                                 (end - base) / 64);
+      }
+    } else {
+      for (uint32_t i = 0; i < b->count; i++) {
+        uint32_t bit = b->ids[i] - a->base;
+
+        if (b->ids[i] >= a->base && bit / 64 < a->num_words) {
+          out->words[bit / 64] &= ~(1ull << (bit % 64));
+        }
+      }
+    }
+  }
+
+  entity_set__finish(out);
+}
@@ -0,0 +1,277 @@
+#ifndef __ENTITY_SET_H_
+#define __ENTITY_SET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "component.h"
+#include "hash_set.h"
+
+// Sets of entity ids with intersection, union and difference
+//
+// A set picks its representation from what it holds:
+//
+// - `ENTITY_SET_SORTED`, the ids in ascending order, for small or sparse sets.
+// - `ENTITY_SET_BITMAP`, one bit per id over the range the set spans, once
+//   that takes less memory than the sorted ids.
+// - `ENTITY_SET_HASH`, a `hash_set`, for big sparse sets changed out of order,
+//   where keeping the ids sorted would move most of them on every insert.
+//
+// Set operations run on sorted ids and bitmaps: bitmaps are combined a
+// machine word or an SSE2 register at a time, sorted sets are intersected
+// four ids against four. A hash set taking part is sorted first, which also
+// keeps it in the faster form. Results take whichever of the two forms is
+// smaller.
+//
+// Sets allocate as they grow, they aren't meant for ECS_STATIC_STORAGE builds.
+
+enum entity_set_kind {
+  ENTITY_SET_SORTED,
+  ENTITY_SET_BITMAP,
+  ENTITY_SET_HASH,
+};
+
+struct entity_set {
+  enum entity_set_kind kind;
+  uint32_t count;
+  // ENTITY_SET_SORTED: `count` ids in ascending order
+  uint32_t *ids;
+  uint32_t ids_cap;
+  // ENTITY_SET_BITMAP: bit i is id `base + i`, base is a multiple of 64
+  uint64_t *words;
+  uint32_t base;
+  uint32_t num_words;
+  // ENTITY_SET_HASH
+  struct hash_set *hash;
+  struct ecs_allocator *alloc;
+};
+
+/**
+ * Initialise an empty set, nothing is allocated until the first insert.
+ */
+void entity_set_init(struct entity_set *set);
+void entity_set_destroy(struct entity_set *set);
+
+/**
+ * Remove every id, keeping the memory.
+ */
+void entity_set_clear(struct entity_set *set);
+
+/**
+ * Add `id`, returns false if it was already in the set.
+ */
+bool entity_set_insert(struct entity_set *set, uint32_t id);
+
+/**
+ * Remove `id`, returns false if it wasn't in the set.
+ */
+bool entity_set_delete(struct entity_set *set, uint32_t id);
+
+/**
+ * Switch the set to the smaller of the sorted and bitmap forms.
+ */
+void entity_set_optimize(struct entity_set *set);
+
+/**
+ * Replace `out` with the ids in both `a` and `b`. `out` must be a different
+ * set from the other two, which may be optimized along the way.
+ */
+void entity_set_intersect(struct entity_set *out, struct entity_set *a,
+                          struct entity_set *b);
+
+/**
+ * Replace `out` with the ids in `a`, `b` or both, see `entity_set_intersect`.
+ */
+void entity_set_union(struct entity_set *out, struct entity_set *a,
+                      struct entity_set *b);
+
+/**
+ * Replace `out` with the ids in `a` but not in `b`, see
+ * `entity_set_intersect`.
+ */
+void entity_set_difference(struct entity_set *out, struct entity_set *a,
+                           struct entity_set *b);
+
+static inline uint32_t entity_set_count(const struct entity_set *set) {
+  return set->count;
+}
+
+static inline bool entity_set_contains(const struct entity_set *set,
+                                       uint32_t id) {
+  switch (set->kind) {
+  case ENTITY_SET_SORTED: {
+    uint32_t lo = 0, hi = set->count;
+
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (set->ids[mid] < id) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < set->count && set->ids[lo] == id;
+  }
+  case ENTITY_SET_BITMAP: {
+    uint32_t bit = id - set->base;
+
+    return id >= set->base && bit / 64 < set->num_words &&
+           (set->words[bit / 64] >> (bit % 64) & 1);
+  }
+  case ENTITY_SET_HASH:
+    return hash_set_contains(set->hash, id);
+  }
+  return false;
+}
+
+/**
+ * Position of `entity_set_next` in a set, zero initialise it to start.
+ */
+struct entity_set_iter {
+  uint32_t pos;
+  uint64_t word;
+};
+
+/**
+ * Get the next id of `set` into `id`, returns false once they have all been
+ * seen. Sorted and bitmap sets give their ids in ascending order. The set
+ * must not change while it is being walked.
+ */
+static inline bool entity_set_next(const struct entity_set *set,
+                                   struct entity_set_iter *it, uint32_t *id) {
+  switch (set->kind) {
+  case ENTITY_SET_SORTED:
+    if (it->pos >= set->count) {
+      return false;
+    }
+    *id = set->ids[it->pos++];
+    return true;
+  case ENTITY_SET_BITMAP:
+    // `pos` counts the words started, `word` holds the bits left of the last
+    while (!it->word) {
+      if (it->pos >= set->num_words) {
+        return false;
+      }
+      it->word = set->words[it->pos++];
+    }
+    *id = set->base + (it->pos - 1) * 64 + __builtin_ctzll(it->word);
+    it->word &= it->word - 1;
+    return true;
+  case ENTITY_SET_HASH:
+    for (; it->pos < set->hash->cap; it->pos++) {
+      if (set->hash->elems[it->pos].hash &&
+          !hash_set_is_entry_deleted(set->hash, it->pos)) {
+        *id = set->hash->elems[it->pos++].key;
+        return true;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+/**
+ * Loop over every id of `SET`, a `struct entity_set *`.
+ *
+ * Usage:
+ * FOR_EACH_ENTITY_SET(&visible, id, { draw(id); });
+ */
+#define FOR_EACH_ENTITY_SET(SET, ID_VAR, ...)                                  \
+  do {                                                                         \
+    const struct entity_set *entity_set__set = (SET);                          \
+    struct entity_set_iter entity_set__it = {0};                               \
+    uint32_t ID_VAR;                                                           \
+    while (entity_set_next(entity_set__set, &entity_set__it, &ID_VAR)) {       \
+      __VA_ARGS__                                                              \
+    }                                                                          \
+  } while (0)
+
+/**
+ * `FOR_JOIN_COMPONENT_1` restricted to the entities of `SET`.
+ *
+ * Walks the set and looks each entity up in the component, so it pays off
+ * when the set is smaller than the component. Otherwise filter a plain join
+ * with `entity_set_contains`.
+ *
+ * Usage:
+ * FOR_JOIN_SET_COMPONENT_1(&in_combat, health, d, {
+ *     d.health->hp -= 1;
+ * });
+ */
+#define FOR_JOIN_SET_COMPONENT_1(SET, COMP_NAME, ITER_VAR, ...)                \
+  FOR_EACH_ENTITY_SET(SET, entity_set__id, {                                   \
+    STRUCT_MEMBER_TYPE(struct hash_table_component_##COMP_NAME##_storage_elem, \
+                       val) *v_0 =                                             \
+        hash_table_component_##COMP_NAME##_storage_lookup(COMP_NAME.storage,   \
+                                                          entity_set__id);     \
+    if (v_0 != NULL) {                                                         \
+      struct {                                                                 \
+        uint32_t id;                                                           \
+        typeof(v_0) COMP_NAME;                                                 \
+      } ITER_VAR = {entity_set__id, v_0};                                      \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  })
+
+/**
+ * `FOR_JOIN_COMPONENT_2` restricted to the entities of `SET`, see
+ * `FOR_JOIN_SET_COMPONENT_1`.
+ */
+#define FOR_JOIN_SET_COMPONENT_2(SET, COMP_NAME_0, COMP_NAME_1, ITER_VAR, ...) \
+  FOR_EACH_ENTITY_SET(SET, entity_set__id, {                                   \
+    STRUCT_MEMBER_TYPE(                                                        \
+        struct hash_table_component_##COMP_NAME_0##_storage_elem, val) *v_0 =  \
+        hash_table_component_##COMP_NAME_0##_storage_lookup(                   \
+            COMP_NAME_0.storage, entity_set__id);                              \
+    STRUCT_MEMBER_TYPE(                                                        \
+        struct hash_table_component_##COMP_NAME_1##_storage_elem, val) *v_1 =  \
+        v_0 ? hash_table_component_##COMP_NAME_1##_storage_lookup(             \
+                  COMP_NAME_1.storage, entity_set__id)                         \
+            : NULL;                                                            \
+    if (v_1 != NULL) {                                                         \
+      struct {                                                                 \
+        uint32_t id;                                                           \
+        typeof(v_0) COMP_NAME_0;                                               \
+        typeof(v_1) COMP_NAME_1;                                               \
+      } ITER_VAR = {entity_set__id, v_0, v_1};                                 \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  })
+
+/**
+ * `FOR_JOIN_COMPONENT_3` restricted to the entities of `SET`, see
+ * `FOR_JOIN_SET_COMPONENT_1`.
+ */
+#define FOR_JOIN_SET_COMPONENT_3(SET, COMP_NAME_0, COMP_NAME_1, COMP_NAME_2,   \
+                                 ITER_VAR, ...)                                \
+  FOR_EACH_ENTITY_SET(SET, entity_set__id, {                                   \
+    STRUCT_MEMBER_TYPE(                                                        \
+        struct hash_table_component_##COMP_NAME_0##_storage_elem, val) *v_0 =  \
+        hash_table_component_##COMP_NAME_0##_storage_lookup(                   \
+            COMP_NAME_0.storage, entity_set__id);                              \
+    STRUCT_MEMBER_TYPE(                                                        \
+        struct hash_table_component_##COMP_NAME_1##_storage_elem, val) *v_1 =  \
+        v_0 ? hash_table_component_##COMP_NAME_1##_storage_lookup(             \
+                  COMP_NAME_1.storage, entity_set__id)                         \
+            : NULL;                                                            \
+    STRUCT_MEMBER_TYPE(                                                        \
+        struct hash_table_component_##COMP_NAME_2##_storage_elem, val) *v_2 =  \
+        v_1 ? hash_table_component_##COMP_NAME_2##_storage_lookup(             \
+                  COMP_NAME_2.storage, entity_set__id)                         \
+            : NULL;                                                            \
+    if (v_2 != NULL) {                                                         \
+      struct {                                                                 \
+        uint32_t id;                                                           \
+        typeof(v_0) COMP_NAME_0;                                               \
+        typeof(v_1) COMP_NAME_1;                                               \
+        typeof(v_2) COMP_NAME_2;                                               \
+      } ITER_VAR = {entity_set__id, v_0, v_1, v_2};                            \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  })
+
+#endif // __ENTITY_SET_H_
@@ -0,0 +1,14 @@
+#include <stdint.h>
+
+#include "event.h"
+
+// declared weak as a program doesn't have to register any events
+extern struct event_def *__start_event_def_array __attribute__((weak));
+extern struct event_def *__stop_event_def_array __attribute__((weak));
+
+void swap_events(void) {
+  for (struct event_def **e = &__start_event_def_array;
+       e != &__stop_event_def_array; e++) {
+    (*e)->swap();
+  }
+}
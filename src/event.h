@@ -0,0 +1,257 @@
+#ifndef __EVENT_H_
+#define __EVENT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "vec.h"
+
+// Typed event channels between systems
+//
+// Every thread that emits onto a channel gets a writer of its own, so emitting
+// is a push onto a thread local vector and never touches a component table or
+// another thread's memory. Writers are found with a lock free list the first
+// time a thread emits and stay with the channel for the life of the program,
+// so emit from a fixed pool of worker threads rather than short lived ones.
+//
+// Each writer has two buffers. Events are emitted into one while consumers read
+// the other, `swap_events` (run at the end of `run_systems`) flips them and
+// empties the new write buffers without freeing them, so events emitted during
+// one tick are read during the next and storage is reused from tick to tick.
+// `swap_events` must not run at the same time as an emit.
+//
+// Channels allocate from the allocator that was current when their writer was
+// created, on the emitting thread, so it must be thread safe when emitting
+// from worker threads (the default libc one is).
+
+#ifndef ECS_STATIC_EVENT_WRITERS
+// number of threads that can emit onto one channel in ECS_STATIC_STORAGE builds
+#define ECS_STATIC_EVENT_WRITERS 8
+#endif // ECS_STATIC_EVENT_WRITERS
+
+struct event_def {
+  const char *const name;
+  const uint32_t id;
+  void *const channel;
+  void *emit;
+  void (*const swap)(void);
+  size_t (*const count)(void);
+};
+
+#define EVENT_DEF(NAME, TYPE)                                                  \
+  struct event_##NAME##_def {                                                  \
+    const char *const name;                                                    \
+    const uint32_t id;                                                         \
+    struct event_##NAME##_channel *const channel;                              \
+    bool (*const emit)(TYPE ev);                                               \
+    void (*const swap)(void);                                                  \
+    size_t (*const count)(void);                                               \
+  };
+
+/**
+ * Define an event channel carrying values of `TYPE`, usage:
+ *
+ * DEFINE_EVENT(collision, struct collision_evt);
+ *
+ * collision.emit((struct collision_evt){.a = a, .b = b});
+ */
+#define DEFINE_EVENT(NAME, TYPE)                                               \
+  DEFINE_VECTOR(TYPE, event_##NAME);                                           \
+  struct event_##NAME##_writer {                                               \
+    struct event_##NAME##_writer *next;                                        \
+    struct vector_event_##NAME bufs[2];                                        \
+  };                                                                           \
+  struct event_##NAME##_channel {                                              \
+    struct event_##NAME##_writer *writers;                                     \
+    uint32_t num_writers;                                                      \
+    /* events are emitted into bufs[epoch & 1] */                              \
+    uint32_t epoch;                                                            \
+  };                                                                           \
+  EVENT_DEF(NAME, TYPE);                                                       \
+  extern struct event_##NAME##_def NAME;
+
+/**
+ * Writers of a channel whose buffers hold up to `MAX` events each.
+ *
+ * With ECS_STATIC_STORAGE the buffers live in static memory, at most
+ * `ECS_STATIC_EVENT_WRITERS` threads can emit and `emit` returns false once
+ * the thread's buffer is full. Otherwise `MAX` only pre-sizes the buffers.
+ */
+#ifdef ECS_STATIC_STORAGE
+#define EVENT_WRITER_STORAGE(NAME, TYPE, MAX)                                  \
+  static struct event_##NAME##_writer                                          \
+      event_##NAME##_writers[ECS_STATIC_EVENT_WRITERS];                        \
+  static TYPE event_##NAME##_bufs[ECS_STATIC_EVENT_WRITERS][2][MAX];           \
+  static struct event_##NAME##_writer *event_##NAME##_writer_new(              \
+      struct event_##NAME##_channel *channel) {                                \
+    /* only take a slot while one is left, so the count never wraps */         \
+    uint32_t i = __atomic_load_n(&channel->num_writers, __ATOMIC_RELAXED);     \
+    do {                                                                       \
+      if (i >= ECS_STATIC_EVENT_WRITERS) {                                     \
+        return NULL;                                                           \
+      }                                                                        \
+    } while (!__atomic_compare_exchange_n(&channel->num_writers, &i, i + 1,    \
+                                          true, __ATOMIC_RELAXED,              \
+                                          __ATOMIC_RELAXED));                  \
+    struct event_##NAME##_writer *w = &event_##NAME##_writers[i];              \
+    for (uint32_t b = 0; b < 2; b++) {                                         \
+      w->bufs[b] =                                                             \
+          vector_event_##NAME##_from_buffer(event_##NAME##_bufs[i][b], MAX);   \
+    }                                                                          \
+    return w;                                                                  \
+  }
+#define DEFAULT_EVENT_CAPACITY ECS_STATIC_DEFAULT_CAPACITY
+#else
+#define EVENT_WRITER_STORAGE(NAME, TYPE, MAX)                                  \
+  static struct event_##NAME##_writer *event_##NAME##_writer_new(              \
+      struct event_##NAME##_channel *channel) {                                \
+    struct event_##NAME##_writer *w =                                          \
+        ecs_alloc(ecs_current_allocator(), sizeof(*w));                        \
+    for (uint32_t b = 0; b < 2; b++) {                                         \
+      w->bufs[b] = vector_event_##NAME##_new(MAX);                             \
+    }                                                                          \
+    __atomic_fetch_add(&channel->num_writers, 1, __ATOMIC_RELAXED);            \
+    return w;                                                                  \
+  }
+#define DEFAULT_EVENT_CAPACITY 256
+#endif // ECS_STATIC_STORAGE
+
+#define REGISTER_EVENT(NAME, TYPE)                                             \
+  REGISTER_EVENT_CAPACITY(NAME, TYPE, DEFAULT_EVENT_CAPACITY)
+
+/**
+ * Register an event channel whose per thread buffers hold up to `MAX` events,
+ * see `EVENT_WRITER_STORAGE`.
+ */
+#define REGISTER_EVENT_CAPACITY(NAME, TYPE, MAX)                               \
+  MAKE_VECTOR(TYPE, event_##NAME);                                             \
+  EVENT_WRITER_STORAGE(NAME, TYPE, MAX);                                       \
+  static struct event_##NAME##_channel event_##NAME##_channel;                 \
+  static __thread struct event_##NAME##_writer *event_##NAME##_tls_writer;     \
+  struct event_##NAME##_def NAME;                                              \
+  static struct event_##NAME##_def *event_ptr__##NAME                          \
+      __attribute__((used, section("event_def_array"))) = &NAME;               \
+  static const uint32_t event_##NAME##_id = __COUNTER__;                       \
+  static struct event_##NAME##_writer *event_##NAME##_writer(void) {           \
+    struct event_##NAME##_writer *w = event_##NAME##_tls_writer;               \
+    if (w) {                                                                   \
+      return w;                                                                \
+    }                                                                          \
+    w = event_##NAME##_writer_new(&event_##NAME##_channel);                    \
+    if (!w) {                                                                  \
+      return NULL;                                                             \
+    }                                                                          \
+    w->next = __atomic_load_n(&event_##NAME##_channel.writers,                 \
+                              __ATOMIC_RELAXED);                               \
+    while (!__atomic_compare_exchange_n(&event_##NAME##_channel.writers,       \
+                                        &w->next, w, true, __ATOMIC_RELEASE,   \
+                                        __ATOMIC_RELAXED)) {                   \
+    }                                                                          \
+    event_##NAME##_tls_writer = w;                                             \
+    return w;                                                                  \
+  }                                                                            \
+  bool event_##NAME##_emit(TYPE ev) {                                          \
+    struct event_##NAME##_writer *w = event_##NAME##_writer();                 \
+    if (!w) {                                                                  \
+      return false;                                                            \
+    }                                                                          \
+    uint32_t epoch =                                                           \
+        __atomic_load_n(&event_##NAME##_channel.epoch, __ATOMIC_RELAXED);      \
+    return vector_event_##NAME##_push(&w->bufs[epoch & 1], ev) !=              \
+           VECTOR_PUSH_FAILED;                                                 \
+  }                                                                            \
+  void event_##NAME##_swap(void) {                                             \
+    uint32_t epoch = __atomic_add_fetch(&event_##NAME##_channel.epoch, 1,      \
+                                        __ATOMIC_RELAXED);                     \
+    for (struct event_##NAME##_writer *w = __atomic_load_n(                    \
+             &event_##NAME##_channel.writers, __ATOMIC_ACQUIRE);               \
+         w; w = w->next) {                                                     \
+      w->bufs[epoch & 1].length = 0;                                           \
+    }                                                                          \
+  }                                                                            \
+  size_t event_##NAME##_count(void) {                                          \
+    uint32_t epoch =                                                           \
+        __atomic_load_n(&event_##NAME##_channel.epoch, __ATOMIC_RELAXED);      \
+    size_t count = 0;                                                          \
+    for (struct event_##NAME##_writer *w = __atomic_load_n(                    \
+             &event_##NAME##_channel.writers, __ATOMIC_ACQUIRE);               \
+         w; w = w->next) {                                                     \
+      count += w->bufs[(epoch + 1) & 1].length;                                \
+    }                                                                          \
+    return count;                                                              \
+  }                                                                            \
+  static void event_init__##NAME(void) __attribute__((constructor));           \
+  static void event_init__##NAME(void) {                                       \
+    memcpy(&NAME,                                                              \
+           &(struct event_##NAME##_def){                                       \
+               .name = #NAME,                                                  \
+               .id = event_##NAME##_id,                                        \
+               .channel = &event_##NAME##_channel,                             \
+               .emit = &event_##NAME##_emit,                                   \
+               .swap = &event_##NAME##_swap,                                   \
+               .count = &event_##NAME##_count},                                \
+           sizeof(struct event_##NAME##_def));                                 \
+  }
+
+/**
+ * Loop over the events published at the last `swap_events`, one contiguous
+ * batch per emitting thread.
+ *
+ * @param NAME event channel to read.
+ * @param BATCH variable to receive each batch, will be given the type of
+ *        `struct {const TYPE *data; size_t len;}`.
+ *
+ * Usage:
+ * FOR_EACH_EVENT_BATCH(collision, b, {
+ *    resolve_collisions(b.data, b.len);
+ * });
+ */
+#define FOR_EACH_EVENT_BATCH(NAME, BATCH, ...)                                 \
+  do {                                                                         \
+    uint32_t event__read =                                                     \
+        (__atomic_load_n(&NAME.channel->epoch, __ATOMIC_RELAXED) + 1) & 1;     \
+    for (struct event_##NAME##_writer *event__w =                              \
+             __atomic_load_n(&NAME.channel->writers, __ATOMIC_ACQUIRE);        \
+         event__w; event__w = event__w->next) {                                \
+      struct vector_event_##NAME *event__buf = &event__w->bufs[event__read];   \
+      if (event__buf->length == 0) {                                           \
+        continue;                                                              \
+      }                                                                        \
+      struct {                                                                 \
+        const typeof(*event__buf->data) *data;                                 \
+        size_t len;                                                            \
+      } BATCH = {event__buf->data, event__buf->length};                        \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Loop over the events published at the last `swap_events`.
+ *
+ * @param NAME event channel to read.
+ * @param EV variable to receive a `const TYPE *` to each event.
+ *
+ * Usage:
+ * FOR_EACH_EVENT(collision, ev, {
+ *    printf("%u hit %u\n", ev->a, ev->b);
+ * });
+ */
+#define FOR_EACH_EVENT(NAME, EV, ...)                                          \
+  FOR_EACH_EVENT_BATCH(NAME, event__batch, {                                   \
+    for (size_t event__i = 0; event__i < event__batch.len; event__i++) {       \
+      const typeof(*event__batch.data) *EV = &event__batch.data[event__i];     \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  })
+
+/**
+ * Publish the events emitted since the last call on every channel and recycle
+ * the buffers of the ones published before. Called by `run_systems` once all
+ * systems have run.
+ */
+void swap_events(void);
+
+#endif // __EVENT_H_
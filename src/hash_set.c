@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "allocator.h"
 #include "bit_array.h"
 #include "common_macros.h"
 #include "hash_set.h"
@@ -59,21 +60,23 @@ static void hash_set__insert(struct hash_set *table, struct hash_set_elem e) {
     uint32_t current_elem_probes =
         hash_set_max_probes(table, table->elems[idx].hash, idx);
 
-    // if we're here, the element was occupied or deleted
-    // steal from the rich, give to the poor
-    if (current_elem_probes < to_insert_elem_probes) {
-
-      // the element is deleted, just replace it
-      if (hash_set_is_entry_deleted(table, idx)) {
+    // the element is deleted and no further from its ideal slot than the one
+    // to insert, just replace it, as the hash table does
+    if (hash_set_is_entry_deleted(table, idx) &&
+        current_elem_probes <= to_insert_elem_probes) {
 
-        // undelete
-        hash_set__reset_deleted(table, idx);
+      // undelete
+      hash_set__reset_deleted(table, idx);
+      table->num_tombstones--;
 
-        table->elems[idx] = e;
+      table->elems[idx] = e;
 
-        return;
-      }
+      return;
+    }
 
+    // if we're here, the element was occupied or deleted
+    // steal from the rich, give to the poor
+    if (current_elem_probes < to_insert_elem_probes) {
       // element wasn't deleted, swap element to insert with it and continue
       SWAP(e, table->elems[idx]);
       to_insert_elem_probes = current_elem_probes;
@@ -120,30 +123,41 @@ static int64_t hash_set__lookup(struct hash_set *table, uint32_t k) {
 }
 
 static void hash_set__construct(struct hash_set *table,
+                                struct ecs_allocator *alloc,
                                 uint32_t initial_capacity) {
-  table->elems = calloc(initial_capacity, sizeof(struct hash_set_elem));
-  table->deleted = bit_array_new(initial_capacity);
+  table->alloc = alloc;
+  table->elems =
+      ecs_alloc(alloc, sizeof(struct hash_set_elem) * initial_capacity);
+  table->deleted = ecs_alloc(alloc, bit_array_num_bytes(initial_capacity));
   table->num_elems = 0;
+  table->num_tombstones = 0;
   table->cap = initial_capacity;
   table->mask = initial_capacity - 1;
   table->resize_thresh =
       (initial_capacity * hash_set_load_factor_to_grow) / 100;
 }
 
+static void hash_set__destruct(struct hash_set *table) {
+  ecs_free(table->alloc, table->elems,
+           sizeof(struct hash_set_elem) * table->cap);
+  ecs_free(table->alloc, table->deleted, bit_array_num_bytes(table->cap));
+}
+
 struct hash_set *hash_set_new() {
-  struct hash_set *table = malloc(sizeof(struct hash_set));
-  hash_set__construct(table, hash_set_initial_cap);
+  struct ecs_allocator *alloc = ecs_current_allocator();
+  struct hash_set *table = ecs_alloc(alloc, sizeof(struct hash_set));
+  hash_set__construct(table, alloc, hash_set_initial_cap);
   return table;
 }
 
 void hash_set_free(struct hash_set *table) {
-  free(table->elems);
-  free(table->deleted);
+  hash_set__destruct(table);
+  ecs_free(table->alloc, table, sizeof(struct hash_set));
 }
 
 void hash_set_grow(struct hash_set *table) {
   struct hash_set new_table;
-  hash_set__construct(&new_table, table->cap * 2);
+  hash_set__construct(&new_table, table->alloc, table->cap * 2);
 
   new_table.num_elems = table->num_elems;
 
@@ -155,21 +169,60 @@ void hash_set_grow(struct hash_set *table) {
     }
   }
 
-  hash_set_free(table);
+  hash_set__destruct(table);
   *table = new_table;
 }
 
-void hash_set_insert(struct hash_set *table, uint32_t k) {
+// shift the rest of the run back over the tombstone at `idx`
+static void hash_set__close(struct hash_set *table, uint32_t idx) {
+  uint32_t next = (idx + 1) & table->mask;
+
+  while (table->elems[next].hash &&
+         hash_set_max_probes(table, table->elems[next].hash, next) > 0) {
+    table->elems[idx] = table->elems[next];
+    set_bit_in_bitarray(table->deleted, idx,
+                        hash_set_is_entry_deleted(table, next));
+    idx = next;
+    next = (next + 1) & table->mask;
+  }
+
+  table->elems[idx] = (struct hash_set_elem){0};
+  hash_set__reset_deleted(table, idx);
+}
+
+// drop every tombstone in place, cheaper than growing when deletes made them
+static void hash_set__purge(struct hash_set *table) {
+  for (uint32_t i = 0; table->num_tombstones; i = (i + 1) & table->mask) {
+    if (table->elems[i].hash && hash_set_is_entry_deleted(table, i)) {
+      hash_set__close(table, i);
+      table->num_tombstones--;
+    }
+  }
+}
+
+bool hash_set_insert(struct hash_set *table, uint32_t k) {
   uint32_t hash = hash_set__fix_hash(hash_set_hash_fun(k));
 
+  if (hash_set__lookup(table, k) >= 0) {
+    return false;
+  }
+
   table->num_elems++;
 
-  if (table->num_elems >= table->resize_thresh) {
+  // tombstones lengthen probes like live elements, drop them in place while
+  // they are a good part of the load and grow otherwise
+  if (table->num_elems + table->num_tombstones >= table->resize_thresh &&
+      table->num_tombstones > table->num_elems / 4) {
+    hash_set__purge(table);
+  }
+
+  if (table->num_elems + table->num_tombstones >= table->resize_thresh) {
     /* printf("growing table\n"); */
     hash_set_grow(table);
   }
 
   hash_set__insert(table, (struct hash_set_elem){hash, k});
+  return true;
 }
 
 bool hash_set_contains(struct hash_set *table, uint32_t k) {
@@ -187,5 +240,6 @@ bool hash_set_delete(struct hash_set *table, uint32_t k) {
 
   hash_set__mark_deleted(table, idx);
   table->num_elems--;
+  table->num_tombstones++;
   return true;
 }
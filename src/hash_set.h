@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "allocator.h"
 #include "bit_array.h"
 #include "common_macros.h"
 
@@ -21,9 +22,12 @@ struct hash_set {
   struct hash_set_elem *elems;
   uint8_t *deleted;
   uint32_t num_elems;
+  // deleted slots, they count towards the load like live elements
+  uint32_t num_tombstones;
   uint32_t cap;
   uint32_t mask;
   uint resize_thresh;
+  struct ecs_allocator *alloc;
 };
 
 bool hash_set_is_entry_deleted(struct hash_set *table, uint32_t idx);
@@ -41,7 +45,10 @@ void hash_set_free(struct hash_set *table);
 
 void hash_set_grow(struct hash_set *table);
 
-void hash_set_insert(struct hash_set *table, uint32_t k);
+/**
+ * Add `k` to the set, returns false if it was already there.
+ */
+bool hash_set_insert(struct hash_set *table, uint32_t k);
 bool hash_set_contains(struct hash_set *table, uint32_t k);
 
 bool hash_set_delete(struct hash_set *table, uint32_t k);
@@ -49,10 +56,9 @@ bool hash_set_delete(struct hash_set *table, uint32_t k);
 #define HASH_SET_ITER(ELEM_NAME, TABLE, ...)                                   \
   for (uint32_t hash_set_iter_idx = 0; hash_set_iter_idx < (TABLE)->cap;       \
        hash_set_iter_idx++) {                                                  \
-    struct hash_set_##NAME##_elem hash_set_iter_e =                            \
-        (TABLE)->elems[hash_set_iter_idx];                                     \
+    struct hash_set_elem hash_set_iter_e = (TABLE)->elems[hash_set_iter_idx];  \
     if (hash_set_iter_e.hash &&                                                \
-        !hash_set_##NAME##__is_entry_deleted((TABLE), hash_set_iter_idx)) {    \
+        !hash_set_is_entry_deleted((TABLE), hash_set_iter_idx)) {              \
       uint32_t ELEM_NAME = hash_set_iter_e.key;                                \
       { __VA_ARGS__ }                                                          \
     }                                                                          \
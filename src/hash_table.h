@@ -2,32 +2,106 @@
 #define __HASH_H_
 
 // A hash table implementation using robin hood hashing
+//
+// Every table type (`DEFINE_HASH`, `DEFINE_CONCURRENT_HASH`, ...) generates
+// the same set of `hash_table_<name>_*` functions so they can be used
+// interchangeably as component storage: `new`, `free`, `init`, `init_fixed`,
+// `destroy`, `insert`, `lookup`, `delete`, `clear`, `reserve`, `count`,
+// `stats`, `reclaim` and the slot protocol used by `HASH_TABLE_ITER`.
+//
+// Tables allocate nothing until their first insert, `new` and `init` only
+// record how big to make them. `reserve` raises that size, or grows a table
+// that is already allocated. In every table type inserting a key that is
+// already present replaces its value.
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
+#include "allocator.h"
 #include "bit_array.h"
 #include "common_macros.h"
 
+// percentage, a macro so it can be used in constant expressions
+#define hash_table_load_factor 90
+
 static const uint32_t hash_table_initial_cap = 64;
-static const uint8_t hash_table_load_factor_to_grow = 90;
+static const uint8_t hash_table_load_factor_to_grow = hash_table_load_factor;
+
+/**
+ * Number of slots a table needs to hold `N` elements without growing, a
+ * constant expression so it can size static storage.
+ */
+#define HASH_TABLE_SLOTS_FOR(N)                                                \
+  ECS_NEXT_POW2((((uint64_t)(N) + 1) * 100 + hash_table_load_factor - 1) /     \
+                hash_table_load_factor)
+
+#define HASH_TABLE_STATS_HIST_BUCKETS 16
 
+/**
+ * Health statistics of a hash table, filled in by `hash_table_<name>_stats`.
+ *
+ * `probe_hist[i]` counts the live elements sitting `i` slots away from their
+ * ideal slot, the last bucket also counts everything displaced further.
+ * `bytes_allocated` covers the element array and the deleted bitmap.
+ */
+struct hash_table_stats {
+  uint32_t cap;
+  uint32_t num_elems;
+  uint32_t num_tombstones;
+  uint32_t max_probes;
+  double mean_probes;
+  uint32_t probe_hist[HASH_TABLE_STATS_HIST_BUCKETS];
+  size_t bytes_allocated;
+};
+
+/**
+ * Iterate over every element of a table.
+ *
+ * Works on any table type that provides the slot protocol:
+ * `hash_table_<name>__slot_count(table)` gives the number of slots and
+ * `hash_table_<name>__slot(table, idx, &key)` gives a pointer to the value in a
+ * slot and sets `key`, or returns NULL for an empty slot.
+ */
 #define HASH_TABLE_ITER(NAME, KEY_NAME, VAL_NAME, TABLE, ...)                  \
-  for (uint32_t hash_table_##NAME##_iter_idx = 0;                              \
-       hash_table_##NAME##_iter_idx < (TABLE)->cap;                            \
+  for (uint32_t hash_table_##NAME##_iter_idx = 0,                              \
+                hash_table_##NAME##_iter_n =                                   \
+                    hash_table_##NAME##__slot_count(TABLE);                    \
+       hash_table_##NAME##_iter_idx < hash_table_##NAME##_iter_n;              \
        hash_table_##NAME##_iter_idx++) {                                       \
-    struct hash_table_##NAME##_elem *hash_table_##NAME##_iter_e =              \
-        &(TABLE)->elems[hash_table_##NAME##_iter_idx];                         \
-    if (hash_table_##NAME##_iter_e->hash &&                                    \
-        !hash_table_##NAME##_is_entry_deleted((TABLE),                         \
-                                              hash_table_##NAME##_iter_idx)) { \
-      uint32_t KEY_NAME = hash_table_##NAME##_iter_e->key;                     \
-      typeof(hash_table_##NAME##_iter_e->val) *VAL_NAME =                      \
-          &hash_table_##NAME##_iter_e->val;                                    \
+    uint32_t KEY_NAME;                                                         \
+    typeof(hash_table_##NAME##__slot((TABLE), 0, NULL)) VAL_NAME =             \
+        hash_table_##NAME##__slot((TABLE), hash_table_##NAME##_iter_idx,       \
+                                  &KEY_NAME);                                  \
+    if (VAL_NAME) {                                                            \
       { __VA_ARGS__ }                                                          \
     }                                                                          \
   }
 
+/**
+ * A static table `VAR` of any table type for up to `MAX` elements, and
+ * `VAR##_init()` to (re)initialise it empty.
+ *
+ * With ECS_STATIC_STORAGE its elements live in static memory too and it never
+ * grows, inserts fail once it is full. Otherwise `MAX` only pre-sizes it.
+ */
+#ifdef ECS_STATIC_STORAGE
+#define HASH_TABLE_STORAGE(NAME, VAR, MAX)                                     \
+  static struct hash_table_##NAME VAR;                                         \
+  static struct hash_table_##NAME##_elem                                       \
+      VAR##_elems[HASH_TABLE_SLOTS_FOR(MAX)];                                  \
+  static uint8_t                                                               \
+      VAR##_deleted[BIT_ARRAY_NUM_BYTES(HASH_TABLE_SLOTS_FOR(MAX))];           \
+  static void VAR##_init(void) {                                               \
+    hash_table_##NAME##_init_fixed(&VAR, VAR##_elems, VAR##_deleted,           \
+                                   ARRAY_LEN(VAR##_elems), MAX);               \
+  }
+#else
+#define HASH_TABLE_STORAGE(NAME, VAR, MAX)                                     \
+  static struct hash_table_##NAME VAR;                                         \
+  static void VAR##_init(void) { hash_table_##NAME##_init(&VAR, MAX); }
+#endif // ECS_STATIC_STORAGE
+
 #define DEFINE_HASH(VALTYPE, NAME)                                             \
   struct hash_table_##NAME##_elem {                                            \
     uint32_t hash;                                                             \
@@ -39,13 +113,26 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
     struct hash_table_##NAME##_elem *elems;                                    \
     uint8_t *deleted;                                                          \
     uint32_t num_elems;                                                        \
+    /* deleted slots, they count towards the load like live elements */        \
+    uint32_t num_tombstones;                                                   \
     uint32_t cap;                                                              \
     uint32_t mask;                                                             \
     uint resize_thresh;                                                        \
+    /* capacity allocated by the first insert, elems is NULL until then */     \
+    uint32_t lazy_cap;                                                         \
+    struct ecs_allocator *alloc;                                               \
+    /* the storage is not owned by the table and never grows */                \
+    bool fixed;                                                                \
   };                                                                           \
   struct hash_table_##NAME *hash_table_##NAME##_new();                         \
   void hash_table_##NAME##_free(struct hash_table_##NAME *table);              \
-  void hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems);                           \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems);                     \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table);           \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
                                   VALTYPE v);                                  \
   VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
                                       uint32_t k);                             \
@@ -53,7 +140,35 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
                                   uint32_t k);                                 \
   bool hash_table_##NAME##_is_entry_deleted(struct hash_table_##NAME *table,   \
                                             uint32_t idx);                     \
-  void hash_table_##NAME##_clear(struct hash_table_##NAME *table);
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table);             \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems);                        \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table);            \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out);                \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table);           \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##_count(                            \
+      struct hash_table_##NAME *table) {                                       \
+    return table->num_elems;                                                   \
+  }                                                                            \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##__slot_count(                      \
+      struct hash_table_##NAME *table) {                                       \
+    return table->cap;                                                         \
+  }                                                                            \
+                                                                               \
+  static inline VALTYPE *hash_table_##NAME##__slot(                            \
+      struct hash_table_##NAME *table, uint32_t idx, uint32_t *key) {          \
+    struct hash_table_##NAME##_elem *e = &table->elems[idx];                   \
+                                                                               \
+    if (!e->hash || hash_table_##NAME##_is_entry_deleted(table, idx)) {        \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    *key = e->key;                                                             \
+    return &e->val;                                                            \
+  }
 
 #define MAKE_HASH(VALTYPE, NAME)                                               \
   bool hash_table_##NAME##_is_entry_deleted(struct hash_table_##NAME *table,   \
@@ -122,11 +237,15 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
       uint32_t current_elem_probes =                                           \
           hash_table_##NAME##__max_probes(table, table->elems[idx].hash, idx); \
                                                                                \
-      /* the element is deleted, just replace it  */                           \
-      if (hash_table_##NAME##_is_entry_deleted(table, idx)) {                  \
+      /* the element is deleted and no further from its ideal slot than the    \
+       * one to insert, just replace it. A poorer tombstone has to be skipped  \
+       * like a live element would be, or lookups passing it stop early */     \
+      if (hash_table_##NAME##_is_entry_deleted(table, idx) &&                  \
+          current_elem_probes <= to_insert_elem_probes) {                      \
                                                                                \
         /* undelete  */                                                        \
         hash_table_##NAME##__reset_deleted(table, idx);                        \
+        table->num_tombstones--;                                               \
                                                                                \
         table->elems[idx] = e;                                                 \
                                                                                \
@@ -158,6 +277,11 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
                                                                                \
     uint32_t num_probes = 0;                                                   \
                                                                                \
+    /* also covers a table that hasn't allocated yet */                        \
+    if (!table->num_elems) {                                                   \
+      return -1;                                                               \
+    }                                                                          \
+                                                                               \
     for (;;) {                                                                 \
       uint32_t current_hash = table->elems[idx].hash;                          \
                                                                                \
@@ -187,20 +311,46 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
   }                                                                            \
                                                                                \
   static void hash_table_##NAME##__construct(struct hash_table_##NAME *table,  \
+                                             struct ecs_allocator *alloc,      \
                                              uint32_t initial_capacity) {      \
-    table->elems =                                                             \
-        calloc(initial_capacity, sizeof(struct hash_table_##NAME##_elem));     \
-    table->deleted = bit_array_new(initial_capacity);                          \
+    table->alloc = alloc;                                                      \
+    table->elems = ecs_alloc(alloc, sizeof(struct hash_table_##NAME##_elem) *  \
+                                        initial_capacity);                     \
+    table->deleted =                                                           \
+        ecs_alloc(alloc, bit_array_num_bytes(initial_capacity));               \
     table->num_elems = 0;                                                      \
+    table->num_tombstones = 0;                                                 \
     table->cap = initial_capacity;                                             \
     table->mask = initial_capacity - 1;                                        \
     table->resize_thresh =                                                     \
         (initial_capacity * hash_table_load_factor_to_grow) / 100;             \
+    table->lazy_cap = initial_capacity;                                        \
+    table->fixed = false;                                                      \
   }                                                                            \
                                                                                \
-  static void hash_table_##NAME##__grow(struct hash_table_##NAME *table) {     \
+  /* an empty table whose first insert allocates `initial_capacity` slots */   \
+  static void hash_table_##NAME##__construct_lazy(                             \
+      struct hash_table_##NAME *table, struct ecs_allocator *alloc,            \
+      uint32_t initial_capacity) {                                             \
+    memset(table, 0, sizeof(struct hash_table_##NAME));                        \
+    table->alloc = alloc;                                                      \
+    table->lazy_cap = initial_capacity;                                        \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__destruct(struct hash_table_##NAME *table) { \
+    if (table->fixed || !table->elems) {                                       \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    ecs_free(table->alloc, table->elems,                                       \
+             sizeof(struct hash_table_##NAME##_elem) * table->cap);            \
+    ecs_free(table->alloc, table->deleted, bit_array_num_bytes(table->cap));   \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__resize(struct hash_table_##NAME *table,     \
+                                          uint32_t new_cap) {                  \
     struct hash_table_##NAME new_table;                                        \
-    hash_table_##NAME##__construct(&new_table, table->cap * 2);                \
+    hash_table_##NAME##__construct(&new_table, table->alloc, new_cap);         \
                                                                                \
     new_table.num_elems = table->num_elems;                                    \
                                                                                \
@@ -212,39 +362,123 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
       }                                                                        \
     }                                                                          \
                                                                                \
-    hash_table_##NAME##_free(table);                                           \
+    hash_table_##NAME##__destruct(table);                                      \
     *table = new_table;                                                        \
   }                                                                            \
                                                                                \
+  /* shift the rest of the run back over the tombstone at `idx` */             \
+  static void hash_table_##NAME##__close(struct hash_table_##NAME *table,      \
+                                         uint32_t idx) {                       \
+    uint32_t next = (idx + 1) & table->mask;                                   \
+                                                                               \
+    while (table->elems[next].hash &&                                          \
+           hash_table_##NAME##__max_probes(table, table->elems[next].hash,     \
+                                           next) > 0) {                        \
+      table->elems[idx] = table->elems[next];                                  \
+      set_bit_in_bitarray(table->deleted, idx,                                 \
+                          hash_table_##NAME##_is_entry_deleted(table, next));  \
+      idx = next;                                                              \
+      next = (next + 1) & table->mask;                                         \
+    }                                                                          \
+                                                                               \
+    memset(&table->elems[idx], 0, sizeof(struct hash_table_##NAME##_elem));    \
+    hash_table_##NAME##__reset_deleted(table, idx);                            \
+  }                                                                            \
+                                                                               \
+  /* drop every tombstone in place, fixed tables can't be rebuilt */           \
+  static void hash_table_##NAME##__purge(struct hash_table_##NAME *table) {    \
+    for (uint32_t i = 0; table->num_tombstones; i = (i + 1) & table->mask) {   \
+      if (table->elems[i].hash &&                                              \
+          hash_table_##NAME##_is_entry_deleted(table, i)) {                    \
+        hash_table_##NAME##__close(table, i);                                  \
+        table->num_tombstones--;                                               \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void hash_table_##NAME##__grow(struct hash_table_##NAME *table) {     \
+    hash_table_##NAME##__resize(table, table->elems ? table->cap * 2           \
+                                                    : table->lazy_cap);        \
+  }                                                                            \
+                                                                               \
   struct hash_table_##NAME *hash_table_##NAME##_new() {                        \
+    struct ecs_allocator *alloc = ecs_current_allocator();                     \
     struct hash_table_##NAME *table =                                          \
-        malloc(sizeof(struct hash_table_##NAME));                              \
-    hash_table_##NAME##__construct(table, hash_table_initial_cap);             \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME));                    \
+    hash_table_##NAME##__construct_lazy(table, alloc, hash_table_initial_cap); \
     return table;                                                              \
   }                                                                            \
                                                                                \
   void hash_table_##NAME##_free(struct hash_table_##NAME *table) {             \
-    free(table->elems);                                                        \
-    free(table->deleted);                                                      \
+    hash_table_##NAME##__destruct(table);                                      \
+    ecs_free(table->alloc, table, sizeof(struct hash_table_##NAME));           \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems) {                          \
+    uint32_t cap = HASH_TABLE_SLOTS_FOR(num_elems);                            \
+    hash_table_##NAME##__construct_lazy(table, ecs_current_allocator(),        \
+                                        MAX(cap, hash_table_initial_cap));     \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems) {                    \
+    memset(elems, 0, sizeof(struct hash_table_##NAME##_elem) * cap);           \
+    memset(deleted, 0, bit_array_num_bytes(cap));                              \
+    table->elems = elems;                                                      \
+    table->deleted = deleted;                                                  \
+    table->num_elems = 0;                                                      \
+    table->num_tombstones = 0;                                                 \
+    table->cap = cap;                                                          \
+    table->mask = cap - 1;                                                     \
+    table->resize_thresh = max_elems + 1;                                      \
+    table->lazy_cap = cap;                                                     \
+    table->alloc = NULL;                                                       \
+    table->fixed = true;                                                       \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table) {          \
+    hash_table_##NAME##__destruct(table);                                      \
   }                                                                            \
                                                                                \
-  void hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
                                   VALTYPE v) {                                 \
     uint32_t hash =                                                            \
         hash_table_##NAME##__fix_hash(hash_table_##NAME##__hash_fun(k));       \
+    int64_t existing = hash_table_##NAME##__lookup(table, k);                  \
+                                                                               \
+    /* a key that is already present keeps its slot and takes the new value */ \
+    if (existing >= 0) {                                                       \
+      table->elems[existing].val = v;                                          \
+      return true;                                                             \
+    }                                                                          \
                                                                                \
     /* printf("num_elems: %d, resize_thresh: %d\n", table->num_elems,          \
      * table->resize_thresh); */                                               \
                                                                                \
     table->num_elems++;                                                        \
                                                                                \
-    if (table->num_elems >= table->resize_thresh) {                            \
+    /* a fixed table can only make room by dropping its tombstones, others     \
+     * drop them in place too while they are a good part of the load */        \
+    if (table->num_elems + table->num_tombstones >= table->resize_thresh &&    \
+        (table->fixed || table->num_tombstones > table->num_elems / 4)) {      \
+      hash_table_##NAME##__purge(table);                                       \
+    }                                                                          \
+                                                                               \
+    if (table->num_elems + table->num_tombstones >= table->resize_thresh) {    \
+      if (table->fixed) {                                                      \
+        table->num_elems--;                                                    \
+        return false;                                                          \
+      }                                                                        \
+                                                                               \
       /* printf("growing table\n"); */                                         \
       hash_table_##NAME##__grow(table);                                        \
     }                                                                          \
                                                                                \
     hash_table_##NAME##__insert(                                               \
         table, (struct hash_table_##NAME##_elem){hash, k, v});                 \
+    return true;                                                               \
   }                                                                            \
                                                                                \
   VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
@@ -267,13 +501,93 @@ static const uint8_t hash_table_load_factor_to_grow = 90;
                                                                                \
     hash_table_##NAME##__mark_deleted(table, idx);                             \
     table->num_elems--;                                                        \
+    table->num_tombstones++;                                                   \
     return true;                                                               \
   }                                                                            \
   void hash_table_##NAME##_clear(struct hash_table_##NAME *table) {            \
+    if (!table->elems) {                                                       \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
     memset(table->elems, 0,                                                    \
            sizeof(struct hash_table_##NAME##_elem) * table->cap);              \
     memset(table->deleted, 0, table->cap / 8);                                 \
     table->num_elems = 0;                                                      \
-  }
+    table->num_tombstones = 0;                                                 \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems) {                       \
+    uint32_t cap = HASH_TABLE_SLOTS_FOR(num_elems);                            \
+                                                                               \
+    if (table->fixed) {                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    if (!table->elems) {                                                       \
+      table->lazy_cap = MAX(table->lazy_cap, cap);                             \
+    } else if (cap > table->cap) {                                             \
+      hash_table_##NAME##__resize(table, cap);                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* room for twice the elements, so the next inserts don't regrow it */       \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table) {           \
+    uint32_t cap = MAX(HASH_TABLE_SLOTS_FOR((uint64_t)table->num_elems * 2),   \
+                       hash_table_initial_cap);                                \
+                                                                               \
+    if (table->fixed || !table->elems || cap >= table->cap) {                  \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    hash_table_##NAME##__resize(table, cap);                                   \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out) {               \
+    uint64_t total_probes = 0;                                                 \
+                                                                               \
+    memset(out, 0, sizeof(*out));                                              \
+    if (!table->elems) {                                                       \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    out->cap = table->cap;                                                     \
+    out->bytes_allocated =                                                     \
+        sizeof(struct hash_table_##NAME##_elem) * table->cap +                 \
+        bit_array_num_bytes(table->cap);                                       \
+                                                                               \
+    for (uint32_t i = 0; i < table->cap; i++) {                                \
+      uint32_t hash = table->elems[i].hash;                                    \
+                                                                               \
+      if (!hash) {                                                             \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      if (hash_table_##NAME##_is_entry_deleted(table, i)) {                    \
+        out->num_tombstones++;                                                 \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      uint32_t probes = hash_table_##NAME##__max_probes(table, hash, i);       \
+      uint32_t bucket = probes < HASH_TABLE_STATS_HIST_BUCKETS                 \
+                            ? probes                                           \
+                            : HASH_TABLE_STATS_HIST_BUCKETS - 1;               \
+                                                                               \
+      out->num_elems++;                                                        \
+      out->probe_hist[bucket]++;                                               \
+      total_probes += probes;                                                  \
+      if (probes > out->max_probes) {                                          \
+        out->max_probes = probes;                                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    if (out->num_elems) {                                                      \
+      out->mean_probes = (double)total_probes / out->num_elems;                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* nothing is ever retired, tables are single threaded */                    \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table) {}
 
 #endif // __HASH_H_
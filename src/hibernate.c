@@ -0,0 +1,459 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "component.h"
+#include "hibernate.h"
+
+REGISTER_COMPACT_COMPONENT(hibernated, struct hibernated_blob);
+
+// smallest buffer the store allocates
+static const uint32_t cold_store_min_cap = 4096;
+// dead bytes worth compacting for, below this the buffer is left alone
+static const uint32_t cold_store_min_dead = 64 * 1024;
+// most bytes a value header takes, two varints
+static const size_t cold_store_max_header = 10;
+
+static struct {
+  // blobs of every hibernating entity, and of woken ones until compacted
+  uint8_t *bytes;
+  uint32_t length;
+  uint32_t cap;
+  // bytes of blobs that are no longer referenced
+  uint32_t dead;
+  // holds one value while it is packed or unpacked
+  uint8_t *scratch;
+  size_t scratch_size;
+  // most bytes one blob can take, with a value of every component
+  size_t max_blob;
+  struct ecs_allocator *alloc;
+  bool raw;
+} cold_store;
+
+static struct component_def **cold_store__defs(size_t *num_defs) {
+  extern struct component_def *__start_component_def_array[];
+  extern struct component_def *__stop_component_def_array[];
+
+  *num_defs = __stop_component_def_array - __start_component_def_array;
+  return __start_component_def_array;
+}
+
+// every component apart from the store itself
+static bool cold_store__is_hot(const struct component_def *def) {
+  return (const void *)def != (const void *)&hibernated;
+}
+
+static void cold_store__on_delete(uint32_t ent_id, const void *val) {
+  cold_store.dead += ((const struct hibernated_blob *)val)->size;
+}
+
+static void cold_store__on_add(uint32_t ent_id, const void *val) {}
+
+static void cold_store__on_clear(bool reset) {
+  bool raw = cold_store.raw;
+
+  if (reset) {
+    // the memory went with the arena, see `reset_component_storage`
+    memset(&cold_store, 0, sizeof(cold_store));
+    cold_store.raw = raw;
+  }
+  cold_store.length = 0;
+  cold_store.dead = 0;
+}
+
+static struct component_hook cold_store_hook = {
+    .on_add = &cold_store__on_add,
+    .on_delete = &cold_store__on_delete,
+    .on_clear = &cold_store__on_clear};
+
+static void cold_store_init(void) __attribute__((constructor));
+static void cold_store_init(void) {
+  cold_store_hook.next = component_hibernated_hooks;
+  component_hibernated_hooks = &cold_store_hook;
+}
+
+// Memory of the store
+
+static bool cold_store__prepare(void) {
+  size_t num_defs;
+  struct component_def **defs = cold_store__defs(&num_defs);
+
+  if (ECS_STATIC_STORAGE_ENABLED) {
+    return false;
+  }
+
+  if (!cold_store.alloc) {
+    cold_store.alloc = ecs_current_allocator();
+  }
+
+  if (!cold_store.scratch) {
+    for (size_t i = 0; i < num_defs; i++) {
+      cold_store.scratch_size = MAX(cold_store.scratch_size,
+                                    defs[i]->value_size);
+      cold_store.max_blob += cold_store_max_header + defs[i]->value_size;
+    }
+    cold_store.scratch = ecs_alloc(cold_store.alloc, cold_store.scratch_size);
+  }
+  return true;
+}
+
+// room for `n` more bytes, the buffer is limited to 32 bit offsets
+static bool cold_store__reserve(size_t n) {
+  uint64_t needed = (uint64_t)cold_store.length + n;
+
+  if (needed > UINT32_MAX) {
+    return false;
+  }
+  if (needed <= cold_store.cap) {
+    return true;
+  }
+
+  uint64_t cap = MAX(MAX(needed, (uint64_t)cold_store.cap * 2),
+                     cold_store_min_cap);
+
+  cap = MIN(cap, UINT32_MAX);
+  if (cold_store.cap) {
+    cold_store.bytes = ecs_realloc(cold_store.alloc, cold_store.bytes,
+                                   cold_store.cap, cap);
+  } else {
+    cold_store.bytes = ecs_alloc(cold_store.alloc, cap);
+  }
+  cold_store.cap = cap;
+  return true;
+}
+
+// move the live blobs into a new buffer once most of the old one is dead
+static void cold_store__compact(void) {
+  if (cold_store.dead < cold_store_min_dead ||
+      cold_store.dead < cold_store.length / 2) {
+    return;
+  }
+
+  uint32_t live = cold_store.length - cold_store.dead;
+  uint32_t cap = MAX(live + live / 4, cold_store_min_cap);
+  uint8_t *bytes = ecs_alloc(cold_store.alloc, cap);
+  uint32_t length = 0;
+
+  HASH_TABLE_ITER(component_hibernated_storage, id, blob, hibernated.storage, {
+    memcpy(&bytes[length], &cold_store.bytes[blob->offset], blob->size);
+    blob->offset = length;
+    length += blob->size;
+  });
+
+  ecs_free(cold_store.alloc, cold_store.bytes, cold_store.cap);
+  cold_store.bytes = bytes;
+  cold_store.length = length;
+  cold_store.cap = cap;
+  cold_store.dead = 0;
+}
+
+// Encoding
+//
+// A blob is a list of values, each one a varint of the component's position
+// in the component section shifted left once, with the low bit set if the
+// value is packed. Packed values go on with a varint of their packed length
+// and the packed bytes, others with the `value_size` bytes of the value.
+
+static size_t cold_store__put_varint(uint8_t *out, uint32_t v) {
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+static uint32_t cold_store__get_varint(const uint8_t **in) {
+  uint32_t v = 0;
+  uint32_t shift = 0;
+  uint8_t b;
+
+  do {
+    b = *(*in)++;
+    v |= (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return v;
+}
+
+// PackBits: a control byte below 128 is followed by that many plus one
+// literal bytes, one from 128 up by a byte repeated 125 times less than it.
+// Returns SIZE_MAX if the result would be longer than `max`.
+static size_t cold_store__pack(const uint8_t *in, size_t n, uint8_t *out,
+                               size_t max) {
+  size_t i = 0, o = 0;
+
+  while (i < n) {
+    size_t run = 1;
+
+    while (i + run < n && run < 130 && in[i + run] == in[i]) {
+      run++;
+    }
+
+    if (run >= 3) {
+      if (o + 2 > max) {
+        return SIZE_MAX;
+      }
+      out[o++] = (uint8_t)(run + 125);
+      out[o++] = in[i];
+      i += run;
+      continue;
+    }
+
+    // literals up to the next run of three
+    size_t lit = 1;
+
+    while (i + lit < n && lit < 128 &&
+           !(i + lit + 2 < n && in[i + lit] == in[i + lit + 1] &&
+             in[i + lit] == in[i + lit + 2])) {
+      lit++;
+    }
+
+    if (o + 1 + lit > max) {
+      return SIZE_MAX;
+    }
+    out[o++] = (uint8_t)(lit - 1);
+    memcpy(&out[o], &in[i], lit);
+    o += lit;
+    i += lit;
+  }
+
+  return o;
+}
+
+static void cold_store__unpack(const uint8_t *in, size_t n, uint8_t *out) {
+  const uint8_t *end = in + n;
+
+  while (in < end) {
+    uint8_t c = *in++;
+
+    if (c < 128) {
+      memcpy(out, in, c + 1);
+      in += c + 1;
+      out += c + 1;
+    } else {
+      memset(out, *in++, c - 125);
+      out += c - 125;
+    }
+  }
+}
+
+// write the value `val` of component `idx` to `out`, returns the bytes used
+static size_t cold_store__encode(uint8_t *out, uint32_t idx, const void *val,
+                                 size_t size) {
+  size_t packed = SIZE_MAX;
+  size_t len_size = 0;
+  uint8_t len[5];
+
+  if (!cold_store.raw) {
+    packed = cold_store__pack(val, size, cold_store.scratch, size);
+  }
+  if (packed != SIZE_MAX) {
+    len_size = cold_store__put_varint(len, packed);
+  }
+
+  if (packed == SIZE_MAX || packed + len_size >= size) {
+    size_t n = cold_store__put_varint(out, idx << 1);
+
+    memcpy(&out[n], val, size);
+    return n + size;
+  }
+
+  size_t n = cold_store__put_varint(out, idx << 1 | 1);
+
+  memcpy(&out[n], len, len_size);
+  memcpy(&out[n + len_size], cold_store.scratch, packed);
+  return n + len_size + packed;
+}
+
+// read the value at `*in` into the scratch buffer, returns its component
+static struct component_def *cold_store__decode(struct component_def **defs,
+                                                const uint8_t **in) {
+  uint32_t tag = cold_store__get_varint(in);
+  struct component_def *def = defs[tag >> 1];
+
+  if (tag & 1) {
+    uint32_t packed = cold_store__get_varint(in);
+
+    cold_store__unpack(*in, packed, cold_store.scratch);
+    *in += packed;
+  } else {
+    memcpy(cold_store.scratch, *in, def->value_size);
+    *in += def->value_size;
+  }
+  return def;
+}
+
+// the component of the value at `*in`, skipping over it
+static uint32_t cold_store__skip(struct component_def **defs,
+                                 const uint8_t **in) {
+  uint32_t tag = cold_store__get_varint(in);
+
+  *in += tag & 1 ? cold_store__get_varint(in) : defs[tag >> 1]->value_size;
+  return tag >> 1;
+}
+
+// Hibernating and waking
+
+// sets `deleted[i]` for the components a value was deleted from, if given
+static bool cold_store__hibernate(struct component_def **defs,
+                                  size_t num_defs, uint32_t id,
+                                  bool *deleted) {
+  if (is_entity_hibernating(id) || !cold_store__reserve(cold_store.max_blob)) {
+    return false;
+  }
+
+  uint32_t offset = cold_store.length;
+  uint8_t *out = &cold_store.bytes[offset];
+
+  for (size_t i = 0; i < num_defs; i++) {
+    const void *val =
+        cold_store__is_hot(defs[i]) ? defs[i]->lookup_value(id) : NULL;
+
+    if (val) {
+      out += cold_store__encode(out, i, val, defs[i]->value_size);
+    }
+  }
+
+  uint32_t size = out - &cold_store.bytes[offset];
+
+  if (!hibernated.add_value(id, (struct hibernated_blob){offset, size})) {
+    return false;
+  }
+  cold_store.length += size;
+
+  // only the components the blob holds, most have nothing to delete
+  const uint8_t *in = &cold_store.bytes[offset];
+
+  while (in < out) {
+    uint32_t i = cold_store__skip(defs, &in);
+
+    defs[i]->delete_value(id);
+    if (deleted) {
+      deleted[i] = true;
+    }
+  }
+  return true;
+}
+
+static bool cold_store__wake(struct component_def **defs, uint32_t id) {
+  struct hibernated_blob *blob = hibernated.lookup_value(id);
+  bool woke = true;
+
+  if (!blob) {
+    return false;
+  }
+
+  const uint8_t *in = &cold_store.bytes[blob->offset];
+  const uint8_t *end = in + blob->size;
+
+  while (in < end) {
+    struct component_def *def = cold_store__decode(defs, &in);
+
+    woke = def->add_raw(id, cold_store.scratch) && woke;
+  }
+
+  if (woke) {
+    hibernated.delete_value(id);
+  }
+  return woke;
+}
+
+bool hibernate_entity(uint32_t id) {
+  size_t num_defs;
+  struct component_def **defs = cold_store__defs(&num_defs);
+
+  return cold_store__prepare() &&
+         cold_store__hibernate(defs, num_defs, id, NULL);
+}
+
+bool wake_entity(uint32_t id) {
+  size_t num_defs;
+  struct component_def **defs = cold_store__defs(&num_defs);
+
+  if (!cold_store__prepare() || !cold_store__wake(defs, id)) {
+    return false;
+  }
+
+  cold_store__compact();
+  return true;
+}
+
+size_t hibernate_entities(const uint32_t *ids, size_t n) {
+  size_t num_defs;
+  struct component_def **defs = cold_store__defs(&num_defs);
+  size_t hibernated_count = 0;
+
+  if (!cold_store__prepare()) {
+    return 0;
+  }
+
+  bool *deleted = ecs_alloc(cold_store.alloc, sizeof(bool) * num_defs);
+
+  memset(deleted, 0, sizeof(bool) * num_defs);
+  for (size_t i = 0; i < n; i++) {
+    hibernated_count += cold_store__hibernate(defs, num_defs, ids[i], deleted);
+  }
+
+  // only the tables this batch took values from, a no-op if still full enough
+  for (size_t i = 0; i < num_defs; i++) {
+    if (deleted[i]) {
+      defs[i]->shrink();
+    }
+  }
+  ecs_free(cold_store.alloc, deleted, sizeof(bool) * num_defs);
+  return hibernated_count;
+}
+
+size_t wake_entities(const uint32_t *ids, size_t n) {
+  size_t num_defs;
+  struct component_def **defs = cold_store__defs(&num_defs);
+  size_t woken = 0;
+
+  if (!cold_store__prepare()) {
+    return 0;
+  }
+
+  // count the values coming back to each component to grow it just once
+  uint32_t *incoming =
+      ecs_alloc(cold_store.alloc, sizeof(uint32_t) * num_defs);
+
+  memset(incoming, 0, sizeof(uint32_t) * num_defs);
+  for (size_t i = 0; i < n; i++) {
+    struct hibernated_blob *blob = hibernated.lookup_value(ids[i]);
+
+    if (!blob) {
+      continue;
+    }
+
+    const uint8_t *in = &cold_store.bytes[blob->offset];
+    const uint8_t *end = in + blob->size;
+
+    while (in < end) {
+      incoming[cold_store__skip(defs, &in)]++;
+    }
+  }
+
+  for (size_t i = 0; i < num_defs; i++) {
+    if (incoming[i]) {
+      defs[i]->reserve(defs[i]->count() + incoming[i]);
+    }
+  }
+  ecs_free(cold_store.alloc, incoming, sizeof(uint32_t) * num_defs);
+
+  for (size_t i = 0; i < n; i++) {
+    woken += cold_store__wake(defs, ids[i]);
+  }
+
+  cold_store__compact();
+  return woken;
+}
+
+void set_hibernation_compression(bool on) { cold_store.raw = !on; }
+
+size_t hibernated_bytes(void) { return cold_store.length - cold_store.dead; }
@@ -0,0 +1,85 @@
+#ifndef __HIBERNATE_H_
+#define __HIBERNATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "component.h"
+
+// Cold storage for idle entities
+//
+// Hibernating an entity moves the values of all its components out of their
+// tables into one blob in a cold store, waking it puts them back. Joins and
+// systems don't see a hibernating entity, and the hot tables only hold the
+// entities that are awake.
+//
+// Blobs are packed one after another in a single buffer. Each value is run
+// length encoded when that makes it smaller, which pays off for values with
+// zeroed fields or padding. The space of woken and killed entities is taken
+// back by compacting the buffer once most of it is dead.
+//
+// Component hooks see hibernating as a delete and waking as an add, so
+// indexes and spatial grids drop a hibernating entity. Hibernating a
+// hierarchy member makes its children roots: hibernate children before their
+// parents and wake parents first.
+//
+// The store is itself a component, `hibernated`, so killing a hibernating
+// entity or removing every entity drops its blob as well. Not thread safe,
+// and not available with ECS_STATIC_STORAGE, where every call fails.
+
+/**
+ * Where the blob of a hibernating entity is in the cold store.
+ */
+struct hibernated_blob {
+  uint32_t offset;
+  uint32_t size;
+};
+
+DEFINE_COMPACT_COMPONENT(hibernated, struct hibernated_blob);
+
+/**
+ * Move every component value of `id` to the cold store. Returns false if the
+ * entity is already hibernating or the store can't grow.
+ */
+bool hibernate_entity(uint32_t id);
+
+/**
+ * Put the values of a hibernating entity back, replacing any it was given in
+ * the meantime. Returns false if it isn't hibernating or a value couldn't be
+ * added, in which case the entity stays hibernating.
+ */
+bool wake_entity(uint32_t id);
+
+/**
+ * `hibernate_entity` for `n` entities, returns how many were hibernated.
+ * Afterwards shrinks the component tables it took values from that were left
+ * mostly empty, which moves their values: don't call it from inside a join or
+ * any other loop over a component table.
+ */
+size_t hibernate_entities(const uint32_t *ids, size_t n);
+
+/**
+ * `wake_entity` for `n` entities, returns how many woke. Every component is
+ * grown once for all the values coming back before they are added, so like
+ * `hibernate_entities` it must not be called from inside a loop over a
+ * component table.
+ */
+size_t wake_entities(const uint32_t *ids, size_t n);
+
+static inline bool is_entity_hibernating(uint32_t id) {
+  return hibernated.lookup_value(id) != NULL;
+}
+
+/**
+ * Turn the run length encoding of hibernated values on (the default) or off.
+ * Blobs already stored are unaffected.
+ */
+void set_hibernation_compression(bool on);
+
+/**
+ * Bytes taken by the blobs of hibernating entities.
+ */
+size_t hibernated_bytes(void);
+
+#endif // __HIBERNATE_H_
@@ -0,0 +1,195 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common_macros.h"
+#include "hierarchy.h"
+
+MAKE_HASH(struct hierarchy_node, hierarchy_nodes);
+MAKE_VECTOR(struct hierarchy_entry, hierarchy_entries);
+MAKE_VECTOR(uint32_t, hierarchy_ids);
+
+static const struct hierarchy_node hierarchy__unlinked = {
+    HIERARCHY_NONE, HIERARCHY_NONE, HIERARCHY_NONE, HIERARCHY_NONE};
+
+static struct hierarchy_node *hierarchy__get(struct hierarchy *h,
+                                             uint32_t id) {
+  return hash_table_hierarchy_nodes_lookup(&h->nodes, id);
+}
+
+// may move every other node, take pointers to them afterwards
+static void hierarchy__ensure(struct hierarchy *h, uint32_t id) {
+  if (!hierarchy__get(h, id)) {
+    hash_table_hierarchy_nodes_insert(&h->nodes, id, hierarchy__unlinked);
+    h->dirty = true;
+  }
+}
+
+static void hierarchy__unlink(struct hierarchy *h,
+                              struct hierarchy_node *node) {
+  if (node->prev_sibling != HIERARCHY_NONE) {
+    hierarchy__get(h, node->prev_sibling)->next_sibling = node->next_sibling;
+  } else if (node->parent != HIERARCHY_NONE) {
+    hierarchy__get(h, node->parent)->first_child = node->next_sibling;
+  }
+
+  if (node->next_sibling != HIERARCHY_NONE) {
+    hierarchy__get(h, node->next_sibling)->prev_sibling = node->prev_sibling;
+  }
+
+  node->parent = HIERARCHY_NONE;
+  node->next_sibling = HIERARCHY_NONE;
+  node->prev_sibling = HIERARCHY_NONE;
+}
+
+static void hierarchy__link(struct hierarchy *h, uint32_t id,
+                            struct hierarchy_node *node, uint32_t parent) {
+  if (parent == HIERARCHY_NONE) {
+    return;
+  }
+
+  struct hierarchy_node *p = hierarchy__get(h, parent);
+
+  node->parent = parent;
+  node->next_sibling = p->first_child;
+  if (p->first_child != HIERARCHY_NONE) {
+    hierarchy__get(h, p->first_child)->prev_sibling = id;
+  }
+  p->first_child = id;
+}
+
+void hierarchy_init(struct hierarchy *h) {
+  hash_table_hierarchy_nodes_init(&h->nodes, 0);
+  h->order = vector_hierarchy_entries_new(0);
+  h->subtree = vector_hierarchy_ids_new(0);
+  h->dirty = false;
+}
+
+void hierarchy_destroy(struct hierarchy *h) {
+  hash_table_hierarchy_nodes_destroy(&h->nodes);
+  vector_hierarchy_entries_free(&h->order);
+  vector_hierarchy_ids_free(&h->subtree);
+}
+
+void hierarchy_clear(struct hierarchy *h) {
+  hash_table_hierarchy_nodes_clear(&h->nodes);
+  h->order.length = 0;
+  h->subtree.length = 0;
+  h->dirty = false;
+}
+
+bool hierarchy_is_ancestor(struct hierarchy *h, uint32_t ancestor,
+                           uint32_t id) {
+  while (id != HIERARCHY_NONE) {
+    if (id == ancestor) {
+      return true;
+    }
+
+    struct hierarchy_node *node = hierarchy__get(h, id);
+
+    if (!node) {
+      return false;
+    }
+    id = node->parent;
+  }
+
+  return false;
+}
+
+bool hierarchy_set_parent(struct hierarchy *h, uint32_t id, uint32_t parent) {
+  if (parent != HIERARCHY_NONE) {
+    if (hierarchy_is_ancestor(h, id, parent)) {
+      return false;
+    }
+    hierarchy__ensure(h, parent);
+  }
+  hierarchy__ensure(h, id);
+
+  struct hierarchy_node *node = hierarchy__get(h, id);
+
+  if (node->parent == parent) {
+    return true;
+  }
+
+  hierarchy__unlink(h, node);
+  hierarchy__link(h, id, node, parent);
+  h->dirty = true;
+  return true;
+}
+
+void hierarchy_remove(struct hierarchy *h, uint32_t id) {
+  struct hierarchy_node *node = hierarchy__get(h, id);
+
+  if (!node) {
+    return;
+  }
+
+  hierarchy__unlink(h, node);
+
+  for (uint32_t c = node->first_child; c != HIERARCHY_NONE;) {
+    struct hierarchy_node *child = hierarchy__get(h, c);
+
+    c = child->next_sibling;
+    *child = (struct hierarchy_node){HIERARCHY_NONE, child->first_child,
+                                     HIERARCHY_NONE, HIERARCHY_NONE};
+  }
+
+  hash_table_hierarchy_nodes_delete(&h->nodes, id);
+  h->dirty = true;
+}
+
+size_t hierarchy_subtree(struct hierarchy *h, uint32_t root, uint32_t *out,
+                         size_t max) {
+  struct vector_hierarchy_ids *queue = &h->subtree;
+
+  queue->length = 0;
+  if (!hierarchy__get(h, root)) {
+    return 0;
+  }
+
+  // the ids found so far double as the queue of nodes to visit
+  vector_hierarchy_ids_push(queue, root);
+  for (size_t i = 0; i < queue->length; i++) {
+    for (uint32_t c = hierarchy__get(h, queue->data[i])->first_child;
+         c != HIERARCHY_NONE; c = hierarchy__get(h, c)->next_sibling) {
+      vector_hierarchy_ids_push(queue, c);
+    }
+  }
+
+  if (out) {
+    memcpy(out, queue->data, sizeof(uint32_t) * MIN(max, queue->length));
+  }
+  return queue->length;
+}
+
+const struct vector_hierarchy_entries *hierarchy_order(struct hierarchy *h) {
+  struct vector_hierarchy_entries *order = &h->order;
+
+  if (!h->dirty) {
+    return order;
+  }
+
+  order->length = 0;
+  HASH_TABLE_ITER(hierarchy_nodes, id, node, &h->nodes, {
+    if (node->parent == HIERARCHY_NONE) {
+      vector_hierarchy_entries_push(
+          order, (struct hierarchy_entry){id, HIERARCHY_NONE,
+                                          HIERARCHY_NONE, 0});
+    }
+  });
+
+  // entries are appended while walking, so hold indexes rather than pointers
+  for (uint32_t i = 0; i < order->length; i++) {
+    uint32_t parent = order->data[i].id;
+    uint32_t depth = order->data[i].depth + 1;
+
+    for (uint32_t c = hierarchy__get(h, parent)->first_child;
+         c != HIERARCHY_NONE; c = hierarchy__get(h, c)->next_sibling) {
+      vector_hierarchy_entries_push(
+          order, (struct hierarchy_entry){c, parent, i, depth});
+    }
+  }
+
+  h->dirty = false;
+  return order;
+}
@@ -0,0 +1,242 @@
+#ifndef __HIERARCHY_H_
+#define __HIERARCHY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_macros.h"
+#include "component.h"
+#include "entity.h"
+#include "hash_table.h"
+#include "vec.h"
+
+// Parent / child relationships between entities
+//
+// Every member of a hierarchy has a node holding its parent, first child and
+// next and previous siblings. The members are also kept in breadth first
+// order, roots first and then one depth after another, so a pass that needs
+// each parent handled before its children (propagating transforms, say) is a
+// single linear sweep. Each entry of the order knows where its parent is in
+// it, results can be kept in an array indexed the same way instead of looked
+// up by entity.
+//
+// The order is rebuilt from the links the first time it is asked for after the
+// hierarchy changed, which is linear in its size; a tick that only sweeps
+// pays nothing for it.
+//
+// Hierarchies allocate as they grow, so they aren't available with
+// ECS_STATIC_STORAGE.
+
+#define HIERARCHY_NONE UINT32_MAX
+
+struct hierarchy_node {
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint32_t prev_sibling;
+};
+
+struct hierarchy_entry {
+  uint32_t id;
+  uint32_t parent;
+  // position of the parent in the order, HIERARCHY_NONE for roots
+  uint32_t parent_idx;
+  uint32_t depth;
+};
+
+DEFINE_HASH(struct hierarchy_node, hierarchy_nodes);
+DEFINE_VECTOR(struct hierarchy_entry, hierarchy_entries);
+DEFINE_VECTOR(uint32_t, hierarchy_ids);
+
+struct hierarchy {
+  // entity -> links
+  struct hash_table_hierarchy_nodes nodes;
+  // breadth first order, only valid while `dirty` is false
+  struct vector_hierarchy_entries order;
+  // ids found by the last `hierarchy_subtree`
+  struct vector_hierarchy_ids subtree;
+  bool dirty;
+};
+
+void hierarchy_init(struct hierarchy *h);
+void hierarchy_destroy(struct hierarchy *h);
+
+/**
+ * Remove every node, keeping the memory.
+ */
+void hierarchy_clear(struct hierarchy *h);
+
+/**
+ * Make `id` a child of `parent`, or a root if `parent` is HIERARCHY_NONE,
+ * adding either to the hierarchy if it isn't in it yet. The children of `id`
+ * move with it. Returns false, changing nothing, if `parent` is `id` or one
+ * of its descendants.
+ */
+bool hierarchy_set_parent(struct hierarchy *h, uint32_t id, uint32_t parent);
+
+/**
+ * Remove `id` from the hierarchy, its children become roots.
+ */
+void hierarchy_remove(struct hierarchy *h, uint32_t id);
+
+/**
+ * Links of `id`, or NULL if it isn't in the hierarchy.
+ */
+static inline const struct hierarchy_node *hierarchy_node(struct hierarchy *h,
+                                                          uint32_t id) {
+  return hash_table_hierarchy_nodes_lookup(&h->nodes, id);
+}
+
+/**
+ * Whether `ancestor` is `id` or one of its ancestors.
+ */
+bool hierarchy_is_ancestor(struct hierarchy *h, uint32_t ancestor,
+                           uint32_t id);
+
+/**
+ * `root` and all its descendants in breadth first order. Writes up to `max`
+ * ids to `out` and returns how many there are, which may be more than `max`.
+ */
+size_t hierarchy_subtree(struct hierarchy *h, uint32_t root, uint32_t *out,
+                         size_t max);
+
+/**
+ * Every member in breadth first order, parents always before their children.
+ * Stays valid until the hierarchy next changes.
+ */
+const struct vector_hierarchy_entries *hierarchy_order(struct hierarchy *h);
+
+/**
+ * Loop over every member of hierarchy `H` in breadth first order,
+ * `ENTRY_VAR` is a `const struct hierarchy_entry *` and `IDX_VAR` its
+ * position in the order.
+ *
+ * Usage:
+ * FOR_EACH_HIERARCHY(&hierarchy_child_of, e, i, {
+ *     world[i] = e->parent_idx == HIERARCHY_NONE
+ *                    ? local(e->id)
+ *                    : compose(world[e->parent_idx], local(e->id));
+ * });
+ */
+#define FOR_EACH_HIERARCHY(H, ENTRY_VAR, IDX_VAR, ...)                         \
+  do {                                                                         \
+    const struct vector_hierarchy_entries *hierarchy__order =                  \
+        hierarchy_order(H);                                                    \
+    for (uint32_t IDX_VAR = 0; IDX_VAR < hierarchy__order->length;             \
+         IDX_VAR++) {                                                          \
+      const struct hierarchy_entry *ENTRY_VAR =                                \
+          &hierarchy__order->data[IDX_VAR];                                    \
+      { __VA_ARGS__ }                                                          \
+    }                                                                          \
+  } while (0)
+
+/**
+ * The component added to members of a hierarchy, `parent` is HIERARCHY_NONE
+ * for roots.
+ */
+struct hierarchy_link {
+  uint32_t parent;
+};
+
+/**
+ * Declare a hierarchy, a component `NAME` of `struct hierarchy_link` plus a
+ * `struct hierarchy` named `hierarchy_<name>` kept in step with it, usage:
+ *
+ * DEFINE_HIERARCHY(child_of);
+ *
+ * hierarchy_child_of_set_parent(wheel, car);
+ * hierarchy_child_of_despawn(car);
+ *
+ * Set parents with `hierarchy_<name>_set_parent`, which refuses cycles.
+ * Adding the component directly with `add_value` works too but doesn't check
+ * for them, and replaces the value by removing the entity first, so its
+ * children become roots. Killing a member makes its children roots,
+ * `hierarchy_<name>_despawn` kills it together with all its descendants.
+ */
+#define DEFINE_HIERARCHY(NAME)                                                 \
+  DEFINE_COMPONENT(NAME, struct hierarchy_link);                               \
+  extern struct hierarchy hierarchy_##NAME;                                    \
+  bool hierarchy_##NAME##_set_parent(uint32_t ent_id, uint32_t parent);        \
+  void hierarchy_##NAME##_despawn(uint32_t ent_id);
+
+#define REGISTER_HIERARCHY(NAME)                                               \
+  _Static_assert(!ECS_STATIC_STORAGE_ENABLED,                                  \
+                 "hierarchies allocate, they are not available with "          \
+                 "ECS_STATIC_STORAGE");                                        \
+  REGISTER_COMPONENT(NAME, struct hierarchy_link);                             \
+  struct hierarchy hierarchy_##NAME;                                           \
+  /* the children of a removed member become roots */                          \
+  static void hierarchy_##NAME##__orphan_children(uint32_t ent_id) {           \
+    const struct hierarchy_node *node =                                        \
+        hierarchy_node(&hierarchy_##NAME, ent_id);                             \
+    for (uint32_t c = node ? node->first_child : HIERARCHY_NONE;               \
+         c != HIERARCHY_NONE;                                                  \
+         c = hierarchy_node(&hierarchy_##NAME, c)->next_sibling) {             \
+      struct hierarchy_link *link = NAME.lookup_value(c);                      \
+      if (link) {                                                              \
+        link->parent = HIERARCHY_NONE;                                         \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+  static void hierarchy_##NAME##__on_add(uint32_t ent_id, const void *val) {   \
+    uint32_t parent = ((const struct hierarchy_link *)val)->parent;            \
+    if (parent != HIERARCHY_NONE && !NAME.lookup_value(parent)) {              \
+      NAME.add_value(parent, (struct hierarchy_link){HIERARCHY_NONE});         \
+    }                                                                          \
+    if (!hierarchy_set_parent(&hierarchy_##NAME, ent_id, parent)) {            \
+      hierarchy_set_parent(&hierarchy_##NAME, ent_id, HIERARCHY_NONE);         \
+      NAME.lookup_value(ent_id)->parent = HIERARCHY_NONE;                      \
+    }                                                                          \
+  }                                                                            \
+  static void hierarchy_##NAME##__on_delete(uint32_t ent_id,                   \
+                                            const void *val) {                 \
+    hierarchy_##NAME##__orphan_children(ent_id);                               \
+    hierarchy_remove(&hierarchy_##NAME, ent_id);                               \
+  }                                                                            \
+  static void hierarchy_##NAME##__on_clear(bool reset) {                       \
+    if (reset) {                                                               \
+      hierarchy_init(&hierarchy_##NAME);                                       \
+    } else {                                                                   \
+      hierarchy_clear(&hierarchy_##NAME);                                      \
+    }                                                                          \
+  }                                                                            \
+  bool hierarchy_##NAME##_set_parent(uint32_t ent_id, uint32_t parent) {       \
+    if (parent != HIERARCHY_NONE &&                                            \
+        hierarchy_is_ancestor(&hierarchy_##NAME, ent_id, parent)) {            \
+      return false;                                                            \
+    }                                                                          \
+    if (!NAME.lookup_value(ent_id)) {                                          \
+      return NAME.add_value(ent_id, (struct hierarchy_link){parent});          \
+    }                                                                          \
+    if (parent != HIERARCHY_NONE && !NAME.lookup_value(parent) &&              \
+        !NAME.add_value(parent, (struct hierarchy_link){HIERARCHY_NONE})) {    \
+      return false;                                                            \
+    }                                                                          \
+    /* keeps the children, unlike replacing the value with add_value */        \
+    NAME.lookup_value(ent_id)->parent = parent;                                \
+    return hierarchy_set_parent(&hierarchy_##NAME, ent_id, parent);            \
+  }                                                                            \
+  void hierarchy_##NAME##_despawn(uint32_t ent_id) {                           \
+    struct vector_hierarchy_ids *ids = &hierarchy_##NAME.subtree;              \
+    if (!hierarchy_subtree(&hierarchy_##NAME, ent_id, NULL, 0)) {              \
+      kill_entity(ent_id);                                                     \
+      return;                                                                  \
+    }                                                                          \
+    /* deepest first, so no member has children left when it is killed */      \
+    while (ids->length) {                                                      \
+      kill_entity(vector_hierarchy_ids_pop(ids));                              \
+    }                                                                          \
+  }                                                                            \
+  static struct component_hook hierarchy_##NAME##_hook = {                     \
+      .on_add = &hierarchy_##NAME##__on_add,                                   \
+      .on_delete = &hierarchy_##NAME##__on_delete,                             \
+      .on_clear = &hierarchy_##NAME##__on_clear};                              \
+  static void hierarchy_init__##NAME(void) __attribute__((constructor));       \
+  static void hierarchy_init__##NAME(void) {                                   \
+    hierarchy_init(&hierarchy_##NAME);                                         \
+    hierarchy_##NAME##_hook.next = component_##NAME##_hooks;                   \
+    component_##NAME##_hooks = &hierarchy_##NAME##_hook;                       \
+  }
+
+#endif // __HIERARCHY_H_
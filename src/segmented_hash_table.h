@@ -0,0 +1,250 @@
+#ifndef __SEGMENTED_HASH_TABLE_H_
+#define __SEGMENTED_HASH_TABLE_H_
+
+// A hash table whose values never move
+//
+// Values are kept in records of a segmented vector (`segmented_vec.h`) and
+// the robin hood table only maps keys to record slots. Growing adds a segment
+// for the records and rehashes the small slot references, so the cost of a
+// resize does not depend on the size of the values, and a pointer returned by
+// lookup stays valid until its key is deleted, whatever else is inserted.
+// Deleted records are reused by later inserts.
+//
+// Lookups pay for one more indirection than the plain robin hood table.
+// Inserting a key that is already present replaces its value in place.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "hash_table.h"
+#include "segmented_vec.h"
+
+// no record, ends the list of free records
+#define SEGMENTED_HASH_NO_SLOT UINT32_MAX
+
+#define DEFINE_SEGMENTED_HASH(VALTYPE, NAME)                                   \
+  DEFINE_HASH(uint32_t, NAME##__refs);                                         \
+  struct hash_table_##NAME##__record {                                         \
+    /* the next free record instead while not live */                          \
+    uint32_t key;                                                              \
+    bool live;                                                                 \
+    VALTYPE val;                                                               \
+  };                                                                           \
+  DEFINE_SEGMENTED_VECTOR(struct hash_table_##NAME##__record,                  \
+                          hash_table_##NAME##__records);                       \
+                                                                               \
+  /* one slot of fixed storage, enough for a record and a reference */         \
+  struct hash_table_##NAME##_elem {                                            \
+    uint32_t key;                                                              \
+    bool live;                                                                 \
+    VALTYPE val;                                                               \
+    struct hash_table_##NAME##__refs_elem ref;                                 \
+  };                                                                           \
+                                                                               \
+  struct hash_table_##NAME {                                                   \
+    struct hash_table_##NAME##__refs refs;                                     \
+    struct segmented_vector_hash_table_##NAME##__records records;              \
+    uint32_t free_slot;                                                        \
+  };                                                                           \
+  struct hash_table_##NAME *hash_table_##NAME##_new();                         \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table);              \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems);                           \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems);                     \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table);           \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v);                                  \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k);                             \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k);                                 \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table);             \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems);                        \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table);            \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out);                \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table);           \
+                                                                               \
+  static inline uint32_t hash_table_##NAME##_count(                            \
+      struct hash_table_##NAME *table) {                                       \
+    return hash_table_##NAME##__refs_count(&table->refs);                      \
+  }                                                                            \
+                                                                               \
+  /* iterating walks the records, in the order they were first used */         \
+  static inline uint32_t hash_table_##NAME##__slot_count(                      \
+      struct hash_table_##NAME *table) {                                       \
+    return table->records.length;                                              \
+  }                                                                            \
+                                                                               \
+  static inline VALTYPE *hash_table_##NAME##__slot(                            \
+      struct hash_table_##NAME *table, uint32_t idx, uint32_t *key) {          \
+    struct hash_table_##NAME##__record *r =                                    \
+        segmented_vector_hash_table_##NAME##__records__at(&table->records,     \
+                                                          idx);                \
+                                                                               \
+    if (!r->live) {                                                            \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    *key = r->key;                                                             \
+    return &r->val;                                                            \
+  }
+
+#define MAKE_SEGMENTED_HASH(VALTYPE, NAME)                                     \
+  MAKE_HASH(uint32_t, NAME##__refs);                                           \
+  MAKE_SEGMENTED_VECTOR(struct hash_table_##NAME##__record,                    \
+                        hash_table_##NAME##__records);                         \
+                                                                               \
+  _Static_assert(sizeof(struct hash_table_##NAME##_elem) >=                    \
+                     sizeof(struct hash_table_##NAME##__record) +              \
+                         sizeof(struct hash_table_##NAME##__refs_elem),        \
+                 "fixed storage of " #NAME " can't hold its references");      \
+                                                                               \
+  struct hash_table_##NAME *hash_table_##NAME##_new() {                        \
+    struct ecs_allocator *alloc = ecs_current_allocator();                     \
+    struct hash_table_##NAME *table =                                          \
+        ecs_alloc(alloc, sizeof(struct hash_table_##NAME));                    \
+    hash_table_##NAME##_init(table, 0);                                        \
+    return table;                                                              \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_free(struct hash_table_##NAME *table) {             \
+    struct ecs_allocator *alloc = table->refs.alloc;                           \
+    hash_table_##NAME##_destroy(table);                                        \
+    ecs_free(alloc, table, sizeof(struct hash_table_##NAME));                  \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_init(struct hash_table_##NAME *table,               \
+                                uint32_t num_elems) {                          \
+    hash_table_##NAME##__refs_init(&table->refs, num_elems);                   \
+    table->records =                                                           \
+        segmented_vector_hash_table_##NAME##__records_new(num_elems);          \
+    table->free_slot = SEGMENTED_HASH_NO_SLOT;                                 \
+  }                                                                            \
+                                                                               \
+  /* the records take the start of elems and the references the rest */        \
+  void hash_table_##NAME##_init_fixed(                                         \
+      struct hash_table_##NAME *table, struct hash_table_##NAME##_elem *elems, \
+      uint8_t *deleted, uint32_t cap, uint32_t max_elems) {                    \
+    struct hash_table_##NAME##__record *records = (void *)elems;               \
+    hash_table_##NAME##__refs_init_fixed(                                      \
+        &table->refs, (void *)&records[cap], deleted, cap, max_elems);         \
+    table->records =                                                           \
+        segmented_vector_hash_table_##NAME##__records_from_buffer(records,     \
+                                                                  cap);        \
+    table->free_slot = SEGMENTED_HASH_NO_SLOT;                                 \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_destroy(struct hash_table_##NAME *table) {          \
+    hash_table_##NAME##__refs_destroy(&table->refs);                           \
+    segmented_vector_hash_table_##NAME##__records_free(&table->records);       \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_insert(struct hash_table_##NAME *table, uint32_t k, \
+                                  VALTYPE v) {                                 \
+    uint32_t *slot = hash_table_##NAME##__refs_lookup(&table->refs, k);        \
+    struct hash_table_##NAME##__record *r;                                     \
+                                                                               \
+    if (slot) {                                                                \
+      r = segmented_vector_hash_table_##NAME##__records__at(&table->records,   \
+                                                            *slot);            \
+      r->val = v;                                                              \
+      return true;                                                             \
+    }                                                                          \
+                                                                               \
+    uint32_t new_slot = table->free_slot;                                      \
+                                                                               \
+    if (new_slot != SEGMENTED_HASH_NO_SLOT) {                                  \
+      r = segmented_vector_hash_table_##NAME##__records__at(&table->records,   \
+                                                            new_slot);         \
+      table->free_slot = r->key;                                               \
+    } else {                                                                   \
+      size_t pushed = segmented_vector_hash_table_##NAME##__records_push(      \
+          &table->records, (struct hash_table_##NAME##__record){0});           \
+      if (pushed == VECTOR_PUSH_FAILED) {                                      \
+        return false;                                                          \
+      }                                                                        \
+      new_slot = pushed;                                                       \
+      r = segmented_vector_hash_table_##NAME##__records__at(&table->records,   \
+                                                            new_slot);         \
+    }                                                                          \
+                                                                               \
+    if (!hash_table_##NAME##__refs_insert(&table->refs, k, new_slot)) {        \
+      r->key = table->free_slot;                                               \
+      table->free_slot = new_slot;                                             \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    r->key = k;                                                                \
+    r->live = true;                                                            \
+    r->val = v;                                                                \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  VALTYPE *hash_table_##NAME##_lookup(struct hash_table_##NAME *table,         \
+                                      uint32_t k) {                            \
+    uint32_t *slot = hash_table_##NAME##__refs_lookup(&table->refs, k);        \
+                                                                               \
+    if (!slot) {                                                               \
+      return NULL;                                                             \
+    }                                                                          \
+    return &segmented_vector_hash_table_##NAME##__records__at(&table->records, \
+                                                              *slot)           \
+                ->val;                                                         \
+  }                                                                            \
+                                                                               \
+  bool hash_table_##NAME##_delete(struct hash_table_##NAME *table,             \
+                                  uint32_t k) {                                \
+    uint32_t *slot = hash_table_##NAME##__refs_lookup(&table->refs, k);        \
+                                                                               \
+    if (!slot) {                                                               \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    uint32_t freed = *slot;                                                    \
+    struct hash_table_##NAME##__record *r =                                    \
+        segmented_vector_hash_table_##NAME##__records__at(&table->records,     \
+                                                          freed);              \
+    hash_table_##NAME##__refs_delete(&table->refs, k);                         \
+    r->live = false;                                                           \
+    r->key = table->free_slot;                                                 \
+    table->free_slot = freed;                                                  \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* keeps every segment for the records inserted next */                      \
+  void hash_table_##NAME##_clear(struct hash_table_##NAME *table) {            \
+    hash_table_##NAME##__refs_clear(&table->refs);                             \
+    table->records.length = 0;                                                 \
+    table->free_slot = SEGMENTED_HASH_NO_SLOT;                                 \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_reserve(struct hash_table_##NAME *table,            \
+                                   uint32_t num_elems) {                       \
+    hash_table_##NAME##__refs_reserve(&table->refs, num_elems);                \
+    segmented_vector_hash_table_##NAME##__records_reserve(&table->records,     \
+                                                          num_elems);          \
+  }                                                                            \
+                                                                               \
+  /* records never move, only the references are rehashed smaller */           \
+  void hash_table_##NAME##_shrink(struct hash_table_##NAME *table) {           \
+    hash_table_##NAME##__refs_shrink(&table->refs);                            \
+  }                                                                            \
+                                                                               \
+  void hash_table_##NAME##_stats(struct hash_table_##NAME *table,              \
+                                 struct hash_table_stats *out) {               \
+    hash_table_##NAME##__refs_stats(&table->refs, out);                        \
+    out->bytes_allocated +=                                                    \
+        sizeof(struct hash_table_##NAME##__record) * table->records.cap;       \
+  }                                                                            \
+                                                                               \
+  /* nothing is ever retired, tables are single threaded */                    \
+  void hash_table_##NAME##_reclaim(struct hash_table_##NAME *table) {}
+
+#endif // __SEGMENTED_HASH_TABLE_H_
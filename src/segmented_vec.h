@@ -0,0 +1,161 @@
+#ifndef __SEGMENTED_VEC_H_
+#define __SEGMENTED_VEC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "vec.h"
+
+// A vector whose elements never move
+//
+// Elements live in a fixed directory of segments, each twice the size of the
+// one before it. Growing allocates the next segment instead of reallocating,
+// so pointers to elements stay valid for the life of the vector and pushing
+// never copies what is already stored. Indexing costs a count of leading
+// zeros to find the segment.
+//
+// The functions mirror those of `vec.h`, `segmented_vector_<name>_*` can be
+// used wherever `vector_<name>_*` was when element addresses have to be kept.
+
+#define SEGMENTED_VECTOR_MAX_SEGMENTS 32
+
+// elements in the first segment of a vector created with `_new`, at least
+static const uint32_t segmented_vector_min_base = 64;
+
+/**
+ * Vectors created with `segmented_vector_<name>_from_buffer` use the given
+ * memory as their only segment and never grow, neither does any vector in
+ * ECS_STATIC_STORAGE builds. Pushing onto a full one of those returns
+ * `VECTOR_PUSH_FAILED`.
+ */
+#define DEFINE_SEGMENTED_VECTOR(TYPE, TNAME)                                   \
+  struct segmented_vector_##TNAME {                                            \
+    size_t cap;                                                                \
+    size_t length;                                                             \
+    /* segment i holds 1 << (base_shift + i) elements */                       \
+    uint32_t base_shift;                                                       \
+    uint32_t num_segments;                                                     \
+    TYPE *segments[SEGMENTED_VECTOR_MAX_SEGMENTS];                             \
+    struct ecs_allocator *alloc;                                               \
+  };                                                                           \
+  struct segmented_vector_##TNAME segmented_vector_##TNAME##_new(size_t);      \
+  struct segmented_vector_##TNAME segmented_vector_##TNAME##_from_buffer(      \
+      TYPE *, size_t);                                                         \
+  TYPE segmented_vector_##TNAME##_pop(struct segmented_vector_##TNAME *);      \
+  size_t segmented_vector_##TNAME##_push(struct segmented_vector_##TNAME *,    \
+                                         TYPE);                                \
+  TYPE segmented_vector_##TNAME##_index(struct segmented_vector_##TNAME *,     \
+                                        size_t);                               \
+  void segmented_vector_##TNAME##_set(struct segmented_vector_##TNAME *,       \
+                                      TYPE, size_t);                           \
+  TYPE *segmented_vector_##TNAME##_index_ptr(                                  \
+      struct segmented_vector_##TNAME *, size_t);                              \
+  void segmented_vector_##TNAME##_reserve(struct segmented_vector_##TNAME *,   \
+                                          size_t);                             \
+  void segmented_vector_##TNAME##_free(struct segmented_vector_##TNAME *);     \
+                                                                               \
+  static inline TYPE *segmented_vector_##TNAME##__at(                          \
+      struct segmented_vector_##TNAME *vec, size_t idx) {                      \
+    size_t blocks = (idx >> vec->base_shift) + 1;                              \
+    uint32_t seg = 63 - __builtin_clzll(blocks);                               \
+    size_t seg_start = (((size_t)1 << seg) - 1) << vec->base_shift;            \
+    return &vec->segments[seg][idx - seg_start];                               \
+  }
+
+#define MAKE_SEGMENTED_VECTOR(TYPE, TNAME)                                     \
+  struct segmented_vector_##TNAME segmented_vector_##TNAME##_new(              \
+      size_t initial) {                                                        \
+    size_t base = ECS_NEXT_POW2(MAX(initial, segmented_vector_min_base));      \
+    struct segmented_vector_##TNAME vec = {0};                                 \
+    /* the first segment is allocated by the first push */                     \
+    vec.alloc = ecs_current_allocator();                                       \
+    vec.base_shift = __builtin_ctzll(base);                                    \
+    return vec;                                                                \
+  }                                                                            \
+  struct segmented_vector_##TNAME segmented_vector_##TNAME##_from_buffer(      \
+      TYPE *data, size_t cap) {                                                \
+    struct segmented_vector_##TNAME vec = {0};                                 \
+    /* segments are powers of two, a smaller one only uses part of data */     \
+    vec.base_shift = 63 - __builtin_clzll(cap);                                \
+    vec.segments[0] = data;                                                    \
+    vec.num_segments = 1;                                                      \
+    vec.cap = (size_t)1 << vec.base_shift;                                     \
+    return vec;                                                                \
+  }                                                                            \
+  TYPE segmented_vector_##TNAME##_pop(struct segmented_vector_##TNAME *vec) {  \
+    if (DEBUG_ONLY(vec->length == 0)) {                                        \
+      RUNTIME_ERROR("Popping from 0-length vector");                           \
+    }                                                                          \
+    vec->length--;                                                             \
+    return *segmented_vector_##TNAME##__at(vec, vec->length);                  \
+  }                                                                            \
+  static bool segmented_vector_##TNAME##__add_segment(                         \
+      struct segmented_vector_##TNAME *vec) {                                  \
+    if (ECS_STATIC_STORAGE_ENABLED || vec->alloc == NULL ||                    \
+        vec->num_segments == SEGMENTED_VECTOR_MAX_SEGMENTS) {                  \
+      return false;                                                            \
+    }                                                                          \
+    size_t seg_len = (size_t)1 << (vec->base_shift + vec->num_segments);       \
+    DEBUG_LOG("adding segment of %ld to segmented vec(%p)", seg_len,           \
+              (void *)vec);                                                    \
+    vec->segments[vec->num_segments++] =                                       \
+        ecs_alloc(vec->alloc, sizeof(TYPE) * seg_len);                         \
+    vec->cap += seg_len;                                                       \
+    return true;                                                               \
+  }                                                                            \
+  size_t segmented_vector_##TNAME##_push(struct segmented_vector_##TNAME *vec, \
+                                         TYPE elem) {                          \
+    if (vec->length >= vec->cap &&                                             \
+        !segmented_vector_##TNAME##__add_segment(vec)) {                       \
+      return VECTOR_PUSH_FAILED;                                               \
+    }                                                                          \
+    size_t inserted_idx = vec->length;                                         \
+    *segmented_vector_##TNAME##__at(vec, vec->length++) = elem;                \
+    return inserted_idx;                                                       \
+  }                                                                            \
+  TYPE segmented_vector_##TNAME##_index(struct segmented_vector_##TNAME *vec,  \
+                                        size_t idx) {                          \
+    if (DEBUG_ONLY(idx >= vec->length)) {                                      \
+      RUNTIME_ERROR("Indexing vector out of bounds");                          \
+    }                                                                          \
+    return *segmented_vector_##TNAME##__at(vec, idx);                          \
+  }                                                                            \
+  void segmented_vector_##TNAME##_set(struct segmented_vector_##TNAME *vec,    \
+                                      TYPE elem, size_t idx) {                 \
+    if (DEBUG_ONLY(idx >= vec->length)) {                                      \
+      RUNTIME_ERROR("Indexing vector out of bounds");                          \
+    }                                                                          \
+    *segmented_vector_##TNAME##__at(vec, idx) = elem;                          \
+  }                                                                            \
+  TYPE *segmented_vector_##TNAME##_index_ptr(                                  \
+      struct segmented_vector_##TNAME *vec, size_t idx) {                      \
+    if (DEBUG_ONLY(idx >= vec->length)) {                                      \
+      RUNTIME_ERROR("Indexing vector out of bounds");                          \
+    }                                                                          \
+    return segmented_vector_##TNAME##__at(vec, idx);                           \
+  }                                                                            \
+  /* sizes the first segment to fit if none is allocated yet */                \
+  void segmented_vector_##TNAME##_reserve(                                     \
+      struct segmented_vector_##TNAME *vec, size_t n) {                        \
+    if (vec->num_segments == 0 && vec->alloc != NULL) {                        \
+      size_t base = ECS_NEXT_POW2(MAX(n, segmented_vector_min_base));          \
+      vec->base_shift = MAX(vec->base_shift, __builtin_ctzll(base));           \
+    }                                                                          \
+    while (vec->cap < n && segmented_vector_##TNAME##__add_segment(vec)) {     \
+    }                                                                          \
+  }                                                                            \
+  void segmented_vector_##TNAME##_free(struct segmented_vector_##TNAME *vec) { \
+    if (vec->alloc == NULL) {                                                  \
+      return;                                                                  \
+    }                                                                          \
+    for (uint32_t i = 0; i < vec->num_segments; i++) {                         \
+      ecs_free(vec->alloc, vec->segments[i],                                   \
+               sizeof(TYPE) << (vec->base_shift + i));                         \
+    }                                                                          \
+  }
+
+#endif // __SEGMENTED_VEC_H_
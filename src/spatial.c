@@ -0,0 +1,336 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "common_macros.h"
+#include "spatial.h"
+
+MAKE_HASH(uint32_t, spatial_cells);
+MAKE_HASH(struct spatial_loc, spatial_locs);
+MAKE_VECTOR(struct spatial_bucket, spatial_buckets);
+MAKE_VECTOR(uint32_t, spatial_ids);
+
+// most cells a query visits one by one before scanning every bucket instead
+#define SPATIAL_MAX_QUERY_CELLS 125
+
+static const uint32_t spatial_initial_buckets = 64;
+
+static int32_t spatial__cell(const struct spatial_grid *grid, float v) {
+  float f = v * grid->inv_cell_size;
+  int32_t i = (int32_t)f;
+
+  return i - (f < i);
+}
+
+static uint32_t spatial__key(int32_t x, int32_t y, int32_t z) {
+  return ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^
+         ((uint32_t)z * 83492791u);
+}
+
+static uint32_t spatial__key_of(const struct spatial_grid *grid,
+                                const float p[3]) {
+  return spatial__key(spatial__cell(grid, p[0]), spatial__cell(grid, p[1]),
+                      grid->dims == 3 ? spatial__cell(grid, p[2]) : 0);
+}
+
+static float spatial__dist2(const float a[3], const float b[3]) {
+  float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+
+  return dx * dx + dy * dy + dz * dz;
+}
+
+void spatial_grid_init(struct spatial_grid *grid, uint32_t dims,
+                       float cell_size) {
+  grid->dims = dims;
+  grid->cell_size = cell_size;
+  grid->inv_cell_size = 1.0f / cell_size;
+  hash_table_spatial_cells_init(&grid->cells, spatial_initial_buckets);
+  hash_table_spatial_locs_init(&grid->locs, 0);
+  grid->buckets = vector_spatial_buckets_new(spatial_initial_buckets);
+  grid->free_buckets = vector_spatial_ids_new(0);
+  grid->dirty = vector_spatial_ids_new(0);
+}
+
+void spatial_grid_destroy(struct spatial_grid *grid) {
+  for (size_t i = 0; i < grid->buckets.length; i++) {
+    struct spatial_bucket *b = &grid->buckets.data[i];
+    ecs_free(grid->buckets.alloc, b->entries,
+             b->cap * sizeof(struct spatial_entry));
+  }
+
+  hash_table_spatial_cells_destroy(&grid->cells);
+  hash_table_spatial_locs_destroy(&grid->locs);
+  vector_spatial_buckets_free(&grid->buckets);
+  vector_spatial_ids_free(&grid->free_buckets);
+  vector_spatial_ids_free(&grid->dirty);
+}
+
+void spatial_grid_clear(struct spatial_grid *grid) {
+  hash_table_spatial_cells_clear(&grid->cells);
+  hash_table_spatial_locs_clear(&grid->locs);
+  grid->free_buckets.length = 0;
+  grid->dirty.length = 0;
+
+  // keep the entry arrays of every bucket around for reuse
+  for (uint32_t i = 0; i < grid->buckets.length; i++) {
+    grid->buckets.data[i].len = 0;
+    vector_spatial_ids_push(&grid->free_buckets, i);
+  }
+}
+
+static uint32_t spatial__bucket_for(struct spatial_grid *grid, uint32_t key) {
+  uint32_t *idx = hash_table_spatial_cells_lookup(&grid->cells, key);
+
+  if (idx) {
+    return *idx;
+  }
+
+  uint32_t new_idx;
+
+  if (grid->free_buckets.length) {
+    new_idx = vector_spatial_ids_pop(&grid->free_buckets);
+  } else {
+    new_idx = vector_spatial_buckets_push(&grid->buckets,
+                                          (struct spatial_bucket){0});
+  }
+
+  grid->buckets.data[new_idx].key = key;
+  hash_table_spatial_cells_insert(&grid->cells, key, new_idx);
+
+  return new_idx;
+}
+
+static void spatial__append(struct spatial_grid *grid, uint32_t bucket_idx,
+                            uint32_t id, const float p[3]) {
+  struct spatial_bucket *b = &grid->buckets.data[bucket_idx];
+
+  if (b->len == b->cap) {
+    uint32_t new_cap = b->cap ? b->cap * 2 : 4;
+    b->entries = ecs_realloc(grid->buckets.alloc, b->entries,
+                             b->cap * sizeof(struct spatial_entry),
+                             new_cap * sizeof(struct spatial_entry));
+    b->cap = new_cap;
+  }
+
+  struct spatial_entry *e = &b->entries[b->len];
+  e->id = id;
+  memcpy(e->p, p, sizeof(e->p));
+
+  hash_table_spatial_locs_insert(&grid->locs, id,
+                                 (struct spatial_loc){bucket_idx, b->len});
+  b->len++;
+}
+
+void spatial_grid_insert(struct spatial_grid *grid, uint32_t id,
+                         const float p[3]) {
+  spatial__append(grid, spatial__bucket_for(grid, spatial__key_of(grid, p)),
+                  id, p);
+}
+
+void spatial_grid_remove(struct spatial_grid *grid, uint32_t id) {
+  struct spatial_loc *loc = hash_table_spatial_locs_lookup(&grid->locs, id);
+
+  if (!loc) {
+    return;
+  }
+
+  struct spatial_bucket *b = &grid->buckets.data[loc->bucket];
+  uint32_t last = b->len - 1;
+
+  // swap the last entry into the hole
+  if (loc->slot != last) {
+    b->entries[loc->slot] = b->entries[last];
+    hash_table_spatial_locs_lookup(&grid->locs, b->entries[last].id)->slot =
+        loc->slot;
+  }
+  b->len--;
+
+  if (b->len == 0) {
+    hash_table_spatial_cells_delete(&grid->cells, b->key);
+    vector_spatial_ids_push(&grid->free_buckets, loc->bucket);
+  }
+
+  hash_table_spatial_locs_delete(&grid->locs, id);
+}
+
+void spatial_grid_move(struct spatial_grid *grid, uint32_t id,
+                       const float p[3]) {
+  struct spatial_loc *loc = hash_table_spatial_locs_lookup(&grid->locs, id);
+
+  if (loc &&
+      grid->buckets.data[loc->bucket].key == spatial__key_of(grid, p)) {
+    memcpy(grid->buckets.data[loc->bucket].entries[loc->slot].p, p,
+           3 * sizeof(float));
+    return;
+  }
+
+  spatial_grid_remove(grid, id);
+  spatial_grid_insert(grid, id, p);
+}
+
+/**
+ * Collect the distinct buckets of the cells overlapping the box from `lo` to
+ * `hi` into `out`, returns how many there are, or -1 if the box covers more
+ * than `SPATIAL_MAX_QUERY_CELLS` cells.
+ */
+static int32_t spatial__buckets_in(struct spatial_grid *grid,
+                                   const float lo[3], const float hi[3],
+                                   uint32_t out[SPATIAL_MAX_QUERY_CELLS]) {
+  int32_t c_lo[3] = {0}, c_hi[3] = {0};
+
+  for (uint32_t d = 0; d < grid->dims; d++) {
+    c_lo[d] = spatial__cell(grid, lo[d]);
+    c_hi[d] = spatial__cell(grid, hi[d]);
+  }
+
+  uint64_t num_cells = 1;
+  for (uint32_t d = 0; d < 3; d++) {
+    num_cells *= (uint64_t)((int64_t)c_hi[d] - c_lo[d] + 1);
+  }
+
+  if (num_cells > SPATIAL_MAX_QUERY_CELLS) {
+    return -1;
+  }
+
+  int32_t n = 0;
+
+  for (int32_t x = c_lo[0]; x <= c_hi[0]; x++) {
+    for (int32_t y = c_lo[1]; y <= c_hi[1]; y++) {
+      for (int32_t z = c_lo[2]; z <= c_hi[2]; z++) {
+        uint32_t *idx = hash_table_spatial_cells_lookup(&grid->cells,
+                                                        spatial__key(x, y, z));
+        if (!idx) {
+          continue;
+        }
+
+        // different cells can share a bucket, only visit it once
+        bool seen = false;
+        for (int32_t i = 0; i < n && !seen; i++) {
+          seen = out[i] == *idx;
+        }
+
+        if (!seen) {
+          out[n++] = *idx;
+        }
+      }
+    }
+  }
+
+  return n;
+}
+
+#define SPATIAL_QUERY(GRID, LO, HI, ENTRY_VAR, ...)                            \
+  do {                                                                         \
+    uint32_t spatial__buckets[SPATIAL_MAX_QUERY_CELLS];                        \
+    int32_t spatial__n =                                                       \
+        spatial__buckets_in((GRID), (LO), (HI), spatial__buckets);             \
+    uint32_t spatial__count =                                                  \
+        spatial__n < 0 ? (GRID)->buckets.length : (uint32_t)spatial__n;        \
+                                                                               \
+    for (uint32_t spatial__i = 0; spatial__i < spatial__count;                 \
+         spatial__i++) {                                                       \
+      struct spatial_bucket *spatial__b =                                      \
+          &(GRID)->buckets                                                     \
+               .data[spatial__n < 0 ? spatial__i                               \
+                                    : spatial__buckets[spatial__i]];           \
+      for (uint32_t spatial__j = 0; spatial__j < spatial__b->len;              \
+           spatial__j++) {                                                     \
+        struct spatial_entry *ENTRY_VAR = &spatial__b->entries[spatial__j];    \
+        { __VA_ARGS__ }                                                        \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+size_t spatial_grid_radius(struct spatial_grid *grid, const float center[3],
+                           float r, uint32_t *out, size_t max) {
+  float lo[3], hi[3];
+  float r2 = r * r;
+  size_t n = 0;
+
+  for (uint32_t d = 0; d < 3; d++) {
+    lo[d] = center[d] - r;
+    hi[d] = center[d] + r;
+  }
+
+  SPATIAL_QUERY(grid, lo, hi, e, {
+    if (spatial__dist2(e->p, center) <= r2) {
+      if (n < max) {
+        out[n] = e->id;
+      }
+      n++;
+    }
+  });
+
+  return n;
+}
+
+size_t spatial_grid_aabb(struct spatial_grid *grid, const float lo[3],
+                         const float hi[3], uint32_t *out, size_t max) {
+  size_t n = 0;
+
+  SPATIAL_QUERY(grid, lo, hi, e, {
+    bool inside = true;
+    for (uint32_t d = 0; d < grid->dims; d++) {
+      inside &= e->p[d] >= lo[d] && e->p[d] <= hi[d];
+    }
+
+    if (inside) {
+      if (n < max) {
+        out[n] = e->id;
+      }
+      n++;
+    }
+  });
+
+  return n;
+}
+
+size_t spatial_grid_pairs(struct spatial_grid *grid,
+                          struct spatial_pair_cursor *cursor, float r,
+                          struct spatial_pair *out, size_t max) {
+  float r2 = r * r;
+  size_t n = 0;
+
+  for (; cursor->bucket < grid->buckets.length;
+       cursor->bucket++, cursor->slot = 0) {
+    struct spatial_bucket *b = &grid->buckets.data[cursor->bucket];
+
+    for (; cursor->slot < b->len; cursor->slot++, cursor->neighbour = 0) {
+      struct spatial_entry *a = &b->entries[cursor->slot];
+      uint32_t neighbours[SPATIAL_MAX_QUERY_CELLS];
+      float lo[3], hi[3];
+
+      for (uint32_t d = 0; d < 3; d++) {
+        lo[d] = a->p[d] - r;
+        hi[d] = a->p[d] + r;
+      }
+
+      int32_t num_neighbours = spatial__buckets_in(grid, lo, hi, neighbours);
+      uint32_t count =
+          num_neighbours < 0 ? grid->buckets.length : (uint32_t)num_neighbours;
+
+      for (; cursor->neighbour < count;
+           cursor->neighbour++, cursor->entry = 0) {
+        struct spatial_bucket *nb =
+            &grid->buckets.data[num_neighbours < 0
+                                    ? cursor->neighbour
+                                    : neighbours[cursor->neighbour]];
+
+        for (; cursor->entry < nb->len; cursor->entry++) {
+          struct spatial_entry *e = &nb->entries[cursor->entry];
+
+          // each pair is reported from the side of its smaller id
+          if (a->id < e->id && spatial__dist2(a->p, e->p) <= r2) {
+            if (n == max) {
+              return n;
+            }
+            out[n++] = (struct spatial_pair){a->id, e->id};
+          }
+        }
+      }
+    }
+  }
+
+  return n;
+}
@@ -0,0 +1,247 @@
+#ifndef __SPATIAL_H_
+#define __SPATIAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_macros.h"
+#include "component.h"
+#include "hash_table.h"
+#include "vec.h"
+
+// A spatial index over a position component
+//
+// Entities are bucketed into a hashed uniform grid: cell coordinates are hashed
+// to pick a bucket, and each bucket keeps the ids and positions of its
+// entities in one contiguous array so queries scan memory linearly. Cells that
+// hash alike share a bucket, queries always check real positions so this only
+// costs a few extra comparisons.
+//
+// The grid stores a copy of every position. It follows `add_value` and
+// `delete_value` of the component by itself; positions changed through a
+// `lookup_value` pointer are picked up by `spatial_<comp>_move(ent_id)`, by
+// `spatial_<comp>_mark_dirty(ent_id)` followed by `spatial_<comp>_flush()`,
+// or by `spatial_<comp>_sync()` which rechecks every entity.
+//
+// Buckets grow on demand, so spatial indexes aren't available with
+// ECS_STATIC_STORAGE.
+
+struct spatial_entry {
+  uint32_t id;
+  float p[3];
+};
+
+struct spatial_bucket {
+  uint32_t key;
+  uint32_t len;
+  uint32_t cap;
+  struct spatial_entry *entries;
+};
+
+struct spatial_loc {
+  uint32_t bucket;
+  uint32_t slot;
+};
+
+DEFINE_HASH(uint32_t, spatial_cells);
+DEFINE_HASH(struct spatial_loc, spatial_locs);
+DEFINE_VECTOR(struct spatial_bucket, spatial_buckets);
+DEFINE_VECTOR(uint32_t, spatial_ids);
+
+struct spatial_grid {
+  uint32_t dims;
+  float cell_size;
+  float inv_cell_size;
+  // cell hash -> bucket index
+  struct hash_table_spatial_cells cells;
+  // entity -> where it is stored
+  struct hash_table_spatial_locs locs;
+  struct vector_spatial_buckets buckets;
+  // indexes of emptied buckets for reuse
+  struct vector_spatial_ids free_buckets;
+  struct vector_spatial_ids dirty;
+};
+
+struct spatial_pair {
+  uint32_t a;
+  uint32_t b;
+};
+
+/**
+ * Position of `spatial_grid_pairs` in the grid, zero initialise it to start.
+ */
+struct spatial_pair_cursor {
+  uint32_t bucket;
+  uint32_t slot;
+  uint32_t neighbour;
+  uint32_t entry;
+};
+
+/**
+ * Initialise an empty grid of `dims` (2 or 3) dimensional cells of side
+ * `cell_size`. Pick a cell size around the usual query radius.
+ */
+void spatial_grid_init(struct spatial_grid *grid, uint32_t dims,
+                       float cell_size);
+void spatial_grid_destroy(struct spatial_grid *grid);
+
+/**
+ * Remove every entity, keeping the memory.
+ */
+void spatial_grid_clear(struct spatial_grid *grid);
+
+void spatial_grid_insert(struct spatial_grid *grid, uint32_t id,
+                         const float p[3]);
+void spatial_grid_remove(struct spatial_grid *grid, uint32_t id);
+
+/**
+ * Update the position of an entity, inserting it if it isn't in the grid.
+ * Cheap when it stays in the same cell.
+ */
+void spatial_grid_move(struct spatial_grid *grid, uint32_t id,
+                       const float p[3]);
+
+/**
+ * Entities within `r` of `center`. Writes up to `max` ids to `out` and
+ * returns the number of matches, which may be more than `max`.
+ */
+size_t spatial_grid_radius(struct spatial_grid *grid, const float center[3],
+                           float r, uint32_t *out, size_t max);
+
+/**
+ * Entities inside the box from `lo` to `hi` inclusive, as
+ * `spatial_grid_radius`.
+ */
+size_t spatial_grid_aabb(struct spatial_grid *grid, const float lo[3],
+                         const float hi[3], uint32_t *out, size_t max);
+
+/**
+ * Broadphase: every pair of entities within `r` of each other, each pair once.
+ * Writes up to `max` pairs to `out` and returns how many it wrote, continuing
+ * from `cursor` on the next call until it returns 0. The grid must not change
+ * in between. Keep `r` within twice the cell size, beyond that every entity
+ * is checked against every bucket.
+ */
+size_t spatial_grid_pairs(struct spatial_grid *grid,
+                          struct spatial_pair_cursor *cursor, float r,
+                          struct spatial_pair *out, size_t max);
+
+/**
+ * Loop over every pair of entities of `GRID` within `R` of each other, in
+ * batches, `PAIR_VAR` is a `struct spatial_pair *`.
+ *
+ * Usage:
+ * FOR_EACH_SPATIAL_PAIR(&spatial_position, 1.0f, p, {
+ *     collide(p->a, p->b);
+ * });
+ */
+#define FOR_EACH_SPATIAL_PAIR(GRID, R, PAIR_VAR, ...)                          \
+  do {                                                                         \
+    struct spatial_pair_cursor spatial__cursor = {0};                          \
+    struct spatial_pair spatial__batch[256];                                   \
+    size_t spatial__n;                                                         \
+    while ((spatial__n = spatial_grid_pairs((GRID), &spatial__cursor, (R),     \
+                                            spatial__batch,                    \
+                                            ARRAY_LEN(spatial__batch)))) {     \
+      for (size_t spatial__i = 0; spatial__i < spatial__n; spatial__i++) {     \
+        struct spatial_pair *PAIR_VAR = &spatial__batch[spatial__i];           \
+        { __VA_ARGS__ }                                                        \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Declare the spatial index of component `COMP`, a `struct spatial_grid`
+ * named `spatial_<comp>` to query.
+ */
+#define DEFINE_SPATIAL_INDEX(COMP)                                             \
+  extern struct spatial_grid spatial_##COMP;                                   \
+  void spatial_##COMP##_move(uint32_t ent_id);                                 \
+  void spatial_##COMP##_mark_dirty(uint32_t ent_id);                           \
+  void spatial_##COMP##_flush(void);                                           \
+  void spatial_##COMP##_sync(void);
+
+/**
+ * Register a 2D spatial index on fields `X` and `Y` of component `COMP`.
+ */
+#define REGISTER_SPATIAL_INDEX_2D(COMP, X, Y, CELL_SIZE)                       \
+  REGISTER_SPATIAL_INDEX_OF(COMP, 2, CELL_SIZE, val->X, val->Y, 0)
+
+/**
+ * Register a 3D spatial index on fields `X`, `Y` and `Z` of component `COMP`.
+ */
+#define REGISTER_SPATIAL_INDEX_3D(COMP, X, Y, Z, CELL_SIZE)                    \
+  REGISTER_SPATIAL_INDEX_OF(COMP, 3, CELL_SIZE, val->X, val->Y, val->Z)
+
+/**
+ * Register a spatial index whose position is `(PX, PY, PZ)`, expressions of
+ * `val`, a pointer to the component value.
+ */
+#define REGISTER_SPATIAL_INDEX_OF(COMP, DIMS, CELL_SIZE, PX, PY, PZ)           \
+  _Static_assert(!ECS_STATIC_STORAGE_ENABLED,                                  \
+                 "spatial indexes allocate, they are not available with "      \
+                 "ECS_STATIC_STORAGE");                                        \
+  struct spatial_grid spatial_##COMP;                                          \
+  static void spatial_##COMP##__read(                                          \
+      const STRUCT_MEMBER_TYPE(                                                \
+          struct hash_table_component_##COMP##_storage_elem, val) * val,       \
+      float p[3]) {                                                            \
+    p[0] = PX;                                                                 \
+    p[1] = PY;                                                                 \
+    p[2] = PZ;                                                                 \
+  }                                                                            \
+  static void spatial_##COMP##__on_add(uint32_t ent_id, const void *val) {     \
+    float p[3];                                                                \
+    spatial_##COMP##__read(val, p);                                            \
+    spatial_grid_insert(&spatial_##COMP, ent_id, p);                           \
+  }                                                                            \
+  static void spatial_##COMP##__on_delete(uint32_t ent_id,                     \
+                                          const void *val) {                   \
+    spatial_grid_remove(&spatial_##COMP, ent_id);                              \
+  }                                                                            \
+  static void spatial_##COMP##__on_clear(bool reset) {                         \
+    if (reset) {                                                               \
+      spatial_grid_init(&spatial_##COMP, DIMS, CELL_SIZE);                     \
+    } else {                                                                   \
+      spatial_grid_clear(&spatial_##COMP);                                     \
+    }                                                                          \
+  }                                                                            \
+  void spatial_##COMP##_move(uint32_t ent_id) {                                \
+    typeof(COMP.lookup_value(0)) val = COMP.lookup_value(ent_id);              \
+    if (!val) {                                                                \
+      spatial_grid_remove(&spatial_##COMP, ent_id);                            \
+      return;                                                                  \
+    }                                                                          \
+    float p[3];                                                                \
+    spatial_##COMP##__read(val, p);                                            \
+    spatial_grid_move(&spatial_##COMP, ent_id, p);                             \
+  }                                                                            \
+  void spatial_##COMP##_mark_dirty(uint32_t ent_id) {                          \
+    vector_spatial_ids_push(&spatial_##COMP.dirty, ent_id);                    \
+  }                                                                            \
+  void spatial_##COMP##_flush(void) {                                          \
+    for (size_t i = 0; i < spatial_##COMP.dirty.length; i++) {                 \
+      spatial_##COMP##_move(spatial_##COMP.dirty.data[i]);                     \
+    }                                                                          \
+    spatial_##COMP.dirty.length = 0;                                           \
+  }                                                                            \
+  void spatial_##COMP##_sync(void) {                                           \
+    FOR_JOIN_COMPONENT_1(COMP, d, {                                            \
+      float p[3];                                                              \
+      spatial_##COMP##__read(d.COMP, p);                                       \
+      spatial_grid_move(&spatial_##COMP, d.id, p);                             \
+    });                                                                        \
+  }                                                                            \
+  static struct component_hook spatial_##COMP##_hook = {                       \
+      .on_add = &spatial_##COMP##__on_add,                                     \
+      .on_delete = &spatial_##COMP##__on_delete,                               \
+      .on_clear = &spatial_##COMP##__on_clear};                                \
+  static void spatial_init__##COMP(void) __attribute__((constructor));         \
+  static void spatial_init__##COMP(void) {                                     \
+    spatial_grid_init(&spatial_##COMP, DIMS, CELL_SIZE);                       \
+    spatial_##COMP##_hook.next = component_##COMP##_hooks;                     \
+    component_##COMP##_hooks = &spatial_##COMP##_hook;                         \
+  }
+
+#endif // __SPATIAL_H_
@@ -1,8 +1,103 @@
+#include <inttypes.h>
 #include <stdio.h>
 
+#include "event.h"
 #include "system.h"
 
+static uint64_t last_tick_ns = 0;
+static uint64_t current_delta_ns = 0;
+
+uint64_t system_delta_ns(void) { return current_delta_ns; }
+
+static bool system__should_run(struct system_def *s) {
+  if (s->opts.primary && s->opts.primary->count() == 0) {
+    return false;
+  }
+
+  return !s->opts.run_if || s->opts.run_if();
+}
+
+static void system__tick(struct system_def *s, uint64_t dt_ns) {
+  s->accumulator_ns += dt_ns;
+
+  if (s->opts.interval_ns) {
+    uint32_t max_catch_up = s->opts.max_catch_up ? s->opts.max_catch_up
+                                                 : system_default_max_catch_up;
+
+    for (uint32_t i = 0; s->accumulator_ns >= s->opts.interval_ns; i++) {
+      if (i == max_catch_up) {
+        // too far behind, drop the backlog rather than spiral
+        s->accumulator_ns %= s->opts.interval_ns;
+        break;
+      }
+
+      s->accumulator_ns -= s->opts.interval_ns;
+
+      if (system__should_run(s)) {
+        current_delta_ns = s->opts.interval_ns;
+        s->cb();
+      }
+    }
+    return;
+  }
+
+  if (++s->ticks_waited < s->opts.every_ticks) {
+    return;
+  }
+
+  current_delta_ns = s->accumulator_ns;
+  s->accumulator_ns = 0;
+  s->ticks_waited = 0;
+
+  if (system__should_run(s)) {
+    s->cb();
+  }
+}
+
+void run_systems_dt(uint64_t dt_ns) {
+  for (int32_t phase = SYSTEM_PHASE_PRE_UPDATE;
+       phase <= SYSTEM_PHASE_POST_UPDATE; phase++) {
+    for (struct system_def **s = ({
+           extern struct system_def *__start_system_def_array;
+           &__start_system_def_array;
+         });
+         s != ({
+           extern struct system_def *__stop_system_def_array;
+           &__stop_system_def_array;
+         });
+         s++) {
+      if ((*s)->opts.phase == phase) {
+        system__tick(*s, dt_ns);
+      }
+    }
+  }
+
+  swap_events();
+}
+
 void run_systems(void) {
+  uint64_t now = system_now_ns();
+  uint64_t dt_ns = last_tick_ns ? now - last_tick_ns : 0;
+
+  last_tick_ns = now;
+  run_systems_dt(dt_ns);
+}
+
+void system_slice_run(struct system_slice *slice) {
+  uint64_t start = system_now_ns();
+  slice->deadline_ns = start + slice->budget_ns;
+
+  if (slice->step(slice) == SYSTEM_YIELD) {
+    slice->ticks_carried++;
+  } else {
+    slice->ticks_carried = 0;
+    slice->loop = 0;
+  }
+
+  slice->last_run_ns = system_now_ns() - start;
+}
+
+void dump_carried_systems(FILE *f) {
   for (struct system_def **s = ({
          extern struct system_def *__start_system_def_array;
          &__start_system_def_array;
@@ -12,6 +107,14 @@ void run_systems(void) {
          &__stop_system_def_array;
        });
        s++) {
-    (*s)->cb();
+    struct system_slice *slice = (*s)->slice;
+
+    if (slice && slice->ticks_carried) {
+      fprintf(f,
+              "%s: carried over %u ticks, loop=%u cursor=%" PRIu64
+              " last_run=%" PRIu64 "ns budget=%" PRIu64 "ns\n",
+              (*s)->name, slice->ticks_carried, slice->loop, slice->cursor,
+              slice->last_run_ns, slice->budget_ns);
+    }
   }
 }
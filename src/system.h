@@ -1,8 +1,13 @@
 #ifndef __SYSTEM_H_
 #define __SYSTEM_H_
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include "component.h"
 
 // Systems of the entity component system
 
@@ -15,22 +20,226 @@
  *
  * Systems should be registered in an order they will be executed in.
  */
-#define REGISTER_SYSTEM(NAME, ...)                                             \
+#define REGISTER_SYSTEM(NAME, ...) REGISTER_SYSTEM_OPTS(NAME, (), __VA_ARGS__)
+
+/**
+ * Register a system with `struct system_opts` given as a parenthesised list of
+ * designated initialisers, usage:
+ *
+ * REGISTER_SYSTEM_OPTS(plan_ai,
+ *                      (.interval_ns = SYSTEM_HZ(10),
+ *                       .primary = SYSTEM_COMPONENT(brain)),
+ *                      { ... });
+ */
+#define REGISTER_SYSTEM_OPTS(NAME, OPTS, ...)                                  \
   static void system_callback__##NAME(void) { __VA_ARGS__ }                    \
-  static struct system_def NAME = {                                            \
-      .name = #NAME, .id = __COUNTER__, .cb = &system_callback__##NAME};       \
+  static struct system_def NAME = {.name = #NAME,                              \
+                                   .id = __COUNTER__,                          \
+                                   .cb = &system_callback__##NAME,             \
+                                   .opts = {ECS__UNPAREN OPTS}};               \
   static struct system_def *system_ptr__##NAME                                 \
       __attribute__((used, section("system_def_array"))) = &NAME;
 
+/**
+ * Phases of a tick, every system of a phase runs before any of the next one.
+ */
+enum system_phase {
+  SYSTEM_PHASE_PRE_UPDATE = -1,
+  SYSTEM_PHASE_UPDATE = 0,
+  SYSTEM_PHASE_POST_UPDATE = 1,
+};
+
+// max times a fixed rate system runs in one tick to catch up, the rest of the
+// backlog is dropped
+static const uint32_t system_default_max_catch_up = 4;
+
+#define SYSTEM_HZ(N) (1000000000ull / (N))
+
+#define SYSTEM_COMPONENT(NAME) ((const struct component_def *)&(NAME))
+
+/**
+ * When a system runs, zeroed fields take the defaults: every tick in
+ * `SYSTEM_PHASE_UPDATE`.
+ */
+struct system_opts {
+  enum system_phase phase;
+  // run once every `every_ticks` ticks
+  uint32_t every_ticks;
+  // run at a fixed rate instead, as many times per tick as `interval_ns` fits
+  // into the time that passed, up to `max_catch_up` times
+  uint64_t interval_ns;
+  uint32_t max_catch_up;
+  // skip the system when this returns false
+  bool (*run_if)(void);
+  // skip the system while this component has no entities
+  const struct component_def *primary;
+};
+
+enum system_status { SYSTEM_DONE, SYSTEM_YIELD };
+
+/**
+ * State of a resumable system that persists across ticks.
+ *
+ * `cursor` is free for the system to record how far it got, it is what
+ * `FOR_EACH_COMPONENT_SLICED` resumes from. `loop` counts the sliced loops
+ * finished since the system last returned `SYSTEM_DONE`.
+ */
+struct system_slice {
+  const uint64_t budget_ns;
+  enum system_status (*const step)(struct system_slice *slice);
+  uint64_t cursor;
+  uint32_t loop;
+  uint64_t deadline_ns;
+  // ticks in a row the system has yielded with work left
+  uint32_t ticks_carried;
+  uint64_t last_run_ns;
+};
+
 struct system_def {
   const char *const name;
   const uint32_t id;
   void (*const cb)(void);
+  // NULL unless the system is resumable
+  struct system_slice *const slice;
+  const struct system_opts opts;
+  // time and ticks since the system was last due
+  uint64_t accumulator_ns;
+  uint32_t ticks_waited;
 };
 
 /**
- * Run all systems in the program.
+ * Register a resumable system that runs for about `BUDGET_NS` nanoseconds per
+ * tick. The body is given `struct system_slice *slice` and returns
+ * `SYSTEM_YIELD` to be resumed on the next `run_systems`, or `SYSTEM_DONE` once
+ * its work is finished. Usage:
+ *
+ * REGISTER_RESUMABLE_SYSTEM(pathfind, 2000000, {
+ *     FOR_EACH_COMPONENT_SLICED(path_request, r, {
+ *         plan_path(r.id, r.path_request);
+ *     });
+ *     return SYSTEM_DONE;
+ * });
+ */
+#define REGISTER_RESUMABLE_SYSTEM(NAME, BUDGET_NS, ...)                        \
+  REGISTER_RESUMABLE_SYSTEM_OPTS(NAME, BUDGET_NS, (), __VA_ARGS__)
+
+/**
+ * Register a resumable system with `struct system_opts`, see
+ * `REGISTER_SYSTEM_OPTS`.
+ */
+#define REGISTER_RESUMABLE_SYSTEM_OPTS(NAME, BUDGET_NS, OPTS, ...)             \
+  static enum system_status system_step__##NAME(struct system_slice *slice) {  \
+    /* numbers the sliced loops in the order they are reached */               \
+    __attribute__((unused)) uint32_t system__loop = 0;                         \
+    __VA_ARGS__                                                                \
+  }                                                                            \
+  static struct system_slice system_slice__##NAME = {                          \
+      .budget_ns = BUDGET_NS, .step = &system_step__##NAME};                   \
+  static void system_callback__##NAME(void) {                                  \
+    system_slice_run(&system_slice__##NAME);                                   \
+  }                                                                            \
+  static struct system_def NAME = {.name = #NAME,                              \
+                                   .id = __COUNTER__,                          \
+                                   .cb = &system_callback__##NAME,             \
+                                   .slice = &system_slice__##NAME,             \
+                                   .opts = {ECS__UNPAREN OPTS}};               \
+  static struct system_def *system_ptr__##NAME                                 \
+      __attribute__((used, section("system_def_array"))) = &NAME;
+
+// entities visited by `FOR_EACH_COMPONENT_SLICED` between clock reads
+static const uint32_t system_slice_check_interval = 64;
+
+static inline uint64_t system_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Whether a resumable system has used up its budget for this tick.
+ */
+static inline bool system_slice_expired(struct system_slice *slice) {
+  return system_now_ns() >= slice->deadline_ns;
+}
+
+/**
+ * Run one slice of a resumable system, called by its `cb`.
+ */
+void system_slice_run(struct system_slice *slice);
+
+/**
+ * Loop over every entity with a component from inside a resumable system,
+ * making `slice->cursor` the position in the component's table. When the
+ * budget runs out the system returns `SYSTEM_YIELD` and the loop carries on
+ * from the same entity on the next tick, once it gets through the whole table
+ * the cursor goes back to the start and execution continues after the loop.
+ *
+ * A system can run several sliced loops one after another: loops it finished
+ * before yielding are skipped when it resumes, until it returns
+ * `SYSTEM_DONE`. Code outside the loops runs again on every tick, and the
+ * loops must be reached in the same order each time.
+ *
+ * Entities added or deleted while a pass is spread over several ticks may be
+ * missed or visited twice by that pass.
+ *
+ * @param ITER_VAR as for `FOR_JOIN_COMPONENT_1`.
+ */
+#define FOR_EACH_COMPONENT_SLICED(COMP_NAME, ITER_VAR, ...)                    \
+  do {                                                                         \
+    uint32_t system__this_loop = system__loop++;                               \
+    if (slice->loop > system__this_loop) {                                     \
+      break;                                                                   \
+    }                                                                          \
+    uint32_t system__n =                                                       \
+        hash_table_component_##COMP_NAME##_storage__slot_count(                \
+            COMP_NAME.storage);                                                \
+    for (uint32_t system__idx = slice->cursor; system__idx < system__n;        \
+         system__idx++) {                                                      \
+      if (system__idx % system_slice_check_interval == 0 &&                    \
+          system__idx != slice->cursor && system_slice_expired(slice)) {       \
+        slice->cursor = system__idx;                                           \
+        return SYSTEM_YIELD;                                                   \
+      }                                                                        \
+      uint32_t system__k;                                                      \
+      typeof(hash_table_component_##COMP_NAME##_storage__slot(                 \
+          COMP_NAME.storage, 0, NULL)) system__v =                             \
+          hash_table_component_##COMP_NAME##_storage__slot(                    \
+              COMP_NAME.storage, system__idx, &system__k);                     \
+      if (system__v) {                                                         \
+        struct {                                                               \
+          uint32_t id;                                                         \
+          typeof(system__v) COMP_NAME;                                         \
+        } ITER_VAR = {system__k, system__v};                                   \
+        { __VA_ARGS__ }                                                        \
+      }                                                                        \
+    }                                                                          \
+    slice->cursor = 0;                                                         \
+    slice->loop = system__this_loop + 1;                                       \
+  } while (0)
+
+/**
+ * Run one tick of the systems in the program that are due, phase by phase,
+ * then publish the events they emitted with `swap_events`. The time since the
+ * last call drives fixed rate systems.
  */
 void run_systems(void);
 
+/**
+ * `run_systems` for a tick of `dt_ns` nanoseconds, for fixed time steps or
+ * replays.
+ */
+void run_systems_dt(uint64_t dt_ns);
+
+/**
+ * Time the running system should advance by: `interval_ns` for fixed rate
+ * systems, otherwise the time since it last ran.
+ */
+uint64_t system_delta_ns(void);
+
+/**
+ * Write the resumable systems that yielded with work left on the last
+ * `run_systems` to `f`, one line per system.
+ */
+void dump_carried_systems(FILE *f);
+
 #endif // __SYSTEM_H_
@@ -2,19 +2,31 @@
 #define __VEC_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
 #include "common_macros.h"
 
+// returned by `vector_<name>_push` when a vector can't grow
+#define VECTOR_PUSH_FAILED SIZE_MAX
+
+/**
+ * Vectors created with `vector_<name>_from_buffer` use the given memory and
+ * never grow, neither does any vector in ECS_STATIC_STORAGE builds. Pushing
+ * onto a full one of those returns `VECTOR_PUSH_FAILED`.
+ */
 #define DEFINE_VECTOR(TYPE, TNAME)                                             \
   struct vector_##TNAME {                                                      \
     size_t cap;                                                                \
     size_t length;                                                             \
     TYPE *data;                                                                \
+    struct ecs_allocator *alloc;                                               \
   };                                                                           \
   struct vector_##TNAME vector_##TNAME##_new(size_t);                          \
+  struct vector_##TNAME vector_##TNAME##_from_buffer(TYPE *, size_t);          \
   TYPE vector_##TNAME##_pop(struct vector_##TNAME *);                          \
   size_t vector_##TNAME##_push(struct vector_##TNAME *, TYPE);                 \
   TYPE vector_##TNAME##_index(struct vector_##TNAME *, size_t);                \
@@ -27,8 +39,12 @@
 
 #define MAKE_VECTOR(TYPE, TNAME)                                               \
   struct vector_##TNAME vector_##TNAME##_new(size_t initial) {                 \
-    TYPE *data = malloc(sizeof(TYPE) * initial);                               \
-    return (struct vector_##TNAME){initial, 0, data};                          \
+    struct ecs_allocator *alloc = ecs_current_allocator();                     \
+    TYPE *data = ecs_alloc(alloc, sizeof(TYPE) * initial);                     \
+    return (struct vector_##TNAME){initial, 0, data, alloc};                   \
+  }                                                                            \
+  struct vector_##TNAME vector_##TNAME##_from_buffer(TYPE *data, size_t cap) { \
+    return (struct vector_##TNAME){cap, 0, data, NULL};                        \
   }                                                                            \
   TYPE vector_##TNAME##_pop(struct vector_##TNAME *vec) {                      \
     if (DEBUG_ONLY(vec->length == 0)) {                                        \
@@ -40,10 +56,14 @@
   }                                                                            \
   size_t vector_##TNAME##_push(struct vector_##TNAME *vec, TYPE elem) {        \
     if (vec->length >= vec->cap) {                                             \
+      if (ECS_STATIC_STORAGE_ENABLED || vec->alloc == NULL) {                  \
+        return VECTOR_PUSH_FAILED;                                             \
+      }                                                                        \
       size_t new_len = 1 + vec->cap + (vec->cap >> 2);                         \
       DEBUG_LOG("growing vec(%p) from %ld to %ld", (void *)vec, vec->cap,      \
                 new_len);                                                      \
-      vec->data = realloc(vec->data, new_len * sizeof(TYPE));                  \
+      vec->data = ecs_realloc(vec->alloc, vec->data, vec->cap * sizeof(TYPE),  \
+                              new_len * sizeof(TYPE));                         \
       vec->cap = new_len;                                                      \
     }                                                                          \
     size_t inserted_idx = vec->length;                                         \
@@ -70,15 +90,25 @@
     return &vec->data[idx];                                                    \
   }                                                                            \
   void vector_##TNAME##_shrink_to_fit(struct vector_##TNAME *vec) {            \
-    vec->data = realloc(vec->data, vec->length * sizeof(TYPE));                \
+    if (ECS_STATIC_STORAGE_ENABLED || vec->alloc == NULL) {                    \
+      return;                                                                  \
+    }                                                                          \
+    vec->data = ecs_realloc(vec->alloc, vec->data, vec->cap * sizeof(TYPE),    \
+                            vec->length * sizeof(TYPE));                       \
     vec->cap = vec->length;                                                    \
   }                                                                            \
-  void vector_##TNAME##_free(struct vector_##TNAME *vec) { free(vec->data); }  \
+  void vector_##TNAME##_free(struct vector_##TNAME *vec) {                     \
+    if (vec->alloc == NULL) {                                                  \
+      return;                                                                  \
+    }                                                                          \
+    ecs_free(vec->alloc, vec->data, vec->cap * sizeof(TYPE));                  \
+  }                                                                            \
   void vector_##TNAME##_remove(struct vector_##TNAME *vec, size_t idx) {       \
     if (DEBUG_ONLY(idx < 0 || idx >= vec->length)) {                           \
       RUNTIME_ERROR("Indexing vector out of bounds");                          \
     }                                                                          \
-    memmove(&vec->data[idx], &vec->data[idx + 1], vec->length - idx - 1);      \
+    memmove(&vec->data[idx], &vec->data[idx + 1],                              \
+            (vec->length - idx - 1) * sizeof(TYPE));                           \
     vec->length--;                                                             \
   }                                                                            \
   size_t vector_##TNAME##_indexof(struct vector_##TNAME *vec, TYPE val) {      \